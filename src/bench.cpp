@@ -0,0 +1,637 @@
+// ServerMonitorBench: runs ServerMonitor once over generated configurations of local stand-in
+// servers and prints one JSON object per run, so that engines and builds can be compared
+// without any network access.
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <unistd.h>
+
+#include "json.hpp"
+
+#include "poller.hpp"
+
+extern char **environ;
+
+namespace {
+
+    using json = nlohmann::json;
+    using ClockType = std::chrono::steady_clock;
+
+    static const char kDefaultSizes[] = "100,1000,10000";
+    static const char kDefaultScenarios[] = "http,port,cmd,mixed";
+    static const unsigned kDefaultTimeout = 2;
+    static const unsigned kDefaultLatency = 0;
+    // Each stand-in port takes at most this many servers, so that a large run doesn't use up
+    // the ephemeral ports to one address and port with connections in TIME_WAIT.
+    static const size_t kServersPerPort = 2000;
+    static const auto kSampleInterval = std::chrono::milliseconds(5);
+
+    // Kinds of stand-in server, and what a check of one should find.
+    enum class Kind {
+        Http,      // answers every request after the latency
+        HttpError, // answers 500
+        HttpHang,  // reads the request and never answers
+        Port,      // accepts and closes
+        Closed,    // refuses connections
+        Blackhole, // never completes a connection
+        Command,   // a command that succeeds
+        Redis,     // answers PING with +PONG, checked by the sample plugin
+    };
+
+    bool expected_up(Kind kind) {
+        return kind == Kind::Http || kind == Kind::Port || kind == Kind::Command || kind == Kind::Redis;
+    }
+
+    bool set_nonblocking(int fd) {
+        const int flags = ::fcntl(fd, F_GETFL);
+        return flags >= 0 && ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0 && ::fcntl(fd, F_SETFD, FD_CLOEXEC) == 0;
+    }
+
+    // A loopback socket on an ephemeral port. Returns the port.
+    uint16_t bind_loopback(int fd) {
+        struct ::sockaddr_in addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof(addr);
+        if (::bind(fd, reinterpret_cast<struct ::sockaddr*>(&addr), sizeof(addr)) != 0 ||
+            ::getsockname(fd, reinterpret_cast<struct ::sockaddr*>(&addr), &length) != 0) {
+            throw std::runtime_error("Can't bind stand-in socket: " + std::string(::strerror(errno)));
+        }
+        return ntohs(addr.sin_port);
+    }
+
+    // Local servers for every kind of check, served from a thread of their own.
+    class StandIns {
+    public:
+        StandIns(size_t ports_per_kind, unsigned latency_ms)
+            : latency_(std::chrono::milliseconds(latency_ms))
+        {
+            for (auto kind : {Kind::Http, Kind::HttpError, Kind::HttpHang, Kind::Port, Kind::Closed, Kind::Blackhole, Kind::Redis}) {
+                for (size_t i = 0; i < ports_per_kind; ++i) {
+                    open(kind);
+                }
+            }
+            if (!poller_.add(stop_.fd(), Poller::Read, nullptr)) {
+                throw std::runtime_error("Can't poll stand-in sockets: " + std::string(::strerror(errno)));
+            }
+            thread_ = std::thread([this](){
+                run();
+            });
+        }
+
+        ~StandIns() {
+            stopping_ = true;
+            stop_.notify();
+            thread_.join();
+            for (const auto& item : connections_) {
+                (void)::close(item.first);
+            }
+            for (int fd : fds_) {
+                (void)::close(fd);
+            }
+        }
+
+        StandIns(const StandIns&) = delete;
+        StandIns& operator=(const StandIns&) = delete;
+
+        // The port for the index'th server of the kind.
+        uint16_t port(Kind kind, size_t index) const {
+            const auto& ports = ports_.at(static_cast<int>(kind));
+            return ports[index % ports.size()];
+        }
+
+    private:
+        struct Connection {
+            uint64_t id;
+            Kind kind;
+            std::string request;
+            std::string response;
+            size_t sent = 0;
+        };
+
+        struct Delayed {
+            ClockType::time_point due;
+            int fd;
+            uint64_t id;
+        };
+
+        void open(Kind kind) {
+            const int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+            if (fd < 0) {
+                throw std::runtime_error("Can't create stand-in socket: " + std::string(::strerror(errno)));
+            }
+            fds_.push_back(fd);
+            const int on = 1;
+            (void)::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            const uint16_t port = bind_loopback(fd);
+            ports_[static_cast<int>(kind)].push_back(port);
+            if (kind == Kind::Closed) {
+                return; // bound but not listening, so connections are refused
+            }
+            if (kind == Kind::Blackhole) {
+                // Nothing is ever accepted, so once the tiny backlog is full the SYNs of every
+                // later connection are dropped.
+                if (::listen(fd, 0) != 0) {
+                    throw std::runtime_error("Can't listen on stand-in socket: " + std::string(::strerror(errno)));
+                }
+                fill_backlog(port);
+                return;
+            }
+            if (::listen(fd, SOMAXCONN) != 0 || !set_nonblocking(fd) || !poller_.add(fd, Poller::Read, nullptr)) {
+                throw std::runtime_error("Can't listen on stand-in socket: " + std::string(::strerror(errno)));
+            }
+            listeners_[fd] = kind;
+        }
+
+        void fill_backlog(uint16_t port) {
+            struct ::sockaddr_in addr;
+            std::memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            addr.sin_port = htons(port);
+            for (int i = 0; i < 4; ++i) {
+                const int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+                if (fd < 0 || !set_nonblocking(fd)) {
+                    break;
+                }
+                fds_.push_back(fd);
+                (void)::connect(fd, reinterpret_cast<struct ::sockaddr*>(&addr), sizeof(addr));
+            }
+        }
+
+        void close_connection(int fd) {
+            poller_.remove(fd);
+            (void)::close(fd);
+            connections_.erase(fd);
+        }
+
+        void accept_all(int listen_fd, Kind kind) {
+            for (;;) {
+                const int fd = ::accept(listen_fd, nullptr, nullptr);
+                if (fd < 0) {
+                    return;
+                }
+                if (kind == Kind::Port) {
+                    (void)::close(fd);
+                    continue;
+                }
+                if (!set_nonblocking(fd) || !poller_.add(fd, Poller::Read, nullptr)) {
+                    (void)::close(fd);
+                    continue;
+                }
+                std::unique_ptr<Connection> connection{new Connection};
+                connection->id = ++next_id_;
+                connection->kind = kind;
+                connections_[fd] = std::move(connection);
+            }
+        }
+
+        // Returns false once the connection is finished with.
+        bool readable(int fd, Connection& connection) {
+            char buffer[4096];
+            for (;;) {
+                const ssize_t n = ::recv(fd, buffer, sizeof(buffer), 0);
+                if (n > 0) {
+                    connection.request.append(buffer, static_cast<size_t>(n));
+                    continue;
+                }
+                if (n == 0) {
+                    return false;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            if (connection.kind == Kind::Redis) {
+                return answer_commands(fd, connection);
+            }
+            if (connection.kind == Kind::HttpHang || connection.request.find("\r\n\r\n") == std::string::npos || !connection.response.empty()) {
+                return true;
+            }
+            const bool head = connection.request.compare(0, 5, "HEAD ") == 0;
+            const bool close = connection.request.find("Connection: close") != std::string::npos;
+            connection.response = connection.kind == Kind::Http ? "HTTP/1.1 200 OK\r\n" : "HTTP/1.1 500 Internal Server Error\r\n";
+            connection.response += "Content-Length: 2\r\n";
+            connection.response += close ? "Connection: close\r\n\r\n" : "\r\n";
+            if (!head) {
+                connection.response += "ok";
+            }
+            connection.sent = 0;
+            if (latency_.count() > 0) {
+                delayed_.push_back(Delayed{ClockType::now() + latency_, fd, connection.id});
+                return true;
+            }
+            return writable(fd, connection);
+        }
+
+        // Answers each whole line of inline commands, PING with +PONG and anything else with an
+        // error.
+        bool answer_commands(int fd, Connection& connection) {
+            size_t start = 0;
+            size_t end;
+            while ((end = connection.request.find("\r\n", start)) != std::string::npos) {
+                const bool ping = connection.request.compare(start, end - start, "PING") == 0;
+                connection.response += ping ? "+PONG\r\n" : "-ERR unknown command\r\n";
+                start = end + 2;
+            }
+            connection.request.erase(0, start);
+            if (connection.response.empty() || connection.sent > 0) {
+                return true; // the rest goes out once the socket is writable
+            }
+            return writable(fd, connection);
+        }
+
+        bool writable(int fd, Connection& connection) {
+            while (connection.sent < connection.response.size()) {
+#ifdef MSG_NOSIGNAL
+                const ssize_t n = ::send(fd, connection.response.data() + connection.sent, connection.response.size() - connection.sent, MSG_NOSIGNAL);
+#else
+                const ssize_t n = ::send(fd, connection.response.data() + connection.sent, connection.response.size() - connection.sent, 0);
+#endif
+                if (n < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                        return poller_.modify(fd, Poller::Read | Poller::Write, nullptr);
+                    }
+                    return false;
+                }
+                connection.sent += static_cast<size_t>(n);
+            }
+            // Ready for the next request on a kept-alive connection; commands keep any partial one.
+            if (connection.kind != Kind::Redis) {
+                connection.request.clear();
+            }
+            connection.response.clear();
+            connection.sent = 0;
+            return poller_.modify(fd, Poller::Read, nullptr);
+        }
+
+        void respond_due() {
+            const auto now = ClockType::now();
+            while (!delayed_.empty() && delayed_.front().due <= now) {
+                const Delayed delayed = delayed_.front();
+                delayed_.pop_front();
+                const auto iter = connections_.find(delayed.fd);
+                if (iter != connections_.end() && iter->second->id == delayed.id && !writable(delayed.fd, *iter->second)) {
+                    close_connection(delayed.fd);
+                }
+            }
+        }
+
+        void run() {
+            std::vector<Poller::Event> events;
+            while (!stopping_) {
+                int timeout_ms = -1;
+                if (!delayed_.empty()) {
+                    const auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(delayed_.front().due - ClockType::now()).count() + 1;
+                    timeout_ms = static_cast<int>(std::max<long long>(wait, 0));
+                }
+                if (!poller_.wait(events, timeout_ms)) {
+                    break;
+                }
+                for (const auto& event : events) {
+                    if (event.fd == stop_.fd()) {
+                        stop_.drain();
+                        continue;
+                    }
+                    const auto listener = listeners_.find(event.fd);
+                    if (listener != listeners_.end()) {
+                        accept_all(event.fd, listener->second);
+                        continue;
+                    }
+                    const auto iter = connections_.find(event.fd);
+                    if (iter == connections_.end()) {
+                        continue;
+                    }
+                    Connection& connection = *iter->second;
+                    bool open = true;
+                    if ((event.events & Poller::Write) && !connection.response.empty()) {
+                        open = writable(event.fd, connection);
+                    }
+                    if (open && (event.events & (Poller::Read | Poller::Error))) {
+                        open = readable(event.fd, connection);
+                    }
+                    if (!open) {
+                        close_connection(event.fd);
+                    }
+                }
+                respond_due();
+            }
+        }
+
+        const std::chrono::milliseconds latency_;
+        Poller poller_;
+        Notifier stop_;
+        std::atomic<bool> stopping_{false};
+        std::thread thread_;
+        std::vector<int> fds_; // listening, closed and blackhole sockets
+        std::unordered_map<int, std::vector<uint16_t>> ports_; // by Kind
+        std::unordered_map<int, Kind> listeners_;
+        std::unordered_map<int, std::unique_ptr<Connection>> connections_;
+        std::deque<Delayed> delayed_; // in order, as every response waits as long
+        uint64_t next_id_ = 0;
+    };
+
+    // The kind of the index'th server of a scenario.
+    Kind scenario_kind(const std::string& scenario, size_t index) {
+        if (scenario == "http") {
+            return Kind::Http;
+        }
+        if (scenario == "port") {
+            return Kind::Port;
+        }
+        if (scenario == "closed") {
+            return Kind::Closed;
+        }
+        if (scenario == "blackhole") {
+            return Kind::Blackhole;
+        }
+        if (scenario == "hang") {
+            return Kind::HttpHang;
+        }
+        if (scenario == "cmd") {
+            return Kind::Command;
+        }
+        if (scenario == "plugin") {
+            return Kind::Redis;
+        }
+        if (scenario == "mixed") {
+            // Mostly healthy websites, with a few of every way a check can fail.
+            static const Kind kMix[20] = {
+                Kind::Http, Kind::Http, Kind::Http, Kind::Http, Kind::Http,
+                Kind::Http, Kind::Http, Kind::Http, Kind::Http, Kind::Http,
+                Kind::Http, Kind::HttpError, Kind::HttpHang, Kind::Port, Kind::Port,
+                Kind::Port, Kind::Closed, Kind::Blackhole, Kind::Command, Kind::Command,
+            };
+            return kMix[index % 20];
+        }
+        throw std::invalid_argument("Unknown scenario " + scenario);
+    }
+
+    json make_config(const StandIns& standIns, const std::string& scenario, size_t servers, unsigned timeout, const json& settings, size_t& expected) {
+        json config = settings;
+        config["timeout"] = timeout;
+        json list = json::array();
+        expected = 0;
+        for (size_t i = 0; i < servers; ++i) {
+            const Kind kind = scenario_kind(scenario, i);
+            json server;
+            server["name"] = scenario + "-" + std::to_string(i);
+            switch (kind) {
+                case Kind::Http:
+                case Kind::HttpError:
+                case Kind::HttpHang:
+                    server["url"] = "http://127.0.0.1:" + std::to_string(standIns.port(kind, i)) + "/" + std::to_string(i);
+                    break;
+                case Kind::Port:
+                case Kind::Closed:
+                case Kind::Blackhole:
+                    server["host"] = "127.0.0.1";
+                    server["port"] = standIns.port(kind, i);
+                    break;
+                case Kind::Command:
+                    server["cmd"] = "true";
+                    break;
+                case Kind::Redis:
+                    server["plugin"] = SERVERMONITOR_PLUGIN_PATH;
+                    server["options"] = {{"host", "127.0.0.1"}, {"port", standIns.port(kind, i)}};
+                    break;
+            }
+            if (expected_up(kind)) {
+                ++expected;
+            }
+            list.push_back(server);
+        }
+        config["servers"] = list;
+        return config;
+    }
+
+    void write_file(const std::string& path, const json& value) {
+        std::ofstream file(path);
+        file << value;
+        if (!file) {
+            throw std::runtime_error("Can't write " + path);
+        }
+    }
+
+    // Threads of a running process, or 0 where /proc can't tell.
+    unsigned count_threads(pid_t pid) {
+        std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+        std::string line;
+        while (std::getline(status, line)) {
+            if (line.compare(0, 8, "Threads:") == 0) {
+                return static_cast<unsigned>(std::strtoul(line.c_str() + 8, nullptr, 10));
+            }
+        }
+        return 0;
+    }
+
+    double millis(const struct ::timeval& tv) {
+        return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+    }
+
+    // Runs the monitor once over the configuration and measures it.
+    json measure(const std::string& monitor, const std::string& config_path, const std::string& status_path) {
+        posix_spawn_file_actions_t actions;
+        (void)::posix_spawn_file_actions_init(&actions);
+        (void)::posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+        std::vector<char*> argv{const_cast<char*>(monitor.c_str()), const_cast<char*>(config_path.c_str()), const_cast<char*>(status_path.c_str()), nullptr};
+        (void)::unlink(status_path.c_str());
+        const auto start = ClockType::now();
+        pid_t pid;
+        const int error = ::posix_spawn(&pid, monitor.c_str(), &actions, nullptr, argv.data(), environ);
+        (void)::posix_spawn_file_actions_destroy(&actions);
+        if (error != 0) {
+            throw std::runtime_error("Can't run " + monitor + ": " + ::strerror(error));
+        }
+        unsigned peak_threads = 0;
+        int status = 0;
+        struct ::rusage usage;
+        for (;;) {
+            const pid_t reaped = ::wait4(pid, &status, WNOHANG, &usage);
+            if (reaped == pid) {
+                break;
+            }
+            if (reaped < 0 && errno != EINTR) {
+                throw std::runtime_error("Can't wait for " + monitor + ": " + ::strerror(errno));
+            }
+            peak_threads = std::max(peak_threads, count_threads(pid));
+            std::this_thread::sleep_for(kSampleInterval);
+        }
+        const double wall_ms = std::chrono::duration_cast<std::chrono::microseconds>(ClockType::now() - start).count() / 1000.0;
+
+        json result;
+        result["exit_status"] = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+        result["wall_ms"] = wall_ms;
+        result["cpu_user_ms"] = millis(usage.ru_utime);
+        result["cpu_system_ms"] = millis(usage.ru_stime);
+#ifdef __APPLE__
+        result["peak_rss_kb"] = usage.ru_maxrss / 1024;
+#else
+        result["peak_rss_kb"] = usage.ru_maxrss;
+#endif
+        if (peak_threads > 0) {
+            result["peak_threads"] = peak_threads;
+        }
+        return result;
+    }
+
+    size_t count_up(const std::string& status_path) {
+        json status;
+        try {
+            std::ifstream file(status_path);
+            file >> status;
+        } catch (...) {
+            return 0;
+        }
+        size_t up = 0;
+        for (const auto& server : status) {
+            const auto iter = server.find("status");
+            if (iter != server.end() && iter->is_boolean() && iter->get<bool>()) {
+                ++up;
+            }
+        }
+        return up;
+    }
+
+    std::vector<std::string> split(const std::string& list) {
+        std::vector<std::string> items;
+        std::stringstream stream(list);
+        std::string item;
+        while (std::getline(stream, item, ',')) {
+            if (!item.empty()) {
+                items.push_back(item);
+            }
+        }
+        return items;
+    }
+
+    void raise_file_limit() {
+        struct ::rlimit limit;
+        if (::getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+            limit.rlim_cur = limit.rlim_max;
+            (void)::setrlimit(RLIMIT_NOFILE, &limit);
+        }
+    }
+
+    const char kUsage[] =
+        "Usage: ServerMonitorBench [options]\n"
+        "  --monitor <path>      ServerMonitor binary to run (default: the one built alongside)\n"
+        "  --sizes <n,...>       numbers of servers to run with (default: 100,1000,10000)\n"
+        "  --scenarios <s,...>   http, port, closed, blackhole, hang, cmd, plugin or mixed (default: http,port,cmd,mixed)\n"
+        "  --latency <ms>        delay before the HTTP stand-ins answer (default: 0)\n"
+        "  --timeout <seconds>   the \"timeout\" option of every run (default: 2)\n"
+        "  --repeat <n>          runs of each size and scenario (default: 1)\n"
+        "  --set <key>=<json>    any other option for every run, e.g. --set keepalive=true\n"
+        "  --dir <path>          where to write the configurations (default: $TMPDIR or /tmp)\n"
+        "Prints one JSON object per run.";
+}
+
+int main(int argc, const char * argv[]) {
+    try {
+        std::string monitor = SERVERMONITOR_PATH;
+        std::vector<std::string> sizes = split(kDefaultSizes);
+        std::vector<std::string> scenarios = split(kDefaultScenarios);
+        unsigned latency = kDefaultLatency;
+        unsigned timeout = kDefaultTimeout;
+        unsigned repeat = 1;
+        json settings = json::object();
+        const char *tmpdir = std::getenv("TMPDIR");
+        std::string dir = tmpdir && *tmpdir ? tmpdir : "/tmp";
+        for (int argi = 1; argi < argc; ++argi) {
+            const std::string arg{argv[argi]};
+            if (argi + 1 >= argc) {
+                throw std::invalid_argument(kUsage);
+            }
+            const std::string value{argv[++argi]};
+            if (arg == "--monitor") {
+                monitor = value;
+            } else if (arg == "--sizes") {
+                sizes = split(value);
+            } else if (arg == "--scenarios") {
+                scenarios = split(value);
+            } else if (arg == "--latency") {
+                latency = static_cast<unsigned>(std::stoul(value));
+            } else if (arg == "--timeout") {
+                timeout = static_cast<unsigned>(std::stoul(value));
+            } else if (arg == "--repeat") {
+                repeat = static_cast<unsigned>(std::stoul(value));
+            } else if (arg == "--set") {
+                const auto equals = value.find('=');
+                if (equals == std::string::npos) {
+                    throw std::invalid_argument(kUsage);
+                }
+                settings[value.substr(0, equals)] = json::parse(value.substr(equals + 1));
+            } else if (arg == "--dir") {
+                dir = value;
+            } else {
+                throw std::invalid_argument(kUsage);
+            }
+        }
+
+        size_t largest = 0;
+        for (const auto& size : sizes) {
+            largest = std::max<size_t>(largest, std::stoul(size));
+        }
+        for (const auto& scenario : scenarios) {
+            (void)scenario_kind(scenario, 0);
+        }
+
+        raise_file_limit();
+        StandIns standIns((largest + kServersPerPort - 1) / kServersPerPort + 1, latency);
+        const std::string config_path = dir + "/servermonitor-bench-" + std::to_string(::getpid()) + ".json";
+        const std::string status_path = dir + "/servermonitor-bench-" + std::to_string(::getpid()) + "-status.json";
+
+        for (const auto& scenario : scenarios) {
+            for (const auto& size : sizes) {
+                const size_t servers = std::stoul(size);
+                size_t expected = 0;
+                write_file(config_path, make_config(standIns, scenario, servers, timeout, settings, expected));
+                for (unsigned run = 0; run < repeat; ++run) {
+                    json result = measure(monitor, config_path, status_path);
+                    const double wall_ms = result["wall_ms"].get<double>();
+                    const size_t up = count_up(status_path);
+                    result["scenario"] = scenario;
+                    result["servers"] = servers;
+                    result["run"] = run;
+                    result["probes_per_sec"] = wall_ms > 0 ? servers * 1000.0 / wall_ms : 0.0;
+                    result["up"] = up;
+                    result["expected_up"] = expected;
+                    result["ok"] = result["exit_status"].get<int>() == 0 && up == expected;
+                    std::cout << result.dump() << std::endl;
+                }
+            }
+        }
+        (void)::unlink(config_path.c_str());
+        (void)::unlink(status_path.c_str());
+        return EXIT_SUCCESS;
+    } catch (const std::exception& ex) {
+        std::cout << "ERROR: " << ex.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+}
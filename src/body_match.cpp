@@ -0,0 +1,96 @@
+#include "body_match.hpp"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+    // The most of the body a regular expression is searched in when there is no max_bytes, as
+    // it keeps all of it.
+    const size_t kMaxRegexBytes = 1 << 20;
+
+    // libc's memmem skips through the haystack with vectorized scans where the CPU has them.
+    bool contains(const char *haystack, size_t size, const std::string& needle) {
+        return ::memmem(haystack, size, needle.data(), needle.size()) != nullptr;
+    }
+}
+
+BodyPattern::BodyPattern(const std::string& text, bool regex)
+    : text(text)
+{
+    if (regex) {
+        try {
+            this->regex.reset(new std::regex(text, std::regex::ECMAScript | std::regex::optimize));
+        } catch (const std::regex_error& e) {
+            throw std::runtime_error("Invalid regular expression \"" + text + "\": " + e.what());
+        }
+    }
+}
+
+BodyMatcher::BodyMatcher(const BodyPattern *pattern, size_t max_bytes)
+    : pattern_(pattern)
+    , max_bytes_(max_bytes == 0 && pattern && pattern->regex ? kMaxRegexBytes : max_bytes)
+{
+}
+
+bool BodyMatcher::feed(const char *data, size_t size) {
+    if (max_bytes_ > 0) {
+        size = std::min(size, max_bytes_ - received_);
+    }
+    received_ += size;
+    if (pattern_ && !matched_) {
+        if (pattern_->regex) {
+            buffer_.append(data, size);
+            if (buffer_.size() >= searched_ * 2) {
+                searchRegex();
+            }
+        } else {
+            searchLiteral(data, size);
+        }
+    }
+    return !matched_ && (max_bytes_ == 0 || received_ < max_bytes_);
+}
+
+bool BodyMatcher::finish(std::string& errorMessage) {
+    if (!pattern_) {
+        return true;
+    }
+    if (pattern_->regex && !matched_ && buffer_.size() > searched_) {
+        searchRegex();
+    }
+    if (!matched_) {
+        errorMessage = "Body doesn't contain \"" + pattern_->text + "\"";
+        if (max_bytes_ > 0 && received_ >= max_bytes_) {
+            errorMessage += " in the first " + std::to_string(max_bytes_) + " bytes";
+        }
+    }
+    return matched_;
+}
+
+void BodyMatcher::searchLiteral(const char *data, size_t size) {
+    const std::string& needle = pattern_->text;
+    if (needle.empty()) {
+        matched_ = true;
+        return;
+    }
+    // A match can start in the last needle.size() - 1 bytes before this chunk.
+    const size_t keep = needle.size() - 1;
+    buffer_.append(data, std::min(size, keep));
+    if (buffer_.size() >= needle.size() && contains(buffer_.data(), buffer_.size(), needle)) {
+        matched_ = true;
+        return;
+    }
+    if (contains(data, size, needle)) {
+        matched_ = true;
+        return;
+    }
+    if (size >= keep) {
+        buffer_.assign(data + size - keep, keep);
+    } else if (buffer_.size() > keep) {
+        buffer_.erase(0, buffer_.size() - keep);
+    }
+}
+
+void BodyMatcher::searchRegex() {
+    searched_ = buffer_.size();
+    matched_ = std::regex_search(buffer_, *pattern_->regex);
+}
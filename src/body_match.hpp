@@ -0,0 +1,43 @@
+#pragma once
+
+#include <memory>
+#include <regex>
+#include <string>
+
+// What a response body must contain: a literal string, or a match of a regular expression.
+struct BodyPattern {
+    // Throws std::runtime_error for an invalid regular expression.
+    BodyPattern(const std::string& text, bool regex);
+
+    std::string text;
+    std::unique_ptr<const std::regex> regex; // null for a literal
+};
+
+// Looks for a pattern in a body as it arrives in chunks, without keeping the body: a literal
+// only needs the end of the previous chunks for a match across them. A regular expression
+// can't be matched a chunk at a time, so it is searched for in what has arrived whenever
+// that has doubled, and at the end.
+class BodyMatcher {
+public:
+    // Looks at the first max_bytes of the body, or for 0 all of it, but only the first MiB
+    // for a regular expression. Without a pattern the bytes are only counted.
+    BodyMatcher(const BodyPattern *pattern, size_t max_bytes);
+
+    // Takes the next chunk of the body. Returns false once no more is needed, because the
+    // pattern matched or max_bytes have arrived.
+    bool feed(const char *data, size_t size);
+
+    // At the end of the body, or once feed() returned false, whether the pattern matched.
+    bool finish(std::string& errorMessage);
+
+private:
+    void searchLiteral(const char *data, size_t size);
+    void searchRegex();
+
+    const BodyPattern *pattern_;
+    size_t max_bytes_;
+    size_t received_ = 0;
+    bool matched_ = false;
+    std::string buffer_;      // the end of a literal's previous chunks, or a regex's whole body
+    size_t searched_ = 0;     // bytes of buffer_ the regex was last searched for in
+};
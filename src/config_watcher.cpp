@@ -0,0 +1,99 @@
+#include "config_watcher.hpp"
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+namespace {
+    struct FileState {
+        bool exists = false;
+        struct ::timespec mtime{};
+        off_t size = 0;
+        ino_t inode = 0;
+
+        bool operator!=(const FileState& other) const {
+            return exists != other.exists || mtime.tv_sec != other.mtime.tv_sec || mtime.tv_nsec != other.mtime.tv_nsec ||
+                size != other.size || inode != other.inode;
+        }
+    };
+
+    FileState file_state(const std::string& path) {
+        FileState state;
+        struct ::stat st;
+        if (::stat(path.c_str(), &st) == 0) {
+            state.exists = true;
+#ifdef __APPLE__
+            state.mtime = st.st_mtimespec;
+#else
+            state.mtime = st.st_mtim;
+#endif
+            state.size = st.st_size;
+            state.inode = st.st_ino;
+        }
+        return state;
+    }
+}
+
+struct ConfigWatcher::Impl {
+    std::string path;
+    std::string name; // within its directory
+    int fd = -1;      // inotify, where there is one
+    FileState state;  // otherwise, as of the last call
+};
+
+ConfigWatcher::ConfigWatcher(const std::string& path)
+    : impl_(new Impl)
+{
+    impl_->path = path;
+    const auto slash = path.rfind('/');
+    const std::string directory = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    impl_->name = slash == std::string::npos ? path : path.substr(slash + 1);
+#ifdef __linux__
+    impl_->fd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (impl_->fd >= 0 && ::inotify_add_watch(impl_->fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_ATTRIB) < 0) {
+        (void)::close(impl_->fd);
+        impl_->fd = -1;
+    }
+#else
+    (void)directory;
+#endif
+    impl_->state = file_state(path);
+}
+
+ConfigWatcher::~ConfigWatcher()
+{
+    if (impl_->fd >= 0) {
+        (void)::close(impl_->fd);
+    }
+}
+
+bool ConfigWatcher::changed() {
+#ifdef __linux__
+    if (impl_->fd >= 0) {
+        bool changed = false;
+        alignas(struct ::inotify_event) char buffer[4096];
+        for (;;) {
+            const ssize_t n = ::read(impl_->fd, buffer, sizeof(buffer));
+            if (n <= 0) {
+                break; // EAGAIN once every event has been read
+            }
+            for (ssize_t offset = 0; offset < n; ) {
+                const auto event = reinterpret_cast<const struct ::inotify_event*>(buffer + offset);
+                if (event->len > 0 && impl_->name == event->name) {
+                    changed = true;
+                }
+                offset += static_cast<ssize_t>(sizeof(struct ::inotify_event) + event->len);
+            }
+        }
+        return changed;
+    }
+#endif
+    const FileState state = file_state(impl_->path);
+    if (state != impl_->state) {
+        impl_->state = state;
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+// Tells when a file has been written or replaced, by watching its directory with inotify on
+// Linux (so editors that save through a new file and a rename are seen too) and by comparing
+// its modification time, size and inode elsewhere. Never blocks.
+class ConfigWatcher {
+public:
+    explicit ConfigWatcher(const std::string& path);
+    ~ConfigWatcher();
+
+    ConfigWatcher(const ConfigWatcher&) = delete;
+    ConfigWatcher& operator=(const ConfigWatcher&) = delete;
+
+    // Whether the file changed since the last call (or since construction).
+    bool changed();
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl_;
+};
@@ -1,9 +1,20 @@
 #include "curl.hpp"
+#include "resolver.hpp"
 #include <curl/curl.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
 #include <vector>
 
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
 #define HANDLE_CURL_CODE(what) \
     code = (what); \
     if (code != ::CURLE_OK) { \
@@ -29,6 +40,7 @@ namespace {
 
     struct CURLSlist {
         struct ::curl_slist *list = nullptr;
+        CURLSlist() = default;
         CURLSlist(const char *str) {
             append(str);
         }
@@ -57,27 +69,544 @@ CurlGlobal::~CurlGlobal()
     ::curl_global_cleanup();
 }
 
-bool HttpHead(const HttpParams& params, std::string& errorMessage) {
-    CURLHandle handle;
-    handle.value = ::curl_easy_init();
-    if (!handle.value) {
-        errorMessage = "CURL init failed";
+namespace {
+    // Hands a GET's body to the matcher as it arrives and stops the transfer once the outcome
+    // is known, so a large body is neither downloaded in full nor kept.
+    struct BodyReader {
+        BodyReader(::CURL *handle, const HttpParams& params)
+            : handle(handle)
+            , status(params.status)
+            , matcher(params.expectBody.get(), params.maxBodyBytes)
+        {
+        }
+
+        ::CURL *handle;
+        int status;
+        BodyMatcher matcher;
+        bool stopped = false; // by write_body, not an error
+    };
+
+    size_t write_body(char *data, size_t size, size_t nmemb, void *userdata) {
+        BodyReader& reader = *static_cast<BodyReader*>(userdata);
+        const size_t bytes = size * nmemb;
+        if (bytes == 0) {
+            return 0;
+        }
+        // The body of an unexpected response doesn't matter.
+        long http_code = 0;
+        if (curl_easy_getinfo(reader.handle, ::CURLINFO_RESPONSE_CODE, &http_code) == ::CURLE_OK && http_code != reader.status) {
+            reader.stopped = true;
+            return 0;
+        }
+        if (!reader.matcher.feed(data, bytes)) {
+            reader.stopped = true;
+            return 0; // anything but bytes ends the transfer with CURLE_WRITE_ERROR
+        }
+        return bytes;
+    }
+
+    // The reader is needed for a GET and must outlive the transfer.
+    bool setup_request(::CURL *handle, const HttpParams& params, BodyReader *reader, std::string& errorMessage) {
+        ::CURLcode code;
+        if (params.get) {
+            HANDLE_CURL_CODE(curl_easy_setopt(handle, ::CURLOPT_HTTPGET, 1L));
+            HANDLE_CURL_CODE(curl_easy_setopt(handle, ::CURLOPT_WRITEFUNCTION, write_body));
+            HANDLE_CURL_CODE(curl_easy_setopt(handle, ::CURLOPT_WRITEDATA, reader));
+        } else {
+            HANDLE_CURL_CODE(curl_easy_setopt(handle, ::CURLOPT_NOBODY, 1L)); // HEAD request
+        }
+        HANDLE_CURL_CODE(curl_easy_setopt(handle, ::CURLOPT_URL, params.url.c_str()));
+        HANDLE_CURL_CODE(curl_easy_setopt(handle, ::CURLOPT_TIMEOUT, static_cast<long>(params.timeout)));
+        HANDLE_CURL_CODE(curl_easy_setopt(handle, ::CURLOPT_FOLLOWLOCATION, 1L));
+        HANDLE_CURL_CODE(curl_easy_setopt(handle, ::CURLOPT_SSL_VERIFYPEER, params.verifypeer ? 1L : 0L));
+        HANDLE_CURL_CODE(curl_easy_setopt(handle, ::CURLOPT_NOSIGNAL, 1L)); // required when used from multiple threads
+        if (params.keepalive) {
+            HANDLE_CURL_CODE(curl_easy_setopt(handle, ::CURLOPT_HTTP_VERSION, static_cast<long>(CURL_HTTP_VERSION_2TLS)));
+            HANDLE_CURL_CODE(curl_easy_setopt(handle, ::CURLOPT_PIPEWAIT, 1L)); // prefer multiplexing over a new connection
+        } else {
+            // Every check measures a full TCP and TLS handshake
+            HANDLE_CURL_CODE(curl_easy_setopt(handle, ::CURLOPT_FRESH_CONNECT, 1L));
+            HANDLE_CURL_CODE(curl_easy_setopt(handle, ::CURLOPT_FORBID_REUSE, 1L));
+            HANDLE_CURL_CODE(curl_easy_setopt(handle, ::CURLOPT_SSL_SESSIONID_CACHE, 0L));
+        }
+        return true;
+    }
+
+    // Microseconds from the start of the transfer to the given point, or -1.
+    int64_t elapsed_micros(::CURL *handle, ::CURLINFO what) {
+#if LIBCURL_VERSION_NUM >= 0x073d00
+        ::curl_off_t value = 0;
+        if (curl_easy_getinfo(handle, what, &value) != ::CURLE_OK) {
+            return -1;
+        }
+        return static_cast<int64_t>(value);
+#else
+        double value = 0;
+        if (curl_easy_getinfo(handle, what, &value) != ::CURLE_OK) {
+            return -1;
+        }
+        return static_cast<int64_t>(value * 1000000);
+#endif
+    }
+
+    void transfer_info(::CURL *handle, HttpInfo& info) {
+        long connects = 0;
+        if (curl_easy_getinfo(handle, ::CURLINFO_NUM_CONNECTS, &connects) == ::CURLE_OK) {
+            info.reused = connects == 0;
+        }
+#if LIBCURL_VERSION_NUM >= 0x073d00
+        const int64_t namelookup = elapsed_micros(handle, ::CURLINFO_NAMELOOKUP_TIME_T);
+        const int64_t connect = elapsed_micros(handle, ::CURLINFO_CONNECT_TIME_T);
+        const int64_t appconnect = elapsed_micros(handle, ::CURLINFO_APPCONNECT_TIME_T);
+        const int64_t starttransfer = elapsed_micros(handle, ::CURLINFO_STARTTRANSFER_TIME_T);
+#else
+        const int64_t namelookup = elapsed_micros(handle, ::CURLINFO_NAMELOOKUP_TIME);
+        const int64_t connect = elapsed_micros(handle, ::CURLINFO_CONNECT_TIME);
+        const int64_t appconnect = elapsed_micros(handle, ::CURLINFO_APPCONNECT_TIME);
+        const int64_t starttransfer = elapsed_micros(handle, ::CURLINFO_STARTTRANSFER_TIME);
+#endif
+        if (namelookup < 0 || connect < 0 || starttransfer < 0) {
+            return;
+        }
+        // The times are cumulative from the start of the transfer. A reused connection reports
+        // zero for the phases it skipped.
+        info.dns = namelookup;
+        info.connect = std::max<int64_t>(connect - namelookup, 0);
+        int64_t ready = connect;
+        if (appconnect > 0) {
+            info.tls = std::max<int64_t>(appconnect - connect, 0);
+            ready = appconnect;
+        }
+        info.firstByte = std::max<int64_t>(starttransfer - ready, 0);
+    }
+
+    // Whether a transfer that ended with code got a response: it either completed or
+    // write_body stopped it.
+    bool got_response(::CURLcode code, const BodyReader *reader) {
+        return code == ::CURLE_OK || (code == ::CURLE_WRITE_ERROR && reader && reader->stopped);
+    }
+
+    bool check_response(::CURL *handle, const HttpParams& params, BodyReader *reader, ProbeError& error) {
+        long http_code = 0;
+        const ::CURLcode code = curl_easy_getinfo(handle, ::CURLINFO_RESPONSE_CODE, &http_code);
+        if (code != ::CURLE_OK) {
+            error.set(ErrorCode::Other, std::string("CURL error: ") + ::curl_easy_strerror(code));
+            return false;
+        }
+        if (http_code != params.status) {
+            error.set(ErrorCode::Http, "HTTP response code: " + std::to_string(http_code));
+            return false;
+        }
+        std::string errorMessage;
+        if (reader && !reader->matcher.finish(errorMessage)) {
+            error.set(ErrorCode::Body, errorMessage);
+            return false;
+        }
+        return true;
+    }
+
+    // The kind of failure of a transfer that ended with code without a response.
+    ErrorCode transfer_error(::CURLcode code) {
+        switch (code) {
+            case ::CURLE_OPERATION_TIMEDOUT:
+                return ErrorCode::Timeout;
+            case ::CURLE_COULDNT_RESOLVE_PROXY:
+            case ::CURLE_COULDNT_RESOLVE_HOST:
+                return ErrorCode::Dns;
+            case ::CURLE_COULDNT_CONNECT:
+                return ErrorCode::Connect;
+            case ::CURLE_SSL_CONNECT_ERROR:
+            case ::CURLE_PEER_FAILED_VERIFICATION:
+            case ::CURLE_SSL_CERTPROBLEM:
+            case ::CURLE_SSL_CIPHER:
+            case ::CURLE_SSL_ISSUER_ERROR:
+            case ::CURLE_SSL_PINNEDPUBKEYNOTMATCH:
+            case ::CURLE_SSL_INVALIDCERTSTATUS:
+#if LIBCURL_VERSION_NUM < 0x073e00
+            case ::CURLE_SSL_CACERT: // an alias of CURLE_PEER_FAILED_VERIFICATION since 7.62
+#endif
+                return ErrorCode::Tls;
+            case ::CURLE_GOT_NOTHING:
+                return ErrorCode::NoReply;
+            default:
+                return ErrorCode::Other;
+        }
+    }
+}
+
+namespace {
+    // The host and port CURL will connect to for url, so the shared resolver can look up the
+    // host. Fails for IP literals and anything CURL can't parse, which CURL then handles itself.
+    bool url_host_port(const std::string& url, std::string& host, long& port) {
+#if LIBCURL_VERSION_NUM >= 0x073e00
+        struct CURLUrl {
+            ::CURLU *value = ::curl_url();
+            ~CURLUrl() {
+                ::curl_url_cleanup(value);
+            }
+        } curl_url;
+        if (!curl_url.value || ::curl_url_set(curl_url.value, ::CURLUPART_URL, url.c_str(), CURLU_GUESS_SCHEME) != ::CURLUE_OK) {
+            return false;
+        }
+        char *host_part = nullptr;
+        char *port_part = nullptr;
+        bool result = false;
+        if (::curl_url_get(curl_url.value, ::CURLUPART_HOST, &host_part, 0) == ::CURLUE_OK &&
+            ::curl_url_get(curl_url.value, ::CURLUPART_PORT, &port_part, CURLU_DEFAULT_PORT) == ::CURLUE_OK) {
+            host = host_part;
+            port = std::strtol(port_part, nullptr, 10);
+            result = !host.empty() && host[0] != '[' && port > 0;
+        }
+        ::curl_free(host_part);
+        ::curl_free(port_part);
+        return result;
+#else
+        (void)url;
+        (void)host;
+        (void)port;
         return false;
+#endif
     }
-    ::CURLcode code;
-    HANDLE_CURL_CODE(curl_easy_setopt(handle.value, ::CURLOPT_NOBODY, 1L)); // HEAD request
-    HANDLE_CURL_CODE(curl_easy_setopt(handle.value, ::CURLOPT_URL, params.url.c_str()));
-    HANDLE_CURL_CODE(curl_easy_setopt(handle.value, ::CURLOPT_TIMEOUT, static_cast<long>(params.timeout)));
-    HANDLE_CURL_CODE(curl_easy_setopt(handle.value, ::CURLOPT_FOLLOWLOCATION, 1L));
-    HANDLE_CURL_CODE(curl_easy_setopt(handle.value, ::CURLOPT_SSL_VERIFYPEER, params.verifypeer ? 1L : 0L));
-    HANDLE_CURL_CODE(::curl_easy_perform(handle.value));
-    long http_code = 0;
-    HANDLE_CURL_CODE(curl_easy_getinfo(handle.value, ::CURLINFO_RESPONSE_CODE, &http_code));
-    if (http_code != params.status) {
-        errorMessage = "HTTP response code: " + std::to_string(http_code);
+}
+
+struct HttpShare::Impl {
+    ::CURLSH *share = nullptr;
+    std::mutex locks[::CURL_LOCK_DATA_LAST];
+    std::mutex mutex;
+    std::vector<::CURL*> idle;
+
+    static void lock(::CURL*, ::curl_lock_data data, ::curl_lock_access, void *userptr) {
+        static_cast<Impl*>(userptr)->locks[data].lock();
+    }
+
+    static void unlock(::CURL*, ::curl_lock_data data, void *userptr) {
+        static_cast<Impl*>(userptr)->locks[data].unlock();
+    }
+
+    // A handle that uses the share, either from the pool or new.
+    ::CURL* acquire() {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            if (!idle.empty()) {
+                ::CURL *handle = idle.back();
+                idle.pop_back();
+                return handle;
+            }
+        }
+        ::CURL *handle = ::curl_easy_init();
+        if (handle && curl_easy_setopt(handle, ::CURLOPT_SHARE, share) != ::CURLE_OK) {
+            ::curl_easy_cleanup(handle);
+            return nullptr;
+        }
+        return handle;
+    }
+
+    // Returns a handle to the pool. Resetting clears its options but keeps the share.
+    void release(::CURL *handle) {
+        ::curl_easy_reset(handle);
+        if (curl_easy_setopt(handle, ::CURLOPT_SHARE, share) != ::CURLE_OK) {
+            ::curl_easy_cleanup(handle);
+            return;
+        }
+        std::lock_guard<std::mutex> guard(mutex);
+        idle.push_back(handle);
+    }
+};
+
+HttpShare::HttpShare()
+    : impl_(new Impl)
+{
+    impl_->share = ::curl_share_init();
+    if (!impl_->share) {
+        throw std::runtime_error("CURL share init failed");
+    }
+    (void)curl_share_setopt(impl_->share, ::CURLSHOPT_LOCKFUNC, Impl::lock);
+    (void)curl_share_setopt(impl_->share, ::CURLSHOPT_UNLOCKFUNC, Impl::unlock);
+    (void)curl_share_setopt(impl_->share, ::CURLSHOPT_USERDATA, impl_.get());
+    (void)curl_share_setopt(impl_->share, ::CURLSHOPT_SHARE, ::CURL_LOCK_DATA_DNS);
+    (void)curl_share_setopt(impl_->share, ::CURLSHOPT_SHARE, ::CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+    (void)curl_share_setopt(impl_->share, ::CURLSHOPT_SHARE, ::CURL_LOCK_DATA_CONNECT);
+#endif
+}
+
+HttpShare::~HttpShare()
+{
+    for (auto handle : impl_->idle) {
+        ::curl_easy_cleanup(handle);
+    }
+    (void)::curl_share_cleanup(impl_->share);
+}
+
+struct HttpMulti::Impl : EventLoop::Watcher {
+    // A transfer in flight, kept by its check().
+    struct Transfer {
+        ::CURL *handle = nullptr;
+        std::unique_ptr<BodyReader> body; // for a GET
+        CURLSlist resolve; // the shared resolver's answer, handed to CURL
+        long timeout_ms = 0; // what the lookup left of the timeout, if it was looked up
+        ::CURLcode code = ::CURLE_OK;
+        std::string failure; // of the multi handle rather than the transfer
+        std::coroutine_handle<> waiter;
+    };
+
+    // co_await Done{transfer} resumes once CURL has finished the transfer.
+    struct Done {
+        Transfer& transfer;
+
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle) noexcept {
+            transfer.waiter = handle;
+        }
+
+        void await_resume() const noexcept {
+        }
+    };
+
+    Impl(EventLoop& loop, Resolver& resolver, HttpShare& share)
+        : loop(loop)
+        , resolver(resolver)
+        , share(*share.impl_)
+        , limit(loop, std::numeric_limits<size_t>::max())
+    {
+    }
+
+    EventLoop& loop;
+    Resolver& resolver;
+    HttpShare::Impl& share;
+    InFlightLimit limit;
+    ::CURLM *multi = nullptr;
+    std::unordered_map<::CURL*, Transfer*> active;
+    EventLoop::TimerId timer = 0;
+
+    // CURL says which of its sockets to watch for what.
+    static int socket_callback(::CURL*, curl_socket_t fd, int what, void *userp, void*) {
+        Impl& impl = *static_cast<Impl*>(userp);
+        if (what == CURL_POLL_REMOVE) {
+            impl.loop.unwatch(fd);
+            return 0;
+        }
+        unsigned events = 0;
+        if (what & CURL_POLL_IN) {
+            events |= Poller::Read;
+        }
+        if (what & CURL_POLL_OUT) {
+            events |= Poller::Write;
+        }
+        return impl.loop.watch(fd, events, &impl) ? 0 : -1;
+    }
+
+    // CURL says when it next needs to run for its timeouts; -1 for never.
+    static int timer_callback(::CURLM*, long timeout_ms, void *userp) {
+        Impl& impl = *static_cast<Impl*>(userp);
+        if (impl.timer != 0) {
+            impl.loop.cancelTimer(impl.timer);
+            impl.timer = 0;
+        }
+        if (timeout_ms >= 0) {
+            impl.timer = impl.loop.addTimer(EventLoop::ClockType::now() + std::chrono::milliseconds(timeout_ms), [&impl](){
+                impl.timer = 0;
+                impl.action(CURL_SOCKET_TIMEOUT, 0);
+            });
+        }
+        return 0;
+    }
+
+    virtual void ready(int fd, unsigned events) override {
+        int mask = 0;
+        if (events & Poller::Read) {
+            mask |= CURL_CSELECT_IN;
+        }
+        if (events & Poller::Write) {
+            mask |= CURL_CSELECT_OUT;
+        }
+        if (events & Poller::Error) {
+            mask |= CURL_CSELECT_ERR;
+        }
+        action(fd, mask);
+    }
+
+    // Lets CURL act on the socket (or its timeouts), then resumes the checks of the transfers
+    // that finished.
+    void action(curl_socket_t fd, int mask) {
+        int running = 0;
+        const ::CURLMcode mcode = ::curl_multi_socket_action(multi, fd, mask, &running);
+        std::vector<Transfer*> done;
+        if (mcode != ::CURLM_OK && mcode != ::CURLM_BAD_SOCKET) {
+            for (auto& item : active) {
+                (void)::curl_multi_remove_handle(multi, item.first);
+                item.second->failure = std::string("CURL error: ") + ::curl_multi_strerror(mcode);
+                done.push_back(item.second);
+            }
+            active.clear();
+        }
+        int queued = 0;
+        while (::CURLMsg *msg = ::curl_multi_info_read(multi, &queued)) {
+            if (msg->msg != ::CURLMSG_DONE) {
+                continue;
+            }
+            const auto iter = active.find(msg->easy_handle);
+            if (iter == active.end()) {
+                continue;
+            }
+            Transfer& transfer = *iter->second;
+            transfer.code = msg->data.result;
+            active.erase(iter);
+            (void)::curl_multi_remove_handle(multi, transfer.handle);
+            done.push_back(&transfer);
+        }
+        for (auto transfer : done) {
+            transfer->waiter.resume();
+        }
+    }
+
+    // Adds the transfer to the multi handle, or reports why it couldn't be started.
+    bool start(Transfer& transfer, const HttpParams& params, std::string& errorMessage) {
+        transfer.handle = share.acquire();
+        if (!transfer.handle) {
+            errorMessage = "CURL init failed";
+            return false;
+        }
+        if (params.get) {
+            transfer.body.reset(new BodyReader(transfer.handle, params));
+        }
+        ::CURLcode code = ::CURLE_OK;
+        ::CURLMcode mcode = ::CURLM_OK;
+        if (!setup_request(transfer.handle, params, transfer.body.get(), errorMessage)) {
+        } else if (transfer.resolve.get() && (code = curl_easy_setopt(transfer.handle, ::CURLOPT_RESOLVE, transfer.resolve.get())) != ::CURLE_OK) {
+            errorMessage = std::string("CURL error: ") + ::curl_easy_strerror(code);
+        } else if (transfer.timeout_ms > 0 && (code = curl_easy_setopt(transfer.handle, ::CURLOPT_TIMEOUT_MS, transfer.timeout_ms)) != ::CURLE_OK) {
+            errorMessage = std::string("CURL error: ") + ::curl_easy_strerror(code);
+        } else if ((mcode = ::curl_multi_add_handle(multi, transfer.handle)) != ::CURLM_OK) {
+            errorMessage = std::string("CURL error: ") + ::curl_multi_strerror(mcode);
+        } else {
+            active[transfer.handle] = &transfer;
+            return true;
+        }
+        share.release(transfer.handle);
+        transfer.handle = nullptr;
         return false;
     }
-    return true;
+};
+
+namespace {
+    // A CURLOPT_RESOLVE entry for the addresses of host:port, or empty if none could be written.
+    std::string resolve_entry(const std::string& host, long port, const Resolved& resolved) {
+        std::string list;
+        for (const auto& resolved_address : resolved.addresses) {
+            const auto& address = resolved_address.address;
+            char buffer[INET6_ADDRSTRLEN];
+            const void *addr = address.ss_family == AF_INET
+                ? static_cast<const void*>(&reinterpret_cast<const struct ::sockaddr_in&>(address).sin_addr)
+                : static_cast<const void*>(&reinterpret_cast<const struct ::sockaddr_in6&>(address).sin6_addr);
+            if (!::inet_ntop(address.ss_family, addr, buffer, sizeof(buffer))) {
+                continue;
+            }
+            if (!list.empty()) {
+                list += ',';
+            }
+            if (address.ss_family == AF_INET) {
+                list += buffer;
+            } else {
+                list += '[';
+                list += buffer;
+                list += ']';
+            }
+        }
+        if (list.empty()) {
+            return list;
+        }
+        return host + ":" + std::to_string(port) + ":" + list;
+    }
+}
+
+HttpMulti::HttpMulti(EventLoop& loop, Resolver& resolver, HttpShare& share)
+    : impl_(new Impl(loop, resolver, share))
+{
+    impl_->multi = ::curl_multi_init();
+    if (!impl_->multi) {
+        throw std::runtime_error("CURL multi init failed");
+    }
+    (void)curl_multi_setopt(impl_->multi, ::CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    (void)curl_multi_setopt(impl_->multi, ::CURLMOPT_SOCKETFUNCTION, Impl::socket_callback);
+    (void)curl_multi_setopt(impl_->multi, ::CURLMOPT_SOCKETDATA, impl_.get());
+    (void)curl_multi_setopt(impl_->multi, ::CURLMOPT_TIMERFUNCTION, Impl::timer_callback);
+    (void)curl_multi_setopt(impl_->multi, ::CURLMOPT_TIMERDATA, impl_.get());
+}
+
+HttpMulti::~HttpMulti()
+{
+    for (auto& item : impl_->active) {
+        (void)::curl_multi_remove_handle(impl_->multi, item.first);
+        impl_->share.release(item.first);
+        item.second->handle = nullptr;
+    }
+    impl_->active.clear();
+    (void)::curl_multi_cleanup(impl_->multi);
+    if (impl_->timer != 0) {
+        impl_->loop.cancelTimer(impl_->timer);
+    }
+}
+
+void HttpMulti::setMaxInFlight(size_t max_in_flight) {
+    impl_->limit.setMax(max_in_flight);
+}
+
+Task<bool> HttpMulti::check(const HttpParams& params, HttpInfo& info, ProbeError& error) {
+    Impl& impl = *impl_;
+    Impl::Transfer transfer;
+    std::string host;
+    long port = 0;
+    int64_t dns = -1; // time the shared resolver took, in microseconds
+    if (url_host_port(params.url, host, port)) { // otherwise CURL resolves it
+        const auto lookup_started = std::chrono::steady_clock::now();
+        const auto timeout = std::chrono::milliseconds(std::chrono::seconds(params.timeout));
+        const ResolvedPtr resolved = co_await Resolve(impl.loop, impl.resolver, host, lookup_started + timeout);
+        const auto lookup_time = std::chrono::steady_clock::now() - lookup_started;
+        dns = std::chrono::duration_cast<std::chrono::microseconds>(lookup_time).count();
+        if (!resolved) {
+            error.set(ErrorCode::Timeout, "Timed out");
+            co_return false;
+        }
+        if (resolved->addresses.empty()) {
+            error.set(ErrorCode::Dns, resolved->errorMessage);
+            co_return false;
+        }
+        const std::string entry = resolve_entry(host, port, *resolved);
+        if (!entry.empty()) {
+            transfer.resolve.append(entry.c_str());
+        }
+        // At least a millisecond, as 0 would mean no timeout.
+        transfer.timeout_ms = std::max<long>(1, static_cast<long>((timeout - std::chrono::duration_cast<std::chrono::milliseconds>(lookup_time)).count()));
+    }
+
+    // CURL's timeout only starts counting once the transfer is added to the multi handle, so
+    // the wait for a slot doesn't count, but the lookup does.
+    const auto slot = co_await impl.limit.acquire();
+    std::string errorMessage;
+    if (!impl.start(transfer, params, errorMessage)) {
+        error.set(ErrorCode::Other, errorMessage);
+        co_return false;
+    }
+    co_await Impl::Done{transfer};
+
+    bool result = false;
+    if (!transfer.failure.empty()) {
+        error.set(ErrorCode::Other, transfer.failure);
+    } else if (!got_response(transfer.code, transfer.body.get())) {
+        error.set(transfer_error(transfer.code), std::string("CURL error: ") + ::curl_easy_strerror(transfer.code));
+    } else {
+        transfer_info(transfer.handle, info);
+        if (dns >= 0 && info.dns >= 0) {
+            info.dns = dns; // CURL only saw the answer handed to it
+        }
+        result = check_response(transfer.handle, params, transfer.body.get(), error);
+    }
+    impl.share.release(transfer.handle);
+    co_return result;
 }
 
 struct EmailHelper {
@@ -106,12 +635,27 @@ size_t EmailHelper::payload_source(void *ptr, size_t size, size_t nmemb)
     return len;
 }
 
-bool Email(const EmailParams& params, unsigned timeout, std::string& errorMessage) {
+struct SmtpSession::Impl {
     CURLHandle handle;
-    handle.value = ::curl_easy_init();
+    TimeoutType timeout;
+};
+
+SmtpSession::SmtpSession(TimeoutType timeout)
+    : impl_(new Impl)
+{
+    impl_->timeout = timeout;
+}
+
+SmtpSession::~SmtpSession() = default;
+
+bool SmtpSession::send(const EmailParams& params, std::string& errorMessage) {
+    CURLHandle& handle = impl_->handle;
     if (!handle.value) {
-        errorMessage = "CURL init failed";
-        return false;
+        handle.value = ::curl_easy_init();
+        if (!handle.value) {
+            errorMessage = "CURL init failed";
+            return false;
+        }
     }
     ::CURLcode code;
     const CURLSlist recipients(params.to.c_str());
@@ -134,9 +678,16 @@ bool Email(const EmailParams& params, unsigned timeout, std::string& errorMessag
     HANDLE_CURL_CODE(curl_easy_setopt(handle, ::CURLOPT_READDATA, &helper));
     HANDLE_CURL_CODE(curl_easy_setopt(handle, ::CURLOPT_UPLOAD, 1L));
     HANDLE_CURL_CODE(curl_easy_setopt(handle, ::CURLOPT_USE_SSL, static_cast<long>(CURLUSESSL_ALL)));
-    HANDLE_CURL_CODE(curl_easy_setopt(handle.value, ::CURLOPT_TIMEOUT, static_cast<long>(timeout)));
+    HANDLE_CURL_CODE(curl_easy_setopt(handle.value, ::CURLOPT_TIMEOUT, static_cast<long>(impl_->timeout)));
+    HANDLE_CURL_CODE(curl_easy_setopt(handle, ::CURLOPT_NOSIGNAL, 1L));
     HANDLE_CURL_CODE(curl_easy_setopt(handle, ::CURLOPT_VERBOSE, 0L)); // set to 1 to debug connection issues
-    HANDLE_CURL_CODE(::curl_easy_perform(handle));
+    code = ::curl_easy_perform(handle);
+    (void)curl_easy_setopt(handle, ::CURLOPT_MAIL_RCPT, nullptr); // recipients goes out of scope
+    (void)curl_easy_setopt(handle, ::CURLOPT_READDATA, nullptr);
+    if (code != ::CURLE_OK) {
+        errorMessage = std::string("CURL error: ") + ::curl_easy_strerror(code);
+        return false;
+    }
     long response_code = 0;
     HANDLE_CURL_CODE(curl_easy_getinfo(handle.value, ::CURLINFO_RESPONSE_CODE, &response_code));
     if (response_code != 250) {
@@ -145,3 +696,8 @@ bool Email(const EmailParams& params, unsigned timeout, std::string& errorMessag
     }
     return true;
 }
+
+bool Email(const EmailParams& params, unsigned timeout, std::string& errorMessage) {
+    SmtpSession session(timeout);
+    return session.send(params, errorMessage);
+}
@@ -1,8 +1,16 @@
 #pragma once
 
+#include "body_match.hpp"
+#include "error_code.hpp"
+#include "event_loop.hpp"
+#include "task.hpp"
 #include "types.hpp"
+#include <cstdint>
+#include <memory>
 #include <string>
 
+class Resolver;
+
 struct CurlGlobal {
     CurlGlobal();
     ~CurlGlobal();
@@ -19,9 +27,61 @@ struct HttpParams {
     int status; // expected HTTP status, usually 200
     TimeoutType timeout;
     bool verifypeer;
+    bool keepalive; // reuse connections and TLS sessions between checks, HTTP/2 multiplexing
+    bool get = false; // GET rather than HEAD
+    std::shared_ptr<const BodyPattern> expectBody; // what a GET's body must contain, if anything
+    size_t maxBodyBytes = 0; // a GET stops reading the body after this much, 0 for no limit
+};
+
+// Details of a finished transfer beyond its result. Phase times are in microseconds and
+// negative when not measured, e.g. when the transfer failed.
+struct HttpInfo {
+    bool reused = false;    // no new connection was needed
+    int64_t dns = -1;       // host name lookup
+    int64_t connect = -1;   // TCP connect
+    int64_t tls = -1;       // TLS handshake, if any
+    int64_t firstByte = -1; // from the connection being ready to the first byte of the response
 };
 
-bool HttpHead(const HttpParams& params, std::string& errorMessage);
+// What can outlive a single run of checks: a CURL share object holding the DNS cache, TLS
+// sessions and connections, and a pool of easy handles to reuse. Keep one for the life of the
+// process and hand it to every HttpMulti.
+class HttpShare {
+public:
+    HttpShare();
+    ~HttpShare();
+
+    HttpShare(const HttpShare&) = delete;
+    HttpShare& operator=(const HttpShare&) = delete;
+
+private:
+    friend class HttpMulti;
+    struct Impl;
+    std::unique_ptr<Impl> impl_;
+};
+
+// Runs any number of HTTP checks at once on a single curl multi handle driven by an EventLoop,
+// instead of a thread (and a blocking easy handle) each. Host names are looked up through the
+// shared Resolver and passed to CURL via CURLOPT_RESOLVE.
+class HttpMulti {
+public:
+    HttpMulti(EventLoop& loop, Resolver& resolver, HttpShare& share);
+    ~HttpMulti();
+
+    HttpMulti(const HttpMulti&) = delete;
+    HttpMulti& operator=(const HttpMulti&) = delete;
+
+    // Limits how many transfers run at once; the rest wait for a free slot.
+    void setMaxInFlight(size_t max_in_flight);
+
+    // Checks the response status, and for a GET the body as it arrives, completing as soon as
+    // the outcome is known.
+    Task<bool> check(const HttpParams& params, HttpInfo& info, ProbeError& error);
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl_;
+};
 
 struct EmailParams {
     std::string smtp_host;
@@ -34,3 +94,21 @@ struct EmailParams {
 };
 
 bool Email(const EmailParams& params, TimeoutType timeout, std::string& errorMessage);
+
+// Sends several emails over one SMTP connection: CURL keeps the connection of the session's
+// handle open between messages to the same server and reconnects if it was dropped.
+// Not thread safe.
+class SmtpSession {
+public:
+    explicit SmtpSession(TimeoutType timeout);
+    ~SmtpSession();
+
+    SmtpSession(const SmtpSession&) = delete;
+    SmtpSession& operator=(const SmtpSession&) = delete;
+
+    bool send(const EmailParams& params, std::string& errorMessage);
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl_;
+};
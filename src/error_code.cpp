@@ -0,0 +1,27 @@
+#include "error_code.hpp"
+
+const char* error_code_name(ErrorCode code) {
+    switch (code) {
+        case ErrorCode::None:
+            return "none";
+        case ErrorCode::Timeout:
+            return "timeout";
+        case ErrorCode::Dns:
+            return "dns";
+        case ErrorCode::Connect:
+            return "connect";
+        case ErrorCode::Http:
+            return "http";
+        case ErrorCode::Tls:
+            return "tls";
+        case ErrorCode::NoReply:
+            return "no_reply";
+        case ErrorCode::Other:
+            return "other";
+        case ErrorCode::Body:
+            return "body";
+        case ErrorCode::Unreachable:
+            return "unreachable";
+    }
+    return "other";
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <utility>
+
+// Broad kinds of check failure, so failures can be counted and stored without their messages.
+// The values are stored in the history, so only append new ones.
+enum class ErrorCode : uint16_t {
+    None = 0,
+    Timeout,
+    Dns,
+    Connect,
+    Http,
+    Tls,
+    NoReply,
+    Other,
+    Body,
+    Unreachable, // not checked because the server it depends on is down
+};
+
+const size_t kErrorCodeCount = 10;
+
+// Why a probe failed: the kind of failure, set by the engine where it happened, and the
+// message for people.
+struct ProbeError {
+    ErrorCode code = ErrorCode::None;
+    std::string message;
+
+    void set(ErrorCode error_code, std::string error_message) {
+        code = error_code;
+        message = std::move(error_message);
+    }
+};
+
+const char* error_code_name(ErrorCode code);
@@ -0,0 +1,232 @@
+#include "event_loop.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace {
+    // Longest single wait, so a timer far in the future can't overflow it.
+    const int64_t kMaxTimeoutMillis = 3600 * 1000;
+
+    void* to_data(uint64_t id) {
+        return reinterpret_cast<void*>(static_cast<uintptr_t>(id));
+    }
+
+    uint64_t from_data(void *data) {
+        return static_cast<uint64_t>(reinterpret_cast<uintptr_t>(data));
+    }
+}
+
+EventLoop::EventLoop()
+{
+    if (!poller_.add(notifier_.fd(), Poller::Read, nullptr)) {
+        throw std::runtime_error("Can't poll notifier: " + std::string(::strerror(errno)));
+    }
+}
+
+EventLoop::~EventLoop()
+{
+    poller_.remove(notifier_.fd());
+}
+
+bool EventLoop::watch(int fd, unsigned events, Watcher *watcher) {
+    const auto iter = watches_.find(fd);
+    if (iter != watches_.end()) {
+        Watch& watch = iter->second;
+        if (poller_.modify(fd, events, to_data(watch.id))) {
+            watch.watcher = watcher;
+            watch.events = events;
+            return true;
+        }
+        watches_.erase(iter); // closed without being unwatched
+    }
+    const uint64_t id = next_watch_++;
+    if (!poller_.add(fd, events, to_data(id))) {
+        return false;
+    }
+    watches_[fd] = Watch{watcher, events, id};
+    return true;
+}
+
+void EventLoop::unwatch(int fd) {
+    const auto iter = watches_.find(fd);
+    if (iter != watches_.end()) {
+        poller_.remove(fd);
+        watches_.erase(iter);
+    }
+}
+
+EventLoop::TimerId EventLoop::addTimer(ClockType::time_point when, Callback callback) {
+    const TimerId id = next_timer_++;
+    timers_.emplace(id, std::move(callback));
+    timer_queue_.emplace(when, id);
+    return id;
+}
+
+void EventLoop::cancelTimer(TimerId id) {
+    timers_.erase(id);
+}
+
+void EventLoop::post(Callback callback) {
+    bool wake = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        wake = posted_.empty();
+        posted_.push_back(std::move(callback));
+    }
+    if (wake) {
+        notifier_.notify();
+    }
+}
+
+void EventLoop::run() {
+    std::vector<Poller::Event> events;
+    while (pending_ > 0 && !error_) {
+        runPosted();
+        if (pending_ == 0 || error_) {
+            break;
+        }
+        if (!poller_.wait(events, nextTimeout())) {
+            throw std::runtime_error("Poll failed: " + std::string(::strerror(errno)));
+        }
+        for (const auto& event : events) {
+            if (event.fd == notifier_.fd()) {
+                continue; // drained by runPosted()
+            }
+            const auto iter = watches_.find(event.fd);
+            if (iter != watches_.end() && iter->second.id == from_data(event.data)) {
+                iter->second.watcher->ready(event.fd, event.events);
+            }
+        }
+        fireTimers();
+    }
+    if (error_) {
+        std::rethrow_exception(std::exchange(error_, nullptr));
+    }
+}
+
+int EventLoop::nextTimeout() const {
+    if (timer_queue_.empty()) {
+        return -1;
+    }
+    const auto remaining = timer_queue_.top().first - ClockType::now();
+    const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(remaining).count();
+    return ms < 0 ? 0 : static_cast<int>(std::min<int64_t>(ms, kMaxTimeoutMillis) + 1);
+}
+
+void EventLoop::runPosted() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (posted_.empty()) {
+            return;
+        }
+        // Drained before the swap, so the wakeup of a post that finds the queue empty after it
+        // stays for the next round.
+        notifier_.drain();
+        running_.swap(posted_);
+    }
+    // Callbacks may post more, which wait for the next round rather than starving the poller.
+    for (auto& callback : running_) {
+        callback();
+    }
+    running_.clear();
+}
+
+void EventLoop::fireTimers() {
+    const auto now = ClockType::now();
+    // Timers added by the callbacks wait for the next round, even if already due.
+    const TimerId added = next_timer_;
+    while (!timer_queue_.empty() && timer_queue_.top().first <= now && timer_queue_.top().second < added) {
+        const TimerId id = timer_queue_.top().second;
+        timer_queue_.pop();
+        const auto iter = timers_.find(id);
+        if (iter == timers_.end()) {
+            continue; // cancelled
+        }
+        const Callback callback = std::move(iter->second);
+        timers_.erase(iter);
+        callback();
+    }
+}
+
+EventLoop::FdWait EventLoop::wait(std::initializer_list<int> fds, unsigned events, ClockType::time_point deadline) {
+    return FdWait(*this, fds, events, deadline);
+}
+
+EventLoop::FdWait EventLoop::wait(int fd, unsigned events, ClockType::time_point deadline) {
+    return FdWait(*this, {fd}, events, deadline);
+}
+
+EventLoop::Sleep EventLoop::sleepUntil(ClockType::time_point when) {
+    return Sleep(*this, when);
+}
+
+EventLoop::Sleep EventLoop::sleep(ClockType::duration duration) {
+    return Sleep(*this, ClockType::now() + duration);
+}
+
+EventLoop::FdWait::FdWait(EventLoop& loop, std::initializer_list<int> fds, unsigned events, ClockType::time_point deadline)
+    : loop_(loop)
+    , events_(events)
+    , deadline_(deadline)
+{
+    for (int fd : fds) {
+        if (fd >= 0 && count_ < kMaxFds) {
+            fds_[count_++] = fd;
+        }
+    }
+}
+
+bool EventLoop::FdWait::await_suspend(std::coroutine_handle<> handle) {
+    for (size_t i = 0; i < count_; ++i) {
+        if (!loop_.watch(fds_[i], events_, this)) {
+            error_ = errno;
+            for (size_t j = 0; j < i; ++j) {
+                loop_.unwatch(fds_[j]);
+            }
+            return false;
+        }
+    }
+    handle_ = handle;
+    timer_ = loop_.addTimer(deadline_, [this](){
+        timer_ = 0;
+        finish(ETIMEDOUT);
+    });
+    return true;
+}
+
+void EventLoop::FdWait::ready(int, unsigned) {
+    finish(0);
+}
+
+void EventLoop::FdWait::finish(int error) {
+    if (timer_ != 0) {
+        loop_.cancelTimer(timer_);
+    }
+    for (size_t i = 0; i < count_; ++i) {
+        loop_.unwatch(fds_[i]);
+    }
+    error_ = error;
+    handle_.resume(); // last, as it may destroy this
+}
+
+void InFlightLimit::setMax(size_t max) {
+    max_ = max > 0 ? max : 1;
+    while (held_ < max_ && !waiting_.empty()) {
+        ++held_;
+        loop_.resume(waiting_.front());
+        waiting_.pop_front();
+    }
+}
+
+void InFlightLimit::release() {
+    if (!waiting_.empty() && held_ <= max_) {
+        // The slot passes straight to the next in line, resumed from the loop so a chain of
+        // probes finishing at once doesn't nest.
+        loop_.resume(waiting_.front());
+        waiting_.pop_front();
+    } else {
+        --held_;
+    }
+}
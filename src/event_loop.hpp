@@ -0,0 +1,273 @@
+#pragma once
+
+#include "poller.hpp"
+#include "task.hpp"
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <initializer_list>
+#include <mutex>
+#include <queue>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Drives every probe from the one thread that calls run(): it waits for descriptors to become
+// ready, for timers and for work posted from other threads, and calls back or resumes the
+// coroutines (see task.hpp) awaiting them. Not thread safe except for post().
+class EventLoop {
+public:
+    using ClockType = std::chrono::steady_clock;
+    using Callback = std::function<void()>;
+    using TimerId = uint64_t;
+
+    // Told whenever a descriptor it watches is ready.
+    class Watcher {
+    public:
+        virtual void ready(int fd, unsigned events) = 0;
+
+    protected:
+        ~Watcher() = default;
+    };
+
+    class FdWait;
+    class Sleep;
+
+    EventLoop();
+    ~EventLoop();
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    // Watches fd for events (Poller::Read and/or Write; errors are always reported), or
+    // changes what an already watched fd is watched for and by. Returns false with errno set
+    // if it can't be watched.
+    bool watch(int fd, unsigned events, Watcher *watcher);
+
+    // Must be called before a watched fd is closed.
+    void unwatch(int fd);
+
+    // Calls back once, on the loop, at or after when.
+    TimerId addTimer(ClockType::time_point when, Callback callback);
+    void cancelTimer(TimerId id);
+
+    // Calls back on the loop as soon as possible. Safe from any thread, and from the loop
+    // itself to run something after the current callback.
+    void post(Callback callback);
+
+    // Resumes the coroutine from the loop rather than right away.
+    void resume(std::coroutine_handle<> handle) {
+        post([handle](){
+            handle.resume();
+        });
+    }
+
+    // Starts the task, which runs until it first awaits something and then on the loop, and
+    // calls completion with its result once it finishes. run() returns only once every task
+    // spawned has finished, and rethrows any exception one of them let escape.
+    template <typename T, typename Completion>
+    void spawn(Task<T> task, Completion completion) {
+        ++pending_;
+        (void)detach(std::move(task), std::move(completion));
+    }
+
+    // Runs until every task spawned has finished. Throws std::runtime_error if the poller
+    // fails.
+    void run();
+
+    // co_await wait(fd, events, deadline) resumes once any of the descriptors (negative ones
+    // are ignored) is ready for events and yields 0, ETIMEDOUT once the deadline passes, or
+    // the errno from watching them.
+    FdWait wait(std::initializer_list<int> fds, unsigned events, ClockType::time_point deadline);
+    FdWait wait(int fd, unsigned events, ClockType::time_point deadline);
+
+    // co_await sleepUntil(when) resumes at or after when.
+    Sleep sleepUntil(ClockType::time_point when);
+
+    Sleep sleep(ClockType::duration duration);
+
+private:
+    struct Watch {
+        Watcher *watcher;
+        unsigned events;
+        uint64_t id; // handed to the poller, so readiness of a closed fd isn't misdelivered
+    };
+
+    using TimerEntry = std::pair<ClockType::time_point, TimerId>;
+
+    template <typename T, typename Completion>
+    task_detail::Detached detach(Task<T> task, Completion completion) {
+        try {
+            if constexpr (std::is_void_v<T>) {
+                co_await task;
+                completion();
+            } else {
+                completion(co_await task);
+            }
+        } catch (...) {
+            if (!error_) {
+                error_ = std::current_exception();
+            }
+        }
+        --pending_;
+    }
+
+    int nextTimeout() const;
+    void runPosted();
+    void fireTimers();
+
+    Poller poller_;
+    Notifier notifier_;
+    std::unordered_map<int, Watch> watches_;
+    uint64_t next_watch_ = 1;
+    std::priority_queue<TimerEntry, std::vector<TimerEntry>, std::greater<TimerEntry>> timer_queue_;
+    std::unordered_map<TimerId, Callback> timers_; // cancelled ones are left in the queue
+    TimerId next_timer_ = 1;
+    std::mutex mutex_;
+    std::vector<Callback> posted_;
+    std::vector<Callback> running_;
+    size_t pending_ = 0;
+    std::exception_ptr error_;
+};
+
+class EventLoop::FdWait : private EventLoop::Watcher {
+public:
+    static const size_t kMaxFds = 3;
+
+    FdWait(EventLoop& loop, std::initializer_list<int> fds, unsigned events, ClockType::time_point deadline);
+
+    FdWait(const FdWait&) = delete;
+    FdWait& operator=(const FdWait&) = delete;
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle);
+
+    int await_resume() const noexcept {
+        return error_;
+    }
+
+private:
+    virtual void ready(int fd, unsigned events) override;
+    void finish(int error);
+
+    EventLoop& loop_;
+    int fds_[kMaxFds];
+    size_t count_ = 0;
+    unsigned events_;
+    ClockType::time_point deadline_;
+    TimerId timer_ = 0;
+    std::coroutine_handle<> handle_;
+    int error_ = 0;
+};
+
+class EventLoop::Sleep {
+public:
+    Sleep(EventLoop& loop, ClockType::time_point when)
+        : loop_(loop)
+        , when_(when)
+    {
+    }
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> handle) {
+        (void)loop_.addTimer(when_, [handle](){
+            handle.resume();
+        });
+    }
+
+    void await_resume() const noexcept {
+    }
+
+private:
+    EventLoop& loop_;
+    ClockType::time_point when_;
+};
+
+// Limits how many tasks on one loop hold a slot at once, e.g. probes of one kind in flight;
+// the rest wait their turn in order. auto slot = co_await limit.acquire() holds one until the
+// slot goes out of scope.
+class InFlightLimit {
+public:
+    class Slot {
+    public:
+        explicit Slot(InFlightLimit *limit)
+            : limit_(limit)
+        {
+        }
+
+        Slot(Slot&& other) noexcept
+            : limit_(std::exchange(other.limit_, nullptr))
+        {
+        }
+
+        Slot(const Slot&) = delete;
+        Slot& operator=(const Slot&) = delete;
+        Slot& operator=(Slot&&) = delete;
+
+        ~Slot() {
+            if (limit_) {
+                limit_->release();
+            }
+        }
+
+    private:
+        InFlightLimit *limit_;
+    };
+
+    class Acquire {
+    public:
+        explicit Acquire(InFlightLimit& limit)
+            : limit_(limit)
+        {
+        }
+
+        bool await_ready() const noexcept {
+            if (limit_.held_ < limit_.max_) {
+                ++limit_.held_;
+                return true;
+            }
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle) {
+            limit_.waiting_.push_back(handle);
+        }
+
+        Slot await_resume() const noexcept {
+            return Slot(&limit_);
+        }
+
+    private:
+        InFlightLimit& limit_;
+    };
+
+    InFlightLimit(EventLoop& loop, size_t max)
+        : loop_(loop)
+        , max_(max > 0 ? max : 1)
+    {
+    }
+
+    void setMax(size_t max);
+
+    Acquire acquire() {
+        return Acquire(*this);
+    }
+
+private:
+    void release();
+
+    EventLoop& loop_;
+    size_t max_;
+    size_t held_ = 0;
+    std::deque<std::coroutine_handle<>> waiting_;
+};
@@ -0,0 +1,589 @@
+#include "history.hpp"
+#include "error_code.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+    const char kMagic[8] = {'S', 'M', 'H', 'I', 'S', 'T', '\0', '\1'};
+    const uint64_t kSegmentRecords = 1 << 18; // 6 MB of records per segment
+    const int64_t kSegmentSpan = 86400;       // a segment is sealed once it covers a day
+    const char kSegmentSuffix[] = ".seg";
+    const char kTempSuffix[] = ".tmp";
+
+    struct SegmentHeader {
+        char magic[8];
+        uint32_t level;       // 0 for full resolution, 1 for downsampled
+        uint32_t parts;       // downsampled segments written for the same sources; 0 in older ones
+        uint64_t capacity;    // records the file has room for
+        uint64_t count;       // records written, only raised once they are in place
+        int64_t minTime;
+        int64_t maxTime;
+        uint64_t sourceFirst; // sequence numbers of the segments a downsampled one replaces
+        uint64_t sourceLast;
+    };
+
+    static_assert(sizeof(SegmentHeader) == 64, "SegmentHeader is stored as is");
+
+    std::string errno_string() {
+        return std::string(::strerror(errno));
+    }
+
+    std::string segment_name(uint64_t sequence) {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%010llu", static_cast<unsigned long long>(sequence));
+        return name + std::string(kSegmentSuffix);
+    }
+
+    bool ends_with(const std::string& text, const char *suffix) {
+        const size_t length = std::strlen(suffix);
+        return text.size() > length && text.compare(text.size() - length, length, suffix) == 0;
+    }
+
+    // A segment file mapped into memory: a header followed by capacity records.
+    class Segment {
+    public:
+        static std::unique_ptr<Segment> create(const std::string& path, uint64_t sequence, uint32_t level, uint64_t capacity) {
+            std::unique_ptr<Segment> segment{new Segment(path, sequence)};
+            segment->fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (segment->fd_ < 0) {
+                throw std::runtime_error("Can't create history segment " + path + ": " + errno_string());
+            }
+            segment->size_ = sizeof(SegmentHeader) + capacity * sizeof(HistoryRecord);
+            if (::ftruncate(segment->fd_, static_cast<off_t>(segment->size_)) != 0) {
+                throw std::runtime_error("Can't size history segment " + path + ": " + errno_string());
+            }
+            segment->map(true);
+            SegmentHeader& header = segment->header();
+            std::memcpy(header.magic, kMagic, sizeof(kMagic));
+            header.level = level;
+            header.parts = 0;
+            header.capacity = capacity;
+            header.count = 0;
+            header.minTime = 0;
+            header.maxTime = 0;
+            header.sourceFirst = 0;
+            header.sourceLast = 0;
+            return segment;
+        }
+
+        // Returns null for files that aren't complete segments.
+        static std::unique_ptr<Segment> open(const std::string& path, uint64_t sequence, bool writable) {
+            std::unique_ptr<Segment> segment{new Segment(path, sequence)};
+            segment->fd_ = ::open(path.c_str(), (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+            if (segment->fd_ < 0) {
+                throw std::runtime_error("Can't open history segment " + path + ": " + errno_string());
+            }
+            struct ::stat st;
+            if (::fstat(segment->fd_, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(SegmentHeader)) {
+                return nullptr;
+            }
+            segment->size_ = static_cast<size_t>(st.st_size);
+            segment->map(writable);
+            const SegmentHeader& header = segment->header();
+            if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+                sizeof(SegmentHeader) + header.capacity * sizeof(HistoryRecord) > segment->size_ ||
+                header.count > header.capacity) {
+                return nullptr;
+            }
+            return segment;
+        }
+
+        ~Segment() {
+            if (data_) {
+                (void)::munmap(data_, size_);
+            }
+            if (fd_ >= 0) {
+                (void)::close(fd_);
+            }
+        }
+
+        Segment(const Segment&) = delete;
+        Segment& operator=(const Segment&) = delete;
+
+        const std::string& path() const {
+            return path_;
+        }
+
+        uint64_t sequence() const {
+            return sequence_;
+        }
+
+        SegmentHeader& header() {
+            return *static_cast<SegmentHeader*>(data_);
+        }
+
+        const SegmentHeader& header() const {
+            return *static_cast<const SegmentHeader*>(data_);
+        }
+
+        HistoryRecord* records() {
+            return reinterpret_cast<HistoryRecord*>(static_cast<char*>(data_) + sizeof(SegmentHeader));
+        }
+
+        const HistoryRecord* records() const {
+            return reinterpret_cast<const HistoryRecord*>(static_cast<const char*>(data_) + sizeof(SegmentHeader));
+        }
+
+        uint64_t space() const {
+            return header().capacity - header().count;
+        }
+
+        void append(const HistoryRecord *records, uint64_t count) {
+            SegmentHeader& h = header();
+            std::memcpy(this->records() + h.count, records, count * sizeof(HistoryRecord));
+            for (uint64_t i = 0; i < count; ++i) {
+                const int64_t time = records[i].time;
+                if (h.count == 0 && i == 0) {
+                    h.minTime = h.maxTime = time;
+                } else {
+                    h.minTime = std::min(h.minTime, time);
+                    h.maxTime = std::max(h.maxTime, time);
+                }
+            }
+            h.count += count;
+        }
+
+        void sync(bool wait) {
+            (void)::msync(data_, size_, wait ? MS_SYNC : MS_ASYNC);
+        }
+
+    private:
+        Segment(const std::string& path, uint64_t sequence)
+            : path_(path)
+            , sequence_(sequence)
+        {
+        }
+
+        void map(bool writable) {
+            void *data = ::mmap(nullptr, size_, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd_, 0);
+            if (data == MAP_FAILED) {
+                throw std::runtime_error("Can't map history segment " + path_ + ": " + errno_string());
+            }
+            data_ = data;
+        }
+
+        std::string path_;
+        uint64_t sequence_;
+        int fd_ = -1;
+        void *data_ = nullptr;
+        size_t size_ = 0;
+    };
+
+    using SegmentPtr = std::unique_ptr<Segment>;
+
+    // Running totals for one server and period while downsampling.
+    struct Period {
+        uint64_t durationSum = 0;
+        uint32_t checks = 0;
+        uint32_t up = 0;
+        int64_t errorTime = 0;
+        uint16_t error = 0;
+    };
+
+    struct PeriodKeyHash {
+        size_t operator()(const std::pair<int64_t, uint32_t>& key) const {
+            return std::hash<uint64_t>()(static_cast<uint64_t>(key.first) * 0x9e3779b97f4a7c15ull ^ key.second);
+        }
+    };
+}
+
+struct HistoryStore::Impl {
+    HistoryOptions options;
+    int lock_fd = -1;
+    std::vector<SegmentPtr> segments; // by sequence number
+    Segment *active = nullptr;        // the full-resolution segment being appended to
+    uint64_t next_sequence = 1;
+    std::vector<std::string> names;
+    std::unordered_map<std::string, uint32_t> ids;
+
+    std::string path(const std::string& name) const {
+        return options.path + "/" + name;
+    }
+
+    void lock() {
+        lock_fd = ::open(path("lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (lock_fd < 0) {
+            throw std::runtime_error("Can't open history lock: " + errno_string());
+        }
+        if (::flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+            throw std::runtime_error("History " + options.path + " is in use by another process");
+        }
+    }
+
+    void load_names() {
+        std::ifstream input{path("servers")};
+        std::string name;
+        while (std::getline(input, name)) {
+            ids.emplace(name, static_cast<uint32_t>(names.size()));
+            names.push_back(name);
+        }
+    }
+
+    void load_segments() {
+        DIR *dir = ::opendir(options.path.c_str());
+        if (!dir) {
+            throw std::runtime_error("Can't open history " + options.path + ": " + errno_string());
+        }
+        std::vector<std::pair<uint64_t, std::string>> files;
+        while (const struct ::dirent *entry = ::readdir(dir)) {
+            const std::string name = entry->d_name;
+            if (!options.readOnly && ends_with(name, kTempSuffix)) {
+                (void)::unlink(path(name).c_str()); // an interrupted compaction
+                continue;
+            }
+            if (!ends_with(name, kSegmentSuffix)) {
+                continue;
+            }
+            char *end = nullptr;
+            const uint64_t sequence = std::strtoull(name.c_str(), &end, 10);
+            if (end != name.c_str() + name.size() - std::strlen(kSegmentSuffix)) {
+                continue;
+            }
+            files.emplace_back(sequence, name);
+        }
+        ::closedir(dir);
+        std::sort(files.begin(), files.end());
+
+        for (const auto& file : files) {
+            next_sequence = std::max(next_sequence, file.first + 1);
+            SegmentPtr segment = Segment::open(path(file.second), file.first, !options.readOnly);
+            if (segment) {
+                segments.push_back(std::move(segment));
+            }
+        }
+
+        // Full-resolution segments already replaced by downsampled ones, if the compaction that
+        // wrote them was interrupted before removing them. Only once every part it wrote is in
+        // place; otherwise the parts that are go instead, and the sources are compacted again.
+        struct Replaced {
+            uint64_t first;
+            uint64_t last;
+            uint32_t parts;
+            uint32_t found;
+        };
+        std::vector<Replaced> ranges;
+        for (const auto& segment : segments) {
+            const SegmentHeader& header = segment->header();
+            if (header.level != 1) {
+                continue;
+            }
+            auto range = std::find_if(ranges.begin(), ranges.end(), [&header](const Replaced& range) {
+                return range.first == header.sourceFirst && range.last == header.sourceLast;
+            });
+            if (range == ranges.end()) {
+                range = ranges.insert(ranges.end(), Replaced{header.sourceFirst, header.sourceLast, header.parts, 0});
+            }
+            ++range->found;
+        }
+        std::vector<std::pair<uint64_t, uint64_t>> replaced;
+        for (const auto& range : ranges) {
+            if (range.found >= range.parts) {
+                replaced.emplace_back(range.first, range.last);
+            }
+        }
+        segments.erase(std::remove_if(segments.begin(), segments.end(), [this, &ranges](const SegmentPtr& segment) {
+            const SegmentHeader& header = segment->header();
+            if (header.level != 1) {
+                return false;
+            }
+            for (const auto& range : ranges) {
+                if (range.first == header.sourceFirst && range.last == header.sourceLast && range.found < range.parts) {
+                    if (!options.readOnly) {
+                        (void)::unlink(segment->path().c_str());
+                    }
+                    return true;
+                }
+            }
+            return false;
+        }), segments.end());
+        segments.erase(std::remove_if(segments.begin(), segments.end(), [this, &replaced](const SegmentPtr& segment) {
+            if (segment->header().level != 0) {
+                return false;
+            }
+            for (const auto& range : replaced) {
+                if (segment->sequence() >= range.first && segment->sequence() <= range.second) {
+                    if (!options.readOnly) {
+                        (void)::unlink(segment->path().c_str());
+                    }
+                    return true;
+                }
+            }
+            return false;
+        }), segments.end());
+
+        for (auto iter = segments.rbegin(); iter != segments.rend(); ++iter) {
+            if ((*iter)->header().level == 0) {
+                if ((*iter)->space() > 0) {
+                    active = iter->get();
+                }
+                break;
+            }
+        }
+    }
+
+    Segment& add_segment(uint32_t level, uint64_t capacity) {
+        const uint64_t sequence = next_sequence++;
+        segments.push_back(Segment::create(path(segment_name(sequence)), sequence, level, capacity));
+        return *segments.back();
+    }
+
+    // The segment to append to, starting a new one when the current one is full or spans
+    // enough time to be compacted on its own.
+    Segment& writable(int64_t time) {
+        if (active && (active->space() == 0 || (active->header().count > 0 && time - active->header().minTime >= kSegmentSpan))) {
+            active->sync(false);
+            active = nullptr;
+        }
+        if (!active) {
+            active = &add_segment(0, kSegmentRecords);
+        }
+        return *active;
+    }
+
+    void drop(const std::vector<Segment*>& dropped) {
+        for (auto segment : dropped) {
+            (void)::unlink(segment->path().c_str());
+        }
+        segments.erase(std::remove_if(segments.begin(), segments.end(), [&dropped](const SegmentPtr& segment) {
+            return std::find(dropped.begin(), dropped.end(), segment.get()) != dropped.end();
+        }), segments.end());
+    }
+
+    void downsample(const std::vector<Segment*>& sources) {
+        const int64_t period = std::max<int64_t>(options.period, 1);
+        std::unordered_map<std::pair<int64_t, uint32_t>, Period, PeriodKeyHash> periods; // by start and server
+        std::vector<HistoryRecord> output;
+        auto emit = [&output](int64_t start, uint32_t server, const Period& totals) {
+            HistoryRecord record;
+            std::memset(&record, 0, sizeof(record));
+            record.time = start;
+            record.server = server;
+            record.duration = static_cast<uint32_t>(totals.durationSum / totals.checks);
+            record.checks = static_cast<uint16_t>(totals.checks);
+            record.up = static_cast<uint16_t>(totals.up);
+            record.error = totals.error;
+            output.push_back(record);
+        };
+        for (auto segment : sources) {
+            const HistoryRecord *records = segment->records();
+            const uint64_t count = segment->header().count;
+            for (uint64_t i = 0; i < count; ++i) {
+                const HistoryRecord& record = records[i];
+                int64_t start = record.time - record.time % period;
+                if (record.time < 0 && record.time % period != 0) {
+                    start -= period;
+                }
+                Period& totals = periods[std::make_pair(start, record.server)];
+                if (totals.checks + record.checks > UINT16_MAX) {
+                    emit(start, record.server, totals);
+                    totals = Period();
+                }
+                totals.checks += record.checks;
+                totals.up += record.up;
+                totals.durationSum += static_cast<uint64_t>(record.duration) * record.checks;
+                if (record.error != static_cast<uint16_t>(ErrorCode::None) && record.time >= totals.errorTime) {
+                    totals.error = record.error;
+                    totals.errorTime = record.time;
+                }
+            }
+        }
+        for (const auto& item : periods) {
+            if (item.second.checks > 0) {
+                emit(item.first.first, item.first.second, item.second);
+            }
+        }
+        std::sort(output.begin(), output.end(), [](const HistoryRecord& a, const HistoryRecord& b) {
+            return a.time != b.time ? a.time < b.time : a.server < b.server;
+        });
+
+        // Every part is written under a temporary name, and all are renamed once complete,
+        // then the sources go. The header's source range and number of parts let
+        // load_segments() finish the job after a crash, or undo it if some parts are missing.
+        const uint64_t first = sources.front()->sequence();
+        const uint64_t last = sources.back()->sequence();
+        const uint32_t parts = static_cast<uint32_t>(std::max<uint64_t>((output.size() + kSegmentRecords - 1) / kSegmentRecords, 1));
+        std::vector<uint64_t> sequences;
+        size_t written = 0;
+        for (uint32_t part = 0; part < parts; ++part) {
+            const uint64_t count = std::min<uint64_t>(output.size() - written, kSegmentRecords);
+            const uint64_t sequence = next_sequence++;
+            SegmentPtr segment = Segment::create(path(segment_name(sequence)) + kTempSuffix, sequence, 1, std::max<uint64_t>(count, 1));
+            segment->header().parts = parts;
+            segment->header().sourceFirst = first;
+            segment->header().sourceLast = last;
+            if (count > 0) {
+                segment->append(output.data() + written, count);
+            }
+            segment->sync(true);
+            sequences.push_back(sequence);
+            written += count;
+        }
+        for (size_t i = 0; i < sequences.size(); ++i) {
+            const std::string final_path = path(segment_name(sequences[i]));
+            const std::string temp_path = final_path + kTempSuffix;
+            if (::rename(temp_path.c_str(), final_path.c_str()) != 0) {
+                const std::string error = errno_string();
+                for (size_t j = i; j < sequences.size(); ++j) {
+                    (void)::unlink((path(segment_name(sequences[j])) + kTempSuffix).c_str());
+                }
+                throw std::runtime_error("Can't rename history segment " + temp_path + ": " + error);
+            }
+        }
+        for (uint64_t sequence : sequences) {
+            segments.push_back(Segment::open(path(segment_name(sequence)), sequence, true));
+        }
+
+        drop(sources);
+        std::sort(segments.begin(), segments.end(), [](const SegmentPtr& a, const SegmentPtr& b) {
+            return a->sequence() < b->sequence();
+        });
+    }
+};
+
+HistoryStore::HistoryStore(const HistoryOptions& options)
+    : impl_(new Impl)
+{
+    impl_->options = options;
+    if (!options.readOnly) {
+        if (::mkdir(options.path.c_str(), 0755) != 0 && errno != EEXIST) {
+            throw std::runtime_error("Can't create history " + options.path + ": " + errno_string());
+        }
+        impl_->lock();
+    }
+    impl_->load_names();
+    impl_->load_segments();
+}
+
+HistoryStore::~HistoryStore()
+{
+    if (impl_->active) {
+        impl_->active->sync(false);
+    }
+    impl_->segments.clear();
+    if (impl_->lock_fd >= 0) {
+        (void)::close(impl_->lock_fd);
+    }
+}
+
+uint32_t HistoryStore::serverId(const std::string& name) {
+    // Keyed by the name as stored, one per line, so the id is the same after a restart.
+    std::string line = name;
+    std::replace(line.begin(), line.end(), '\n', ' ');
+    const auto iter = impl_->ids.find(line);
+    if (iter != impl_->ids.end()) {
+        return iter->second;
+    }
+    if (impl_->options.readOnly) {
+        throw std::runtime_error("History is read only");
+    }
+    std::ofstream output{impl_->path("servers"), std::ios::app};
+    output << line << '\n';
+    output.flush();
+    if (!output) {
+        throw std::runtime_error("Can't write history server names");
+    }
+    const uint32_t id = static_cast<uint32_t>(impl_->names.size());
+    impl_->ids.emplace(line, id);
+    impl_->names.push_back(std::move(line));
+    return id;
+}
+
+size_t HistoryStore::serverCount() const {
+    return impl_->names.size();
+}
+
+const std::string& HistoryStore::serverName(uint32_t id) const {
+    static const std::string empty;
+    return id < impl_->names.size() ? impl_->names[id] : empty;
+}
+
+void HistoryStore::append(const std::vector<HistoryRecord>& records) {
+    if (impl_->options.readOnly) {
+        throw std::runtime_error("History is read only");
+    }
+    size_t written = 0;
+    while (written < records.size()) {
+        Segment& segment = impl_->writable(records[written].time);
+        const uint64_t count = std::min<uint64_t>(segment.space(), records.size() - written);
+        segment.append(records.data() + written, count);
+        written += count;
+    }
+}
+
+void HistoryStore::compact(int64_t now) {
+    Impl& impl = *impl_;
+    if (impl.options.readOnly) {
+        return;
+    }
+
+    std::vector<Segment*> expired;
+    for (const auto& segment : impl.segments) {
+        if (segment.get() != impl.active && segment->header().maxTime < now - impl.options.retention) {
+            expired.push_back(segment.get());
+        }
+    }
+    if (!expired.empty()) {
+        impl.drop(expired);
+    }
+
+    // The oldest run of sealed full-resolution segments entirely past rawAge, so the ones in
+    // between their sequence numbers are exactly the ones replaced.
+    std::vector<Segment*> sources;
+    for (const auto& segment : impl.segments) {
+        if (segment->header().level != 0) {
+            continue;
+        }
+        if (segment.get() == impl.active || segment->header().maxTime >= now - impl.options.rawAge) {
+            break;
+        }
+        sources.push_back(segment.get());
+    }
+    if (!sources.empty()) {
+        impl.downsample(sources);
+    }
+}
+
+void HistoryStore::report(int64_t from, int64_t to, int64_t bucket, std::vector<std::vector<HistorySummary>>& result) const {
+    const int64_t length = std::max<int64_t>(bucket, 1);
+    const size_t buckets = to > from ? static_cast<size_t>((to - from + length - 1) / length) : 0;
+    result.assign(impl_->names.size(), std::vector<HistorySummary>(buckets));
+    if (buckets == 0) {
+        return;
+    }
+    for (const auto& segment : impl_->segments) {
+        const SegmentHeader& header = segment->header();
+        if (header.count == 0 || header.maxTime < from || header.minTime >= to) {
+            continue;
+        }
+        const HistoryRecord *records = segment->records();
+        for (uint64_t i = 0; i < header.count; ++i) {
+            const HistoryRecord& record = records[i];
+            if (record.time < from || record.time >= to || record.server >= result.size()) {
+                continue;
+            }
+            result[record.server][static_cast<size_t>((record.time - from) / length)].add(record);
+        }
+    }
+}
+
+void HistoryStore::flush() {
+    if (impl_->active) {
+        impl_->active->sync(false);
+    }
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// One stored check result, or a downsampled period of them. Records have a fixed size so
+// segments can be appended to and scanned in place.
+struct HistoryRecord {
+    int64_t time;      // Unix time the check started, or the start of a downsampled period
+    uint32_t server;   // HistoryStore::serverId()
+    uint32_t duration; // microseconds; the mean over the period for downsampled records
+    uint16_t checks;   // how many checks the record stands for
+    uint16_t up;       // how many of them were up
+    uint16_t error;    // ErrorCode of the latest failure, or ErrorCode::None
+    uint16_t reserved;
+};
+
+static_assert(sizeof(HistoryRecord) == 24, "HistoryRecord is stored as is");
+
+struct HistoryOptions {
+    std::string path;               // directory of the store, created if missing
+    int64_t rawAge = 7 * 86400;     // seconds records are kept at full resolution
+    int64_t retention = 90 * 86400; // seconds records are kept at all
+    int64_t period = 3600;          // seconds covered by a downsampled record
+    bool readOnly = false;          // for reports while a daemon is writing
+};
+
+// Totals over a range of records.
+struct HistorySummary {
+    uint64_t checks = 0;
+    uint64_t up = 0;
+    uint64_t durationSum = 0; // microseconds, summed over every check
+
+    void add(const HistoryRecord& record) {
+        checks += record.checks;
+        up += record.up;
+        durationSum += static_cast<uint64_t>(record.duration) * record.checks;
+    }
+
+    // Fraction of checks that were up, 0 without any.
+    double uptime() const {
+        return checks > 0 ? static_cast<double>(up) / checks : 0;
+    }
+
+    // Mean duration in microseconds, 0 without any checks.
+    double meanDuration() const {
+        return checks > 0 ? static_cast<double>(durationSum) / checks : 0;
+    }
+};
+
+// Append-only history of check results in a directory of memory-mapped segment files holding
+// fixed-size records. A run is appended by copying its records into the open segment, so the
+// cost does not depend on how much history there is. compact() merges full-resolution
+// segments past rawAge into one record per server and period, and drops segments past
+// retention. Every segment keeps its time range in its header, so a range query only scans
+// the segments that overlap it. Errors opening or writing the store throw std::runtime_error.
+class HistoryStore {
+public:
+    explicit HistoryStore(const HistoryOptions& options);
+    ~HistoryStore();
+
+    HistoryStore(const HistoryStore&) = delete;
+    HistoryStore& operator=(const HistoryStore&) = delete;
+
+    // The id the named server's records are stored under, assigned on first use.
+    uint32_t serverId(const std::string& name);
+
+    size_t serverCount() const;
+
+    // The name of a server id, or an empty string.
+    const std::string& serverName(uint32_t id) const;
+
+    void append(const std::vector<HistoryRecord>& records);
+
+    // Downsamples and drops old segments as of the given Unix time.
+    void compact(int64_t now);
+
+    // Summaries of the records in [from, to), for every server id and for each bucket of the
+    // given length: result[server][bucket].
+    void report(int64_t from, int64_t to, int64_t bucket, std::vector<std::vector<HistorySummary>>& result) const;
+
+    // Starts writing appended records back to disk.
+    void flush();
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl_;
+};
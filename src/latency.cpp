@@ -0,0 +1,171 @@
+#include "latency.hpp"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+    const unsigned kSubBucketBits = 6;
+    const uint64_t kSubBuckets = uint64_t(1) << kSubBucketBits; // exact below this
+    const uint64_t kHalfSubBuckets = kSubBuckets / 2;
+
+    unsigned highest_bit(uint64_t value) {
+        unsigned bit = 0;
+        while (value >>= 1) {
+            ++bit;
+        }
+        return bit;
+    }
+
+    // Each power of two from kSubBuckets up is split into kHalfSubBuckets buckets.
+    size_t bucket_index(uint64_t value) {
+        if (value < kSubBuckets) {
+            return static_cast<size_t>(value);
+        }
+        const unsigned shift = highest_bit(value) - (kSubBucketBits - 1);
+        return static_cast<size_t>(shift * kHalfSubBuckets + (value >> shift));
+    }
+
+    uint64_t bucket_highest(size_t index) {
+        if (index < kSubBuckets) {
+            return index;
+        }
+        const uint64_t shift = index / kHalfSubBuckets - 1;
+        const uint64_t lowest = (index - shift * kHalfSubBuckets) << shift;
+        return lowest + (uint64_t(1) << shift) - 1;
+    }
+}
+
+size_t Histogram::slot(size_t index) {
+    if (counts_.empty()) {
+        offset_ = index;
+        counts_.push_back(0);
+    } else if (index < offset_) {
+        counts_.insert(counts_.begin(), offset_ - index, 0);
+        offset_ = index;
+    } else if (index - offset_ >= counts_.size()) {
+        counts_.resize(index - offset_ + 1, 0);
+    }
+    return index - offset_;
+}
+
+void Histogram::record(uint64_t value) {
+    ++counts_[slot(bucket_index(value))];
+    ++count_;
+    max_ = std::max(max_, value);
+}
+
+void Histogram::merge(const Histogram& other) {
+    if (other.counts_.empty()) {
+        return;
+    }
+    (void)slot(other.offset_);
+    (void)slot(other.offset_ + other.counts_.size() - 1);
+    const size_t first = other.offset_ - offset_;
+    for (size_t i = 0; i < other.counts_.size(); ++i) {
+        counts_[first + i] += other.counts_[i];
+    }
+    count_ += other.count_;
+    max_ = std::max(max_, other.max_);
+}
+
+void Histogram::clear() {
+    counts_.clear();
+    offset_ = 0;
+    count_ = 0;
+    max_ = 0;
+}
+
+uint64_t Histogram::percentile(double percent) const {
+    if (count_ == 0) {
+        return 0;
+    }
+    const double clamped = std::min(std::max(percent, 0.0), 100.0);
+    const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(clamped / 100.0 * count_)));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts_.size(); ++i) {
+        seen += counts_[i];
+        if (seen >= rank) {
+            return std::min(bucket_highest(offset_ + i), max_);
+        }
+    }
+    return max_;
+}
+
+RollingHistogram::RollingHistogram(std::chrono::seconds window, size_t slots)
+    : span_(std::chrono::duration_cast<ClockType::duration>(window) / static_cast<ClockType::duration::rep>(std::max<size_t>(slots, 1)))
+    , slots_(std::max<size_t>(slots, 1))
+{
+    if (span_ <= ClockType::duration::zero()) {
+        span_ = std::chrono::seconds(1);
+    }
+}
+
+uint64_t RollingHistogram::epoch(ClockType::time_point now) const {
+    // Starts at 1 so a fresh slot (epoch 0) never counts as current.
+    return static_cast<uint64_t>(now.time_since_epoch() / span_) + 1;
+}
+
+void RollingHistogram::record(uint64_t value, ClockType::time_point now) {
+    const uint64_t current = epoch(now);
+    Slot& slot = slots_[current % slots_.size()];
+    if (slot.epoch != current) {
+        slot.histogram.clear();
+        slot.epoch = current;
+    }
+    slot.histogram.record(value);
+}
+
+Histogram RollingHistogram::snapshot(ClockType::time_point now) const {
+    const uint64_t current = epoch(now);
+    Histogram result;
+    for (const auto& slot : slots_) {
+        if (slot.epoch != 0 && slot.epoch <= current && current - slot.epoch < slots_.size()) {
+            result.merge(slot.histogram);
+        }
+    }
+    return result;
+}
+
+const char* phase_name(Phase phase) {
+    switch (phase) {
+        case Phase::Total:
+            return "total";
+        case Phase::Dns:
+            return "dns";
+        case Phase::Connect:
+            return "connect";
+        case Phase::Tls:
+            return "tls";
+        case Phase::FirstByte:
+            return "first_byte";
+    }
+    return "";
+}
+
+LatencyTracker::LatencyTracker(std::chrono::seconds window, size_t slots)
+    : window_(window)
+    , slots_(slots)
+{
+}
+
+void LatencyTracker::record(const PhaseTimings& timings, ClockType::time_point now) {
+    for (size_t i = 0; i < kPhaseCount; ++i) {
+        const int64_t value = timings.micros[i];
+        if (value < 0) {
+            continue;
+        }
+        auto& phase = phases_[i];
+        if (!phase) {
+            phase.reset(new RollingHistogram(window_, slots_));
+        }
+        phase->record(static_cast<uint64_t>(value), now);
+    }
+}
+
+bool LatencyTracker::snapshot(Phase phase, ClockType::time_point now, Histogram& histogram) const {
+    const auto& rolling = phases_[static_cast<size_t>(phase)];
+    if (!rolling) {
+        return false;
+    }
+    histogram = rolling->snapshot(now);
+    return histogram.count() > 0;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Latency histogram with HDR-style log-linear buckets: values below 64 are counted exactly and
+// larger ones to within about 3%, so percentiles stay accurate from microseconds to minutes.
+// Only the buckets from the smallest to the largest value recorded are stored, which for one
+// server's latencies is usually a few dozen counters.
+class Histogram {
+public:
+    void record(uint64_t value);
+    void merge(const Histogram& other);
+    void clear();
+
+    uint64_t count() const {
+        return count_;
+    }
+
+    uint64_t max() const {
+        return max_;
+    }
+
+    // The value at or below which the given percentage (0-100) of the recorded values fall,
+    // rounded up to the top of its bucket but never above max().
+    uint64_t percentile(double percent) const;
+
+private:
+    // Makes room for the bucket at index, returning its position in counts_.
+    size_t slot(size_t index);
+
+    std::vector<uint32_t> counts_; // of the buckets from offset_ on
+    size_t offset_ = 0;
+    uint64_t count_ = 0;
+    uint64_t max_ = 0;
+};
+
+// Histogram over a rolling window of time, kept as a ring of slots that each cover an equal
+// share of the window. A slot is cleared when it comes round again, so samples older than the
+// window drop out a slot at a time.
+class RollingHistogram {
+public:
+    using ClockType = std::chrono::steady_clock;
+
+    RollingHistogram(std::chrono::seconds window, size_t slots);
+
+    void record(uint64_t value, ClockType::time_point now);
+
+    // Everything recorded within the window ending at now.
+    Histogram snapshot(ClockType::time_point now) const;
+
+private:
+    struct Slot {
+        uint64_t epoch = 0; // which multiple of span_ the slot currently holds
+        Histogram histogram;
+    };
+
+    uint64_t epoch(ClockType::time_point now) const;
+
+    ClockType::duration span_;
+    std::vector<Slot> slots_;
+};
+
+// The parts a check's response time is made of. Not every monitor measures every phase.
+enum class Phase {
+    Total,
+    Dns,
+    Connect,
+    Tls,
+    FirstByte,
+};
+
+const size_t kPhaseCount = 5;
+
+const char* phase_name(Phase phase);
+
+// Phase durations of one check in microseconds; negative for phases that weren't measured.
+struct PhaseTimings {
+    PhaseTimings() {
+        clear();
+    }
+
+    void clear() {
+        micros.fill(-1);
+    }
+
+    void set(Phase phase, int64_t value) {
+        micros[static_cast<size_t>(phase)] = value;
+    }
+
+    int64_t get(Phase phase) const {
+        return micros[static_cast<size_t>(phase)];
+    }
+
+    std::array<int64_t, kPhaseCount> micros;
+};
+
+// One rolling histogram per phase for a server, created when the phase is first measured.
+class LatencyTracker {
+public:
+    using ClockType = RollingHistogram::ClockType;
+
+    LatencyTracker(std::chrono::seconds window, size_t slots);
+
+    void record(const PhaseTimings& timings, ClockType::time_point now);
+
+    // Sets histogram to the phase's values within the window, returning false if it has none.
+    bool snapshot(Phase phase, ClockType::time_point now, Histogram& histogram) const;
+
+private:
+    std::chrono::seconds window_;
+    size_t slots_;
+    std::array<std::unique_ptr<RollingHistogram>, kPhaseCount> phases_;
+};
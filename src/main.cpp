@@ -1,29 +1,87 @@
+#include <algorithm>
+#include <array>
 #include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
 #include <ctime>
-#include <future>
+#include <functional>
 #include <iostream>
 #include <fstream>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netdb.h>
-#include <unistd.h>
-#include <fcntl.h>
+#include <sys/resource.h>
 
 #include "json.hpp"
-#include "process.hpp"
 
+#include "config_watcher.hpp"
 #include "curl.hpp"
+#include "error_code.hpp"
+#include "event_loop.hpp"
+#include "history.hpp"
+#include "latency.hpp"
+#include "metrics.hpp"
+#include "ping.hpp"
+#include "plugin.hpp"
+#include "resolver.hpp"
+#include "spawn.hpp"
+#include "state_file.hpp"
+#include "status_file.hpp"
+#include "string_pool.hpp"
+#include "tcp.hpp"
+#include "template.hpp"
+#include "thread_pool.hpp"
+#include "timer_wheel.hpp"
 
 namespace {
 
     using json = nlohmann::json;
 
     static const TimeoutType kDefaultTimeout = 5;
+    static const IntervalType kDefaultInterval = 60;
+    static const IntervalType kDefaultFlushInterval = 10;
+    static const unsigned kDefaultDnsTtl = 60;
+    static const unsigned kDefaultLatencyWindow = 3600;
+    static const size_t kLatencySlots = 6;
+    static const size_t kResolverThreads = 8;
+    static const size_t kDefaultMaxConcurrency = 1024;
+    static const size_t kDefaultMaxCommandConcurrency = 32;
+    static const size_t kMaxCommandOutput = 4096;
+    static const size_t kDefaultMaxBodyBytes = 1024 * 1024;
+    static const PortType kDefaultTlsPort = 443;
     static const std::string kDefaultDateFormat = "%Y-%m-%d %I:%M:%S %p";
+    static const auto kSchedulerTick = std::chrono::milliseconds(100);
+    static const auto kHistoryCompactInterval = std::chrono::hours(1);
+    static const auto kMetricsInterval = std::chrono::seconds(1);
+    static const unsigned kDefaultReportDays = 7;
+    static const char kStateSuffix[] = ".state";
+    static const std::string kParentDownError = "unreachable (parent down)";
+    
+    // Error messages, date formats and action names, which many servers share.
+    StringPool string_pool;
+    
+    volatile std::sig_atomic_t stop_requested = 0;
+    volatile std::sig_atomic_t reload_requested = 0;
+    
+    void request_stop(int) {
+        stop_requested = 1;
+    }
+    
+    void request_reload(int) {
+        reload_requested = 1;
+    }
+
+    // Joins the parameters of a probe into a key for Monitor::probeKey().
+    std::string probe_key(std::initializer_list<std::string> parts) {
+        std::string key;
+        for (const auto& part : parts) {
+            key += part;
+            key += '\0';
+        }
+        return key;
+    }
 
     void read_json_file(const std::string& path, json& outJson) {
         try {
@@ -34,6 +92,34 @@ namespace {
         }
     }
 
+    // Reads the "history" option: either the directory of the store, or an object with "path" and
+    // optionally "raw_days" and "retention_days". Returns false if there is none.
+    bool read_history_options(const json& config, HistoryOptions& options) {
+        const auto history_iter = config.find("history");
+        if (history_iter == config.end()) {
+            return false;
+        }
+        if (history_iter->is_object()) {
+            const auto end = history_iter->end();
+            const auto path_iter = history_iter->find("path");
+            if (path_iter == end) {
+                throw std::runtime_error("Missing \"path\" field in \"history\"");
+            }
+            options.path = path_iter->get<std::string>();
+            const auto raw_days_iter = history_iter->find("raw_days");
+            if (raw_days_iter != end) {
+                options.rawAge = static_cast<int64_t>(raw_days_iter->get<unsigned>()) * 86400;
+            }
+            const auto retention_days_iter = history_iter->find("retention_days");
+            if (retention_days_iter != end) {
+                options.retention = static_cast<int64_t>(retention_days_iter->get<unsigned>()) * 86400;
+            }
+        } else {
+            options.path = history_iter->get<std::string>();
+        }
+        return true;
+    }
+
     template <typename StringType>
     StringType trim(const StringType& s) {
         auto it = s.begin();
@@ -46,49 +132,35 @@ namespace {
         }
         return {it, rit.base()};
     }
-
-    class Task {
-    public:
-        Task(const std::string& command)
-            : cmd_(command)
-        {
-        }
-        
-        int run() {
-            const auto read_stdout = [this](const char *bytes, size_t n) {
-                stdout_.append(bytes, n);
-            };
-            const auto read_stderr = [this](const char *bytes, size_t n) {
-                stderr_.append(bytes, n);
-            };
-            Process process(cmd_, {}, read_stdout, read_stderr);
-            return process.get_exit_status();
-        }
-        
-        const std::string& out() const {
-            return stdout_;
-        }
-        
-        const std::string err() const {
-            return stderr_;
+    
+    // Every probe in flight holds a descriptor, so allow as many as the hard limit permits.
+    void raise_file_limit() {
+        struct ::rlimit limit;
+        if (::getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+            limit.rlim_cur = limit.rlim_max;
+            (void)::setrlimit(RLIMIT_NOFILE, &limit);
         }
-        
-    private:
-        const std::string cmd_;
-        std::string stdout_;
-        std::string stderr_;
-    };
+    }
 
-    std::string replace_variables(const std::string& input, const std::unordered_map<std::string, std::string>& values) {
-        std::string str{input};
-        for (const auto& item : values) {
-            std::string what = "{{" + item.first + "}}";
-            std::string::size_type pos;
-            while ((pos = str.find(what)) != std::string::npos) {
-                str.replace(pos, what.size(), item.second);
-            }
+    // Variables of action templates, by their index in kServerVariableNames.
+    enum ServerVariable : size_t {
+        kVariableName,
+        kVariableLowerStatus,
+        kVariableStatus,
+        kVariableUpperStatus,
+        kVariableError,
+        kVariableDate,
+    };
+    
+    const std::vector<std::string> kServerVariableNames{"name", "status", "Status", "STATUS", "error", "date"};
+    
+    // Parses an action template, naming the action in the error for an unknown variable.
+    Template parse_template(const std::string& action, const std::string& text) {
+        try {
+            return Template(text, kServerVariableNames);
+        } catch (const std::exception& ex) {
+            throw std::runtime_error("Action \"" + action + "\": " + ex.what());
         }
-        return str;
     }
 
 }
@@ -104,14 +176,49 @@ public:
     void stop() {
         const auto end = ClockType::now();
         duration_ = static_cast<DurationType>(std::chrono::duration_cast<std::chrono::milliseconds>(end - start_).count());
+        micros_ = std::chrono::duration_cast<std::chrono::microseconds>(end - start_).count();
     }
 
     DurationType duration() const {
         return duration_;
     }
+    
+    int64_t micros() const {
+        return micros_;
+    }
 private:
     ClockType::time_point start_;
     DurationType duration_;
+    int64_t micros_;
+};
+
+// Maximum number of probes of each kind in flight at once ("max_concurrency").
+struct Concurrency {
+    size_t http = kDefaultMaxConcurrency;
+    size_t port = kDefaultMaxConcurrency;
+    size_t ping = kDefaultMaxConcurrency;
+    size_t cmd = kDefaultMaxCommandConcurrency;
+    size_t plugin = kDefaultMaxConcurrency;
+};
+
+// The probe engines, all driven by one event loop that every check() runs on.
+struct Engines {
+    Engines(EventLoop& loop, Resolver& resolver, HttpShare& share)
+        : loop(loop)
+        , http(loop, resolver, share)
+        , tcp(loop, resolver)
+        , ping(loop, resolver)
+        , commands(loop, kDefaultMaxCommandConcurrency)
+        , plugins(loop, kDefaultMaxConcurrency)
+    {
+    }
+    
+    EventLoop& loop;
+    HttpMulti http;
+    TcpMulti tcp;
+    PingMulti ping;
+    InFlightLimit commands; // of the commands run as checks
+    InFlightLimit plugins;
 };
 
 class Monitor {
@@ -122,36 +229,111 @@ public:
     {
     }
     
-    bool run() {
-        time_ = std::time(nullptr);
-        elapsedTime_.start();
-        const bool result = execute();
-        elapsedTime_.stop();
-        return result;
+    virtual ~Monitor() = default;
+    
+    // Probes the server on the engines' loop, recording how it went.
+    Task<bool> check(Engines& engines) {
+        start();
+        const bool result = co_await execute(engines);
+        co_return finish(result);
+    }
+    
+    // Adds monitor specific details of the last run to the server's status entry.
+    virtual void report(json&) const {
+    }
+    
+    // Everything the result of a probe depends on, starting with its kind, so that servers
+    // whose monitors have the same key can share one run of it; empty if it can't be shared.
+    virtual std::string probeKey() const {
+        return std::string();
+    }
+    
+    // Takes the result of the last run of another monitor with the same probeKey().
+    void adopt(const Monitor& other) {
+        error_ = other.error_;
+        errorCode_ = other.errorCode_;
+        elapsedTime_ = other.elapsedTime_;
+        time_ = other.time_;
+        timings_ = other.timings_;
+        adoptDetails(other);
+    }
+    
+    // Records a run that was skipped for the reason instead of probing.
+    void skip(const std::string& reason, ErrorCode code) {
+        start();
+        finish(false);
+        setError(reason, code);
     }
     
     TimeoutType timeout() const {
         return timeout_;
     }
 
+    // Why the last run failed, or empty.
     const std::string& errorMessage() const {
-        return errorMessage_;
+        static const std::string kNone;
+        return error_ ? *error_ : kNone;
+    }
+    
+    ErrorCode errorCode() const {
+        return errorCode_;
     }
     
     DurationType duration() const {
         return elapsedTime_.duration();
     }
     
+    // How long the phases of the last run took; only the total for monitors that can't tell.
+    const PhaseTimings& timings() const {
+        return timings_;
+    }
+    
     const std::time_t& time() const {
         return time_;
     }
     
 protected:
-    virtual bool execute() = 0;
+    virtual Task<bool> execute(Engines& engines) = 0;
+    
+    void start() {
+        time_ = std::time(nullptr);
+        timings_.clear();
+        elapsedTime_.start();
+    }
+    
+    bool finish(bool result) {
+        elapsedTime_.stop();
+        timings_.set(Phase::Total, elapsedTime_.micros());
+        if (result) {
+            setError(ProbeError());
+        }
+        return result;
+    }
     
-    std::string errorMessage_;
+    // Sets why the run failed, as the engine that ran it reported.
+    void setError(const ProbeError& error) {
+        if (error.code == ErrorCode::None) {
+            error_.reset();
+            errorCode_ = ErrorCode::None;
+        } else {
+            setError(error.message, error.code);
+        }
+    }
+    
+    void setError(const std::string& errorMessage, ErrorCode code) {
+        error_ = string_pool.intern(errorMessage);
+        errorCode_ = code;
+    }
+    
+    // Copies what report() needs from another monitor of the same class for adopt().
+    virtual void adoptDetails(const Monitor&) {
+    }
+    
+    PhaseTimings timings_;
     
 private:
+    StringPool::Handle error_;
+    ErrorCode errorCode_ = ErrorCode::None;
     const TimeoutType timeout_;
     ElapsedTime elapsedTime_;
     std::time_t time_;
@@ -159,114 +341,157 @@ private:
 
 class WebsiteMonitor : public Monitor {
 public:
-    WebsiteMonitor(const std::string& url, int httpStatus, TimeoutType timeout, bool verifypeer)
+    WebsiteMonitor(const std::string& url, int httpStatus, TimeoutType timeout, bool verifypeer, bool keepalive, bool get, const std::shared_ptr<const BodyPattern>& expect_body, size_t max_body_bytes)
         : Monitor(timeout)
     {
         params_.url = url;
         params_.status = httpStatus;
         params_.verifypeer = verifypeer;
+        params_.keepalive = keepalive;
+        params_.get = get;
+        params_.expectBody = expect_body;
+        params_.maxBodyBytes = max_body_bytes;
     }
     
-    virtual bool execute() override {
+    virtual Task<bool> execute(Engines& engines) override {
         params_.timeout = timeout();
-        return HttpHead(params_, errorMessage_);
+        info_ = HttpInfo();
+        ProbeError error;
+        const bool result = co_await engines.http.check(params_, info_, error);
+        setError(error);
+        timings_.set(Phase::Dns, info_.dns);
+        timings_.set(Phase::Connect, info_.connect);
+        timings_.set(Phase::Tls, info_.tls);
+        timings_.set(Phase::FirstByte, info_.firstByte);
+        co_return result;
+    }
+    
+    virtual void report(json& server_info) const override {
+        if (params_.keepalive) {
+            server_info["reused"] = info_.reused;
+        }
+    }
+    
+    virtual std::string probeKey() const override {
+        const auto& body = params_.expectBody;
+        return probe_key({"http", params_.url, std::to_string(params_.status), std::to_string(timeout()),
+            std::to_string(params_.verifypeer), std::to_string(params_.keepalive), std::to_string(params_.get),
+            body ? (body->regex ? "regex " : "text ") + body->text : std::string(), std::to_string(params_.maxBodyBytes)});
+    }
+    
+protected:
+    virtual void adoptDetails(const Monitor& other) override {
+        info_ = static_cast<const WebsiteMonitor&>(other).info_;
     }
     
 private:
     HttpParams params_;
+    HttpInfo info_;
 };
 
 class ServiceMonitor : public Monitor {
 public:
     ServiceMonitor(const std::string& host, PortType port, TimeoutType timeout)
         : Monitor(timeout)
-        , host_(host)
-        , port_(std::to_string(port))
     {
+        params_.host = host;
+        params_.port = port;
     }
     
-    virtual bool execute() override {
-        struct ::addrinfo hints;
-        std::memset(&hints, 0, sizeof(hints));
-        hints.ai_family = AF_UNSPEC;
-        hints.ai_socktype = SOCK_STREAM;
-        
-        struct ::addrinfo *res = nullptr;
-        const int getaddrinfo_error = ::getaddrinfo(host_.c_str(), port_.c_str(), &hints, &res);
-        if (getaddrinfo_error != 0) {
-            errorMessage_ = "Can't get address: " + std::string(::gai_strerror(getaddrinfo_error));
-            return false;
-        }
-        
-        struct Socket {
-            int value = -1;
-            ~Socket() {
-                if (value > 0) {
-                    (void)::close(value);
-                }
-            }
-        };
-        
-        Socket socket;
-        socket.value = ::socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-        if (socket.value < 0) {
-            errorMessage_ = "Can't create socket: " + std::string(::strerror(errno));
-            return false;
-        }
-        
-        if (::fcntl(socket.value, F_SETFL, O_NONBLOCK) != 0) {
-            errorMessage_ = "Can't set to non-blocking: " + std::string(::strerror(errno));
-            return false;
+    virtual Task<bool> execute(Engines& engines) override {
+        params_.timeout = timeout();
+        TcpInfo info;
+        ProbeError error;
+        const bool result = co_await engines.tcp.connect(params_, info, error);
+        setError(error);
+        timings_.set(Phase::Dns, info.dns);
+        timings_.set(Phase::Connect, info.connect);
+        co_return result;
+    }
+    
+    virtual std::string probeKey() const override {
+        return probe_key({"port", params_.host, std::to_string(params_.port), std::to_string(timeout())});
+    }
+
+private:
+    ConnectParams params_;
+};
+
+// Completes a TLS handshake with the server, failing once its certificate has fewer than
+// min_days left.
+class TlsMonitor : public Monitor {
+public:
+    TlsMonitor(const std::string& host, PortType port, const std::string& server_name, bool verify, int min_days, TimeoutType timeout)
+        : Monitor(timeout)
+        , min_days_(min_days)
+    {
+        params_.host = host;
+        params_.port = port;
+        params_.tls = true;
+        params_.serverName = server_name;
+        params_.verify = verify;
+    }
+    
+    virtual Task<bool> execute(Engines& engines) override {
+        params_.timeout = timeout();
+        info_ = TcpInfo();
+        ProbeError error;
+        const bool result = co_await engines.tcp.connect(params_, info_, error);
+        setError(error);
+        timings_.set(Phase::Dns, info_.dns);
+        timings_.set(Phase::Connect, info_.connect);
+        timings_.set(Phase::Tls, info_.tls);
+        co_return checkExpiry(result);
+    }
+    
+    virtual void report(json& server_info) const override {
+        if (info_.tls < 0) {
+            return;
         }
-        
-        if (::connect(socket.value, res->ai_addr, res->ai_addrlen) == 0) {
-            return true;
+        json tls;
+        tls["protocol"] = info_.details.protocol;
+        tls["cipher"] = info_.details.cipher;
+        if (info_.details.notAfter != 0) {
+            tls["not_after"] = info_.details.notAfter;
+            tls["days_left"] = daysLeft();
         }
-        
-        if (errno != EINPROGRESS) {
-            errorMessage_ = "Can't connect: " + std::string(::strerror(errno));
-            return false;
+        server_info["tls"] = tls;
+    }
+    
+    virtual std::string probeKey() const override {
+        return probe_key({"tls", params_.host, std::to_string(params_.port), params_.serverName,
+            std::to_string(params_.verify), std::to_string(min_days_), std::to_string(timeout())});
+    }
+    
+protected:
+    virtual void adoptDetails(const Monitor& other) override {
+        info_ = static_cast<const TlsMonitor&>(other).info_;
+    }
+    
+private:
+    // Whole days until the certificate expires, negative once it has.
+    int64_t daysLeft() const {
+        const int64_t remaining = info_.details.notAfter - static_cast<int64_t>(time());
+        return remaining >= 0 ? remaining / 86400 : -((86399 - remaining) / 86400);
+    }
+    
+    bool checkExpiry(bool result) {
+        if (!result || info_.details.notAfter == 0) {
+            return result;
         }
-        
-        ::fd_set rfds;
-        FD_ZERO(&rfds);
-        FD_SET(socket.value, &rfds);
-        
-        struct ::timeval tv;
-        tv.tv_sec = timeout();
-        tv.tv_usec = 0;
-        
-        const int retval = ::select(socket.value+1, nullptr, &rfds, nullptr, &tv);
-        if (retval == -1) {
-            errorMessage_ = "Select failed: " + std::string(::strerror(errno));
+        const int64_t days = daysLeft();
+        if (days < min_days_) {
+            setError(days >= 0
+                ? "TLS certificate expires in " + std::to_string(days) + " days"
+                : "TLS certificate expired " + std::to_string(-days) + " days ago", ErrorCode::Tls);
             return false;
-        } else if (retval == 0) {
-            errorMessage_ = "Timed out";
-            return false;
-        } else if (retval == 1) {
-            if (FD_ISSET(socket.value, &rfds)) {
-                int err = 0;
-                socklen_t errlen = sizeof(err);
-                if (::getsockopt(socket.value, SOL_SOCKET, SO_ERROR, &err, &errlen) == 0) {
-                    if (err == 0) {
-                        return true;
-                    } else {
-                        errorMessage_ = "Socket connect error: " + std::string(::strerror(err));
-                        return false;
-                    }
-                } else {
-                    errorMessage_ = "getsockopt failed: " + std::string(::strerror(errno));
-                    return false;
-                }
-            }
         }
-        errorMessage_ = "Unknown error";
-        return false;
+        return true;
     }
-
-private:
-    const std::string host_;
-    const std::string port_;
+    
+    ConnectParams params_;
+    TcpInfo info_;
+    const int min_days_;
 };
 
 class CommandMonitor : public Monitor {
@@ -286,21 +511,36 @@ public:
         command_ = command;
     }
     
-    virtual bool execute() override {
-        Task task{command_};
-        const int status = task.run();
-        if (status != 0) {
-            const auto& stdout_str = task.out();
-            const auto& stderr_str = task.err();
-            const auto output = trim(stdout_str + stderr_str);
+    virtual Task<bool> execute(Engines& engines) override {
+        const auto slot = co_await engines.commands.acquire();
+        const CommandParams params{command_, commandTimeout(), kMaxCommandOutput};
+        CommandResult result;
+        ProbeError error;
+        if (!co_await RunCommand(engines.loop, params, result, error)) {
+            setError(error);
+            co_return false;
+        }
+        if (result.status != 0) {
+            const auto output = trim(result.out + result.err);
             if (!output.empty()) {
-                errorMessage_ = output;
+                setError(output, exitError(result.status));
             } else {
-                errorMessage_ = "command failed with exit code " + std::to_string(status);
+                setError("command failed with exit code " + std::to_string(result.status), exitError(result.status));
             }
-            return false;
+            co_return false;
         }
-        return true;
+        co_return true;
+    }
+    
+protected:
+    // Seconds the whole command may take.
+    virtual TimeoutType commandTimeout() const {
+        return timeout();
+    }
+    
+    // The kind of failure the command's exit status stands for.
+    virtual ErrorCode exitError(int) const {
+        return ErrorCode::Other;
     }
     
 private:
@@ -310,23 +550,165 @@ private:
 
 class PingMonitor : public CommandMonitor {
 public:
-    PingMonitor(const std::string& host, TimeoutType timeout)
+    PingMonitor(const std::string& host, TimeoutType timeout, unsigned count)
         : CommandMonitor(timeout)
     {
-        setCommand("ping -t " + std::to_string(timeout) + " -c 1 \"" + host + "\"");
+        params_.host = host;
+        params_.count = count;
+        // Only used when ICMP sockets aren't available to this process
+#ifdef __APPLE__
+        setCommand("ping -t " + std::to_string(timeout) + " -c " + std::to_string(count) + " \"" + host + "\"");
+#else
+        setCommand("ping -W " + std::to_string(timeout) + " -c " + std::to_string(count) + " \"" + host + "\"");
+#endif
+    }
+    
+    virtual Task<bool> execute(Engines& engines) override {
+        if (!PingMulti::available()) {
+            co_return co_await CommandMonitor::execute(engines);
+        }
+        params_.timeout = timeout();
+        stats_ = PingStats();
+        ProbeError error;
+        const bool result = co_await engines.ping.ping(params_, stats_, error);
+        setError(error);
+        co_return result;
+    }
+    
+    virtual void report(json& server_info) const override {
+        if (stats_.sent == 0) {
+            return;
+        }
+        json ping;
+        ping["sent"] = stats_.sent;
+        ping["received"] = stats_.received;
+        ping["loss"] = stats_.loss();
+        if (stats_.received > 0) {
+            ping["rtt_min"] = stats_.rtt_min;
+            ping["rtt_avg"] = stats_.rtt_avg;
+            ping["rtt_max"] = stats_.rtt_max;
+        }
+        server_info["ping"] = ping;
+    }
+    
+    virtual std::string probeKey() const override {
+        return probe_key({"ping", params_.host, std::to_string(params_.count), std::to_string(timeout())});
+    }
+    
+protected:
+    virtual void adoptDetails(const Monitor& other) override {
+        stats_ = static_cast<const PingMonitor&>(other).stats_;
+    }
+    
+    // One echo request a second, and the last one may wait the whole timeout for its reply.
+    virtual TimeoutType commandTimeout() const override {
+        return timeout() + params_.count;
+    }
+    
+    // The ping command exits with this status when no reply came, and another on errors.
+    virtual ErrorCode exitError(int status) const override {
+#ifdef __APPLE__
+        return status == 2 ? ErrorCode::NoReply : ErrorCode::Other;
+#else
+        return status == 1 ? ErrorCode::NoReply : ErrorCode::Other;
+#endif
+    }
+    
+private:
+    PingParams params_;
+    PingStats stats_;
+};
+
+// Runs a check implemented by a plugin (see servermonitor_plugin.h), in this process or isolated
+// in one of the plugin's own.
+class PluginMonitor : public Monitor {
+public:
+    PluginMonitor(const std::string& path, const PluginOptions& options, bool isolate, TimeoutType timeout)
+        : Monitor(timeout)
+        , check_(path, options, isolate)
+        , key_(probe_key({"plugin", path, json(options).dump(), std::to_string(isolate), std::to_string(timeout)}))
+    {
+    }
+    
+    virtual Task<bool> execute(Engines& engines) override {
+        const auto slot = co_await engines.plugins.acquire();
+        PluginResult result;
+        const bool up = co_await check_.run(engines.loop, timeout(), result);
+        setError(result.error);
+        timings_.set(Phase::FirstByte, result.latency); // the plugin's own measure
+        co_return up;
+    }
+    
+    virtual std::string probeKey() const override {
+        return key_;
     }
+    
+private:
+    PluginCheck check_;
+    const std::string key_;
+};
+
+// A change of a server's status as actions see it. It is a copy, so actions can run while the
+// server is already being checked again.
+struct Event {
+    std::string name;
+    std::string error;
+    std::string date;
+    bool result = false;
+    
+    // Appends the template to out with the event's values for the variables.
+    void render(const Template& text, std::string& out) const {
+        text.render(out, [this](size_t variable, std::string& out) {
+            switch (variable) {
+                case kVariableName:
+                    out += name;
+                    break;
+                case kVariableLowerStatus:
+                    out += result ? "up" : "down";
+                    break;
+                case kVariableStatus:
+                    out += result ? "Up" : "Down";
+                    break;
+                case kVariableUpperStatus:
+                    out += result ? "UP" : "DOWN";
+                    break;
+                case kVariableError:
+                    out += error;
+                    break;
+                case kVariableDate:
+                    out += date;
+                    break;
+            }
+        });
+    }
+};
+
+// When a server is checked and how many failures it takes to call it down.
+struct Schedule {
+    IntervalType interval = kDefaultInterval;
+    IntervalType maxInterval = kDefaultInterval;   // backed off to while the server stays up
+    IntervalType retryInterval = kDefaultInterval; // while checks are failing
+    uint32_t confirmations = 1;                    // failures in a row before the server is down
 };
 
+class Action;
+
 class Server {
 public:
     using MonitorPtr = std::unique_ptr<Monitor>;
     
-    Server(const std::string& name, const std::string& date_format, MonitorPtr monitor, const std::string& action)
+    // The date format and action name are pooled, as most servers share them; action is null
+    // for none.
+    Server(const std::string& name, const StringPool::Handle& date_format, MonitorPtr monitor, const StringPool::Handle& action, const Schedule& schedule, std::chrono::seconds latency_window)
         : name_(name)
         , date_format_(date_format)
         , monitor_(std::move(monitor))
-        , action_(action)
+        , action_name_(action)
+        , schedule_(schedule)
+        , interval_(schedule.interval)
+        , latency_(latency_window, kLatencySlots)
         , result_(false)
+        , hasStatus_(false)
     {
     }
 
@@ -338,10 +720,59 @@ public:
         return monitor_;
     }
     
-    const std::string& action() const {
+    const StringPool::Handle& actionName() const {
+        return action_name_;
+    }
+    
+    // Resolved from the name whenever the actions are loaded, so a change of status doesn't
+    // look it up.
+    void setAction(Action *action) {
+        action_ = action;
+    }
+    
+    Action* action() const {
         return action_;
     }
     
+    // The name of the server this one is reached through ("depends_on"), or null.
+    void setParentName(const StringPool::Handle& parent) {
+        parent_name_ = parent;
+    }
+    
+    const StringPool::Handle& parentName() const {
+        return parent_name_;
+    }
+    
+    // Resolved from the name whenever the servers are loaded, with the number of servers
+    // above this one.
+    void setParent(Server *parent, unsigned depth) {
+        parent_ = parent;
+        depth_ = depth;
+    }
+    
+    Server* parent() const {
+        return parent_;
+    }
+    
+    unsigned depth() const {
+        return depth_;
+    }
+    
+    // Whether the last check was skipped because the parent was down. The server's status is
+    // then unknown rather than down, so it keeps the one it had.
+    void setUnreachable(bool unreachable) {
+        unreachable_ = unreachable;
+    }
+    
+    bool unreachable() const {
+        return unreachable_;
+    }
+    
+    // Whether the server can't be reached through its parent right now.
+    bool parentDown() const {
+        return parent_ && (parent_->unreachable() || (parent_->hasStatus() && !parent_->status()));
+    }
+    
     void setResult(bool result) {
         result_ = result;
     }
@@ -350,23 +781,114 @@ public:
         return result_;
     }
     
-    std::string monitorTimeString() const {
-        char timebuf[100];
-        std::memset(timebuf, 0, sizeof(timebuf));
-        std::strftime(timebuf, sizeof(timebuf), date_format_.c_str(), std::localtime(&monitor()->time()));
-        return timebuf;
+    const Schedule& schedule() const {
+        return schedule_;
+    }
+    
+    // Seconds until the next check: the retry interval after a failure, otherwise the interval,
+    // doubled with every success in a row after the first up to the maximum.
+    IntervalType nextInterval() const {
+        return result_ ? interval_ : schedule_.retryInterval;
+    }
+    
+    // Adds the phase timings of the monitor's last run to the server's latency histograms.
+    void recordLatency(LatencyTracker::ClockType::time_point now) {
+        latency_.record(monitor_->timings(), now);
+    }
+    
+    const LatencyTracker& latency() const {
+        return latency_;
+    }
+    
+    void setHistoryId(uint32_t id) {
+        historyId_ = id;
+    }
+    
+    uint32_t historyId() const {
+        return historyId_;
+    }
+    
+    void countCheck(ErrorCode error) {
+        ++checks_;
+        ++failures_[static_cast<size_t>(error)];
+    }
+    
+    uint64_t checks() const {
+        return checks_;
+    }
+    
+    // Checks that failed with the error, or succeeded for ErrorCode::None.
+    uint64_t failures(ErrorCode error) const {
+        return failures_[static_cast<size_t>(error)];
+    }
+    
+    // Whether the server has been given a status yet.
+    bool hasStatus() const {
+        return hasStatus_;
+    }
+    
+    // The confirmed status, which only turns down once enough checks in a row have failed.
+    bool status() const {
+        return state_.up;
+    }
+    
+    const ServerState& state() const {
+        return state_;
+    }
+    
+    // Carries on from a state saved by an earlier run or held before a reload.
+    void restoreState(const ServerState& state) {
+        state_ = state;
+        hasStatus_ = true;
+    }
+    
+    // Takes the result of the check that started at time into the status. A server that is up
+    // stays up until the schedule's confirmations have failed in a row. Returns whether the
+    // status changed from one it already had.
+    bool settle(bool result, std::time_t time) {
+        const bool steady = hasStatus_ && result && state_.failures == 0;
+        state_.failures = result ? 0 : state_.failures + 1;
+        const bool up = result || (hasStatus_ && state_.up && state_.failures < schedule_.confirmations);
+        const bool changed = hasStatus_ && state_.up != up;
+        if (!hasStatus_ || changed) {
+            state_.lastChange = static_cast<int64_t>(time);
+        }
+        state_.up = up;
+        hasStatus_ = true;
+        interval_ = steady && !changed ? std::min(interval_ * 2, schedule_.maxInterval) : schedule_.interval;
+        return changed;
+    }
+    
+    // The server's configuration with every global option it uses filled in, to tell whether a
+    // reload changed it. Only a hash of it is kept.
+    void setDefinition(const std::string& definition) {
+        definition_ = std::hash<std::string>()(definition);
+    }
+    
+    size_t definition() const {
+        return definition_;
+    }
+    
+    // When the daemon checks the server next.
+    void setNextCheck(std::chrono::steady_clock::time_point next_check) {
+        next_check_ = next_check;
     }
     
-    std::string replace_variables(const std::string& input) const {
-        const std::unordered_map<std::string, std::string> map{
-            {"name", name()},
-            {"status", result() ? "up" : "down"},
-            {"Status", result() ? "Up" : "Down"},
-            {"STATUS", result() ? "UP" : "DOWN"},
-            {"error", monitor()->errorMessage()},
-            {"date", monitorTimeString()},
-        };
-        return ::replace_variables(input, map);
+    std::chrono::steady_clock::time_point nextCheck() const {
+        return next_check_;
+    }
+    
+    // The server's current status for an action.
+    Event event() const {
+        Event event;
+        event.name = name();
+        event.result = result();
+        event.error = monitor()->errorMessage();
+        char timebuf[100];
+        struct std::tm tm;
+        const size_t length = ::localtime_r(&monitor()->time(), &tm) ? std::strftime(timebuf, sizeof(timebuf), date_format_->c_str(), &tm) : 0;
+        event.date.assign(timebuf, length);
+        return event;
     }
 
     Server(const Server&) = delete;
@@ -377,41 +899,101 @@ public:
 
 private:
     std::string name_;
-    std::string date_format_;
+    StringPool::Handle date_format_;
     MonitorPtr monitor_;
-    std::string action_;
+    StringPool::Handle action_name_;
+    Action *action_ = nullptr;
+    StringPool::Handle parent_name_;
+    Server *parent_ = nullptr;
+    unsigned depth_ = 0;
+    bool unreachable_ = false;
+    Schedule schedule_;
+    IntervalType interval_; // after a success
+    size_t definition_ = 0;
+    std::chrono::steady_clock::time_point next_check_;
+    LatencyTracker latency_;
+    uint32_t historyId_ = 0;
+    uint64_t checks_ = 0;
+    std::array<uint64_t, kErrorCodeCount> failures_{};
     bool result_;
+    ServerState state_;
+    bool hasStatus_;
 };
 
 class Action {
 public:
-    Action(TimeoutType timeout)
-        : timeout_(timeout)
+    // Called for every event delivered, with the error if it couldn't be.
+    using Report = std::function<void(const Event& event, const std::string& errorMessage)>;
+    
+    Action(const std::string& name, TimeoutType timeout, IntervalType digest)
+        : name_(name)
+        , timeout_(timeout)
+        , digest_(digest)
     {
     }
+    
+    virtual ~Action() = default;
+    
+    const std::string& name() const {
+        return name_;
+    }
+    
     TimeoutType timeout() const {
         return timeout_;
     }
-    virtual void run(const Server& server) = 0;
-private:
-    TimeoutType timeout_;
-};
-
-class CommandAction : public Action {
+    
+    // Seconds to collect events for before delivering them together, or 0.
+    IntervalType digest() const {
+        return digest_;
+    }
+    
+    // The action's configuration and the global options it uses, to tell whether a reload
+    // changed it.
+    void setDefinition(const std::string& definition) {
+        definition_ = definition;
+    }
+    
+    const std::string& definition() const {
+        return definition_;
+    }
+    
+    // Delivers the events in order. Called from the ActionQueue, never twice at once.
+    virtual void run(const std::vector<Event>& events, const Report& report) = 0;
+    
+private:
+    const std::string name_;
+    const TimeoutType timeout_;
+    const IntervalType digest_;
+    std::string definition_;
+};
+
+using ActionPtr = std::unique_ptr<Action>;
+
+class CommandAction : public Action {
 public:
-    CommandAction(TimeoutType timeout, const std::string& command)
-        : Action(timeout)
+    CommandAction(const std::string& name, TimeoutType timeout, IntervalType digest, const Template& command)
+        : Action(name, timeout, digest)
         , cmd_(command)
     {
     }
     
-    virtual void run(const Server& server) override {
-        Task task{server.replace_variables(cmd_)};
-        (void)task.run();
+    virtual void run(const std::vector<Event>& events, const Report& report) override {
+        for (const auto& event : events) {
+            buffer_.clear();
+            event.render(cmd_, buffer_);
+            const CommandParams params{buffer_, timeout(), kMaxCommandOutput};
+            std::string errorMessage;
+            if (RunCommand(params, result_, errorMessage) && result_.status != 0) {
+                errorMessage = "command failed with exit code " + std::to_string(result_.status);
+            }
+            report(event, errorMessage);
+        }
     }
     
 private:
-    const std::string cmd_;
+    const Template cmd_;
+    std::string buffer_; // reused for every command
+    CommandResult result_;
 };
 
 class EmailAction : public Action {
@@ -422,74 +1004,410 @@ public:
         std::string smtp_password;
         std::string from;
         std::string to;
-        std::string subject;
-        std::string body_down;
-        std::string body_up;
+        Template subject;
+        Template body_down;
+        Template body_up;
     };
 
-    EmailAction(TimeoutType timeout, const Params& params)
-        : Action(timeout)
+    EmailAction(const std::string& name, TimeoutType timeout, IntervalType digest, const Params& params)
+        : Action(name, timeout, digest)
         , params_(params)
+        , session_(timeout)
     {
+        email_.smtp_host = params_.smtp_host;
+        email_.smtp_user = params_.smtp_user;
+        email_.smtp_password = params_.smtp_password;
+        email_.from = params_.from;
+        email_.to = params_.to;
     }
     
-    virtual void run(const Server& server) override {
-        EmailParams params;
-        params.smtp_host = params_.smtp_host;
-        params.smtp_user = params_.smtp_user;
-        params.smtp_password = params_.smtp_password;
-        params.from = params_.from;
-        params.to = params_.to;
-        params.subject = server.replace_variables(params_.subject);
-        params.body = server.replace_variables(server.result() ? params_.body_up : params_.body_down);
+    // Sends one email per event over the same connection, or in digest mode one email for all.
+    virtual void run(const std::vector<Event>& events, const Report& report) override {
         std::string errorMessage;
-        (void)Email(params, timeout(), errorMessage);
+        if (digest() > 0 && events.size() > 1) {
+            size_t down = 0;
+            email_.body.clear();
+            for (const auto& event : events) {
+                down += event.result ? 0 : 1;
+                if (!email_.body.empty()) {
+                    email_.body += "\r\n\r\n";
+                }
+                event.render(event.result ? params_.body_up : params_.body_down, email_.body);
+            }
+            email_.subject = std::to_string(events.size()) + " status changes: " + std::to_string(down) + " down, " + std::to_string(events.size() - down) + " up";
+            const bool sent = session_.send(email_, errorMessage);
+            for (const auto& event : events) {
+                report(event, sent ? std::string() : errorMessage);
+            }
+            return;
+        }
+        for (const auto& event : events) {
+            email_.subject.clear();
+            event.render(params_.subject, email_.subject);
+            email_.body.clear();
+            event.render(event.result ? params_.body_up : params_.body_down, email_.body);
+            errorMessage.clear();
+            const bool sent = session_.send(email_, errorMessage);
+            report(event, sent ? std::string() : errorMessage);
+        }
     }
 
 private:
     const Params params_;
+    SmtpSession session_;
+    EmailParams email_; // reused for every message
+};
+
+// Runs actions off the check loop on a pool of their own. Events for an action queue up while
+// it runs and are then delivered together, so a burst of changes goes out over one SMTP
+// connection; an action with a digest holds its events until that many seconds have passed
+// since the first. The last failed delivery for each server is kept until one succeeds.
+class ActionQueue {
+public:
+    struct Counts {
+        uint64_t delivered = 0;
+        uint64_t failed = 0;
+    };
+    
+    explicit ActionQueue(size_t workers)
+        : pool_(workers)
+    {
+    }
+    
+    void push(Action& action, Event event) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Queue& queue = queues_[&action];
+        if (queue.events.empty()) {
+            queue.since = ClockType::now();
+        }
+        queue.events.push_back(std::move(event));
+        if (ready(action, queue, ClockType::now(), false)) {
+            dispatch(action, queue);
+        }
+    }
+    
+    // Starts delivering the digests that are due, or with flush every event still held.
+    void release(bool flush) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const auto now = ClockType::now();
+        for (auto& item : queues_) {
+            Action& action = *const_cast<Action*>(item.first);
+            if (ready(action, item.second, now, flush)) {
+                dispatch(action, item.second);
+            }
+        }
+    }
+    
+    // Blocks until every delivery started so far has finished, including the ones queued while
+    // it ran. Held digests are not started; see release().
+    void wait() {
+        pool_.wait();
+    }
+    
+    bool deliveryError(const std::string& server, std::string& errorMessage) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const auto iter = errors_.find(server);
+        if (iter == errors_.end()) {
+            return false;
+        }
+        errorMessage = iter->second;
+        return true;
+    }
+    
+    Counts counts(const Action& action) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const auto iter = queues_.find(&action);
+        return iter != queues_.end() ? iter->second.counts : Counts();
+    }
+    
+    // Forgets an action that is going away. Everything pushed for it must have been delivered
+    // first; see release() and wait().
+    void remove(const Action& action) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queues_.erase(&action);
+    }
+    
+private:
+    using ClockType = std::chrono::steady_clock;
+    
+    struct Queue {
+        std::vector<Event> events;
+        ClockType::time_point since; // when the first of events was pushed
+        bool running = false;
+        Counts counts;
+    };
+    
+    bool ready(const Action& action, const Queue& queue, ClockType::time_point now, bool flush) const {
+        if (queue.running || queue.events.empty()) {
+            return false;
+        }
+        return flush || action.digest() == 0 || now - queue.since >= std::chrono::seconds(action.digest());
+    }
+    
+    // Called with mutex_ held.
+    void dispatch(Action& action, Queue& queue) {
+        auto events = std::make_shared<std::vector<Event>>();
+        events->swap(queue.events);
+        queue.running = true;
+        Action *action_ptr = &action;
+        pool_.post([this, action_ptr, events](){
+            try {
+                action_ptr->run(*events, [this, action_ptr](const Event& event, const std::string& errorMessage) {
+                    record(*action_ptr, event, errorMessage);
+                });
+            } catch (const std::exception& ex) {
+                for (const auto& event : *events) {
+                    record(*action_ptr, event, ex.what());
+                }
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            Queue& queue = queues_[action_ptr];
+            queue.running = false;
+            if (ready(*action_ptr, queue, ClockType::now(), false)) {
+                dispatch(*action_ptr, queue);
+            }
+        });
+    }
+    
+    void record(const Action& action, const Event& event, const std::string& errorMessage) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Queue& queue = queues_[&action];
+        if (errorMessage.empty()) {
+            ++queue.counts.delivered;
+            errors_.erase(event.name);
+            return;
+        }
+        ++queue.counts.failed;
+        errors_[event.name] = errorMessage;
+        std::cout << "  Action " + action.name() + " for " + event.name + " failed: " + errorMessage + "\n" << std::flush;
+    }
+    
+    mutable std::mutex mutex_;
+    std::unordered_map<const Action*, Queue> queues_;
+    std::unordered_map<std::string, std::string> errors_; // by server name
+    ThreadPool pool_; // last, so running deliveries finish before the queues go away
+};
+
+// Everything a configuration defines. It is parsed in full before any of it is used, so a
+// configuration that doesn't load leaves the running one as it was.
+struct Configuration {
+    IntervalType flush_interval = kDefaultFlushInterval;
+    StatusFormat status_format = StatusFormat::Json;
+    unsigned dns_ttl = kDefaultDnsTtl;
+    size_t max_processes = 0;
+    Concurrency concurrency;
+    std::string metrics_address;
+    bool has_history = false;
+    HistoryOptions history;
+    std::unordered_map<std::string, ActionPtr> actions;
+    std::vector<Server> servers;
 };
 
 class ServerMonitor {
 public:
     ServerMonitor(const json& config, const std::string& status_path)
-        : config_(config)
-        , status_path_(status_path)
+        : status_path_(status_path)
+        , flush_interval_(kDefaultFlushInterval)
+        , resolver_(kResolverThreads, std::chrono::seconds(kDefaultDnsTtl))
     {
+        Configuration configuration;
+        parse(config, configuration);
+        start(configuration);
     }
     
+    // Checks every server once, runs the actions of servers whose status changed since the
+    // last status file was written and then rewrites it.
     void run() {
-        json status_prev;
-        read_json_file(status_path_, status_prev);
+        restore();
+        compactHistory();
+        
+        std::vector<Server*> servers;
+        for (auto& server : servers_) {
+            servers.push_back(&server);
+        }
         
-        const auto config_end = config_.end();
+        ElapsedTime elapsedTime;
+        elapsedTime.start();
+        check(servers);
+        elapsedTime.stop();
+        appendHistory();
+        
+        std::cout << "Total time: " << elapsedTime.duration() << " ms" << std::endl;
+        std::cout << "Probes: " << probes_ << " for " << probes_ + shared_probes_ << " checks, " << shared_probes_ << " shared" << std::endl;
+        printResolverStats();
+        
+        // The status doesn't wait for the actions, but is written again with how they went.
+        const uint64_t deliveries = countActionDeliveries();
+        writeStatus();
+        finishActions();
+        if (countActionDeliveries() != deliveries) {
+            writeStatus();
+        }
+    }
+    
+    // Keeps the servers in memory and checks each one on its schedule until SIGINT or
+    // SIGTERM, writing the status file every "flush_interval" seconds if anything was checked.
+    // The configuration is reloaded whenever its file changes, or on SIGHUP.
+    void runDaemon(const std::string& config_path) {
+        restore();
+        compactHistory();
+        loop_.spawn(runScheduler(config_path), [](){});
+        loop_.run();
+        finishActions();
+        writeStatus();
+    }
+    
+private:
+    // The daemon, on the event loop alongside the checks: starts each server's check when it
+    // comes due and schedules its next one once that check completes, so a slow check only
+    // delays its own server. Reloads wait for the checks in flight, as they move the servers.
+    Task<void> runScheduler(const std::string& config_path) {
+        using ClockType = std::chrono::steady_clock;
+        using Wheel = TimerWheel<Server*>;
+        std::unique_ptr<Wheel> wheel{new Wheel(ClockType::now(), kSchedulerTick)};
+        schedule(*wheel);
+        ConfigWatcher watcher(config_path);
+        
+        const auto flush_interval = std::chrono::seconds(flush_interval_);
+        auto next_flush = ClockType::now() + flush_interval;
+        auto next_compact = ClockType::now() + kHistoryCompactInterval;
+        
+        std::unique_ptr<MetricsServer> metrics;
+        if (!metrics_address_.empty()) {
+            metrics.reset(new MetricsServer(metrics_address_));
+            renderMetrics(*metrics);
+        }
+        auto next_metrics = ClockType::now();
+        bool metrics_dirty = false;
+        bool dirty = false;
+        bool reload_pending = false;
+        uint64_t seen_deliveries = 0;
+        std::vector<Server*> due;
+        
+        for (;;) {
+            if (!stop_requested && (watcher.changed() || reload_requested)) {
+                reload_requested = 0;
+                reload_pending = true;
+            }
+            
+            // No new checks start while stopping or waiting to reload.
+            const bool hold = stop_requested || reload_pending;
+            auto now = ClockType::now();
+            due.clear();
+            if (!hold) {
+                wheel->advance(now, due);
+            }
+            if (!finished_.empty()) {
+                for (const auto& finished : finished_) {
+                    const auto next_check = finished.time + std::chrono::seconds(finished.server->nextInterval());
+                    wheel->schedule(finished.server, next_check - now);
+                    finished.server->setNextCheck(next_check);
+                }
+                finished_.clear();
+                appendHistory();
+                dirty = true;
+                metrics_dirty = true;
+            }
+            if (reload_pending && checking_ == 0) {
+                reload_pending = false;
+                if (reload(config_path)) {
+                    dirty = true;
+                    metrics_dirty = true;
+                }
+                // The servers may have moved, and the wheel stood still while the checks in
+                // flight finished, so it is rebuilt from when each server is due.
+                wheel.reset(new Wheel(ClockType::now(), kSchedulerTick));
+                schedule(*wheel);
+            }
+            if (!due.empty()) {
+                startChecks(due);
+            }
+            
+            action_queue_->release(false);
+            const uint64_t deliveries = countActionDeliveries();
+            if (deliveries != seen_deliveries) {
+                seen_deliveries = deliveries;
+                dirty = true; // for the action errors in the status
+                metrics_dirty = true;
+            }
+            
+            now = ClockType::now();
+            if (metrics && metrics_dirty && now >= next_metrics) {
+                renderMetrics(*metrics);
+                metrics_dirty = false;
+                next_metrics = now + kMetricsInterval;
+            }
+            if (now >= next_flush) {
+                if (dirty) {
+                    writeStatus();
+                    printResolverStats();
+                    if (history_) {
+                        history_->flush();
+                    }
+                    dirty = false;
+                }
+                next_flush = now + flush_interval;
+            }
+            if (now >= next_compact) {
+                compactHistory();
+                next_compact = now + kHistoryCompactInterval;
+            }
+            if (stop_requested && checking_ == 0) {
+                break;
+            }
+            
+            auto wake = std::min(next_flush, now + std::chrono::seconds(1));
+            if (!hold) {
+                wake = std::min(wake, wheel->nextExpiry());
+            }
+            if (hold || checking_ > 0) {
+                wake = std::min(wake, now + kSchedulerTick); // to pick up the checks completing
+            }
+            if (metrics && metrics_dirty) {
+                wake = std::min(wake, next_metrics);
+            }
+            co_await loop_.sleepUntil(wake);
+        }
+    }
+    
+    static void parse(const json& config, Configuration& configuration) {
+        const auto config_end = config.end();
         
         TimeoutType global_timeout = kDefaultTimeout;
-        const auto global_timeout_iter = config_.find("timeout");
+        const auto global_timeout_iter = config.find("timeout");
         if (global_timeout_iter != config_end) {
             global_timeout = global_timeout_iter->get<TimeoutType>();
         }
         
         std::string global_date_format = kDefaultDateFormat;
-        const auto global_date_format_iter = config_.find("date_format");
+        const auto global_date_format_iter = config.find("date_format");
         if (global_date_format_iter != config_end) {
             global_date_format = global_date_format_iter->get<std::string>();
         }
+        const StringPool::Handle date_format = string_pool.intern(global_date_format);
         
-        using ActionPtr = std::unique_ptr<Action>;
-        std::unordered_map<std::string, ActionPtr> actions;
-        const auto actions_iter = config_.find("actions");
+        auto& actions = configuration.actions;
+        const auto actions_iter = config.find("actions");
         if (actions_iter != config_end && actions_iter->is_object()) {
             for (auto it = (*actions_iter).cbegin(); it != (*actions_iter).cend(); ++it) {
                 const auto& value = it.value();
                 if (value.is_object()) {
                     const std::string name = it.key();
-                    
                     const auto end = value.end();
                     
+                    IntervalType digest = 0;
+                    const auto digest_iter = value.find("digest");
+                    if (digest_iter != end) {
+                        digest = digest_iter->get<IntervalType>();
+                    }
+                    
+                    json definition = value;
+                    definition["timeout"] = global_timeout;
+                    
                     const auto cmd_iter = value.find("cmd");
                     if (cmd_iter != end) {
-                        actions[name] = std::make_unique<CommandAction>(global_timeout, cmd_iter.value().get<std::string>());
+                        actions[name] = std::make_unique<CommandAction>(name, global_timeout, digest, parse_template(name, cmd_iter.value().get<std::string>()));
+                        actions[name]->setDefinition(definition.dump());
                         continue;
                     }
                     
@@ -515,10 +1433,11 @@ public:
                         params.smtp_password = smtp_password_iter.value().get<std::string>();
                         params.from = from_iter.value().get<std::string>();
                         params.to = to_iter.value().get<std::string>();
-                        params.subject = subject_iter.value().get<std::string>();
-                        params.body_down = body_down_iter.value().get<std::string>();
-                        params.body_up = body_up_iter.value().get<std::string>();
-                        actions[name] = std::make_unique<EmailAction>(global_timeout, params);
+                        params.subject = parse_template(name, subject_iter.value().get<std::string>());
+                        params.body_down = parse_template(name, body_down_iter.value().get<std::string>());
+                        params.body_up = parse_template(name, body_up_iter.value().get<std::string>());
+                        actions[name] = std::make_unique<EmailAction>(name, global_timeout, digest, params);
+                        actions[name]->setDefinition(definition.dump());
                         continue;
                     }
                     
@@ -527,19 +1446,133 @@ public:
             }
         }
         
+        IntervalType global_interval = kDefaultInterval;
+        const auto global_interval_iter = config.find("interval");
+        if (global_interval_iter != config_end) {
+            global_interval = global_interval_iter->get<IntervalType>();
+        }
+        
+        // 0 for the server's own interval.
+        IntervalType global_max_interval = 0;
+        const auto global_max_interval_iter = config.find("max_interval");
+        if (global_max_interval_iter != config_end) {
+            global_max_interval = global_max_interval_iter->get<IntervalType>();
+        }
+        
+        IntervalType global_retry_interval = 0;
+        const auto global_retry_interval_iter = config.find("retry_interval");
+        if (global_retry_interval_iter != config_end) {
+            global_retry_interval = global_retry_interval_iter->get<IntervalType>();
+        }
+        
+        uint32_t global_confirmations = 1;
+        const auto global_confirmations_iter = config.find("confirmations");
+        if (global_confirmations_iter != config_end) {
+            global_confirmations = global_confirmations_iter->get<uint32_t>();
+        }
+        
+        auto& concurrency = configuration.concurrency;
+        const auto max_concurrency_iter = config.find("max_concurrency");
+        if (max_concurrency_iter != config_end) {
+            if (max_concurrency_iter->is_object()) {
+                const auto end = max_concurrency_iter->end();
+                const std::pair<const char*, size_t*> kinds[] = {
+                    {"http", &concurrency.http},
+                    {"port", &concurrency.port},
+                    {"ping", &concurrency.ping},
+                    {"cmd", &concurrency.cmd},
+                    {"plugin", &concurrency.plugin},
+                };
+                for (const auto& kind : kinds) {
+                    const auto kind_iter = max_concurrency_iter->find(kind.first);
+                    if (kind_iter != end) {
+                        *kind.second = kind_iter->get<size_t>();
+                    }
+                }
+            } else {
+                const size_t max_concurrency = max_concurrency_iter->get<size_t>();
+                concurrency.http = concurrency.port = concurrency.ping = concurrency.cmd = concurrency.plugin = max_concurrency;
+            }
+            if (concurrency.http == 0 || concurrency.port == 0 || concurrency.ping == 0 || concurrency.cmd == 0 || concurrency.plugin == 0) {
+                throw std::runtime_error("\"max_concurrency\" must be at least 1");
+            }
+        }
+        const auto max_processes_iter = config.find("max_processes");
+        if (max_processes_iter != config_end) {
+            configuration.max_processes = max_processes_iter->get<size_t>();
+        }
+        
+        const auto metrics_iter = config.find("metrics");
+        if (metrics_iter != config_end) {
+            configuration.metrics_address = metrics_iter->is_number() ? std::to_string(metrics_iter->get<unsigned>()) : metrics_iter->get<std::string>();
+        }
+        
+        const auto dns_ttl_iter = config.find("dns_ttl");
+        if (dns_ttl_iter != config_end) {
+            configuration.dns_ttl = dns_ttl_iter->get<unsigned>();
+        }
+        
+        const auto flush_interval_iter = config.find("flush_interval");
+        if (flush_interval_iter != config_end) {
+            configuration.flush_interval = flush_interval_iter->get<IntervalType>();
+        }
+        
+        const auto status_format_iter = config.find("status_format");
+        if (status_format_iter != config_end) {
+            const auto name = status_format_iter->get<std::string>();
+            if (!status_format(name, configuration.status_format)) {
+                throw std::runtime_error("Unknown \"status_format\" \"" + name + "\"");
+            }
+        }
+        
+        auto latency_window = std::chrono::seconds(kDefaultLatencyWindow);
+        const auto latency_window_iter = config.find("latency_window");
+        if (latency_window_iter != config_end) {
+            latency_window = std::chrono::seconds(latency_window_iter->get<unsigned>());
+            if (latency_window.count() == 0) {
+                throw std::runtime_error("\"latency_window\" must be at least 1 second");
+            }
+        }
+        
         bool global_verifypeer = true;
-        const auto global_verifypeer_iter = config_.find("verifypeer");
+        const auto global_verifypeer_iter = config.find("verifypeer");
         if (global_verifypeer_iter != config_end) {
             global_verifypeer = global_verifypeer_iter->get<bool>();
         }
         
-        const auto serversiter = config_.find("servers");
+        bool global_keepalive = false;
+        const auto global_keepalive_iter = config.find("keepalive");
+        if (global_keepalive_iter != config_end) {
+            global_keepalive = global_keepalive_iter->get<bool>();
+        }
+        
+        bool global_isolate = false;
+        const auto global_isolate_iter = config.find("isolate");
+        if (global_isolate_iter != config_end) {
+            global_isolate = global_isolate_iter->get<bool>();
+        }
+        
+        int global_min_cert_days = 0;
+        const auto global_min_cert_days_iter = config.find("min_cert_days");
+        if (global_min_cert_days_iter != config_end) {
+            global_min_cert_days = global_min_cert_days_iter->get<int>();
+        }
+        
+        size_t global_max_body_bytes = kDefaultMaxBodyBytes;
+        const auto global_max_body_bytes_iter = config.find("max_body_bytes");
+        if (global_max_body_bytes_iter != config_end) {
+            global_max_body_bytes = global_max_body_bytes_iter->get<size_t>();
+        }
+        
+        const auto serversiter = config.find("servers");
         if (serversiter == config_end) {
             throw std::runtime_error("Missing \"servers\" field");
         }
 
-        std::vector<Server> servers;
-        std::unordered_set<std::string> names;
+        // Every server's name, to the name of the server it depends on or an empty string.
+        std::unordered_map<std::string, std::string> names;
+        names.reserve(serversiter->size());
+        configuration.servers.reserve(serversiter->size());
 
         for (const auto& server : *serversiter) {
             const auto end = server.end();
@@ -553,7 +1586,11 @@ public:
             if (names.find(name) != names.end()) {
                 throw std::runtime_error("Name \"" + name + "\" is already used");
             }
-            names.insert(name);
+            auto& parent = names[name];
+            const auto depends_on = server.find("depends_on");
+            if (depends_on != end) {
+                parent = depends_on->get<std::string>();
+            }
             
             TimeoutType timeout = global_timeout;
             const auto timeout_iter = server.find("timeout");
@@ -566,7 +1603,51 @@ public:
             if (verifypeer_iter != end) {
                 verifypeer = verifypeer_iter->get<bool>();
             }
+            
+            bool keepalive = global_keepalive;
+            const auto keepalive_iter = server.find("keepalive");
+            if (keepalive_iter != end) {
+                keepalive = keepalive_iter->get<bool>();
+            }
 
+            IntervalType interval = global_interval;
+            const auto interval_iter = server.find("interval");
+            if (interval_iter != end) {
+                interval = interval_iter->get<IntervalType>();
+            }
+            if (interval == 0) {
+                throw std::runtime_error("Interval for \"" + name + "\" must be at least 1 second");
+            }
+            
+            Schedule schedule;
+            schedule.interval = interval;
+            schedule.maxInterval = global_max_interval;
+            const auto max_interval_iter = server.find("max_interval");
+            if (max_interval_iter != end) {
+                schedule.maxInterval = max_interval_iter->get<IntervalType>();
+            }
+            if (schedule.maxInterval == 0) {
+                schedule.maxInterval = interval;
+            } else if (schedule.maxInterval < interval) {
+                throw std::runtime_error("Max interval for \"" + name + "\" must be at least its interval");
+            }
+            schedule.retryInterval = global_retry_interval;
+            const auto retry_interval_iter = server.find("retry_interval");
+            if (retry_interval_iter != end) {
+                schedule.retryInterval = retry_interval_iter->get<IntervalType>();
+            }
+            if (schedule.retryInterval == 0) {
+                schedule.retryInterval = interval;
+            }
+            schedule.confirmations = global_confirmations;
+            const auto confirmations_iter = server.find("confirmations");
+            if (confirmations_iter != end) {
+                schedule.confirmations = confirmations_iter->get<uint32_t>();
+            }
+            if (schedule.confirmations == 0) {
+                throw std::runtime_error("Confirmations for \"" + name + "\" must be at least 1");
+            }
+            
             std::string action;
             const auto action_iter = server.find("action");
             if (action_iter != end) {
@@ -576,129 +1657,818 @@ public:
                 }
             }
             
+            json definition = server;
+            Server::MonitorPtr monitor;
             const auto url = server.find("url");
+            const auto host = server.find("host");
+            const auto port = server.find("port");
+            const auto ping_host = server.find("ping");
+            const auto tls_host = server.find("tls");
+            const auto cmd = server.find("cmd");
+            const auto plugin = server.find("plugin");
             if (url != end) {
                 const auto httpStatus = server.find("httpStatus");
                 int status = httpStatus != end ? httpStatus->get<int>() : 200;
-                servers.emplace_back(name, global_date_format, std::make_unique<WebsiteMonitor>(url->get<std::string>(), status, timeout, verifypeer), action);
-                continue;
+                std::shared_ptr<const BodyPattern> expect_body;
+                const auto expect_body_iter = server.find("expect_body");
+                if (expect_body_iter != end) {
+                    if (expect_body_iter->is_object()) {
+                        const auto regex = expect_body_iter->find("regex");
+                        if (regex == expect_body_iter->end()) {
+                            throw std::runtime_error("Invalid expect_body for \"" + name + "\"");
+                        }
+                        expect_body = std::make_shared<BodyPattern>(regex->get<std::string>(), true);
+                    } else {
+                        expect_body = std::make_shared<BodyPattern>(expect_body_iter->get<std::string>(), false);
+                    }
+                }
+                bool get = expect_body != nullptr;
+                const auto method = server.find("method");
+                if (method != end) {
+                    const std::string method_name = method->get<std::string>();
+                    if (method_name != "GET" && method_name != "HEAD") {
+                        throw std::runtime_error("Method for \"" + name + "\" must be GET or HEAD");
+                    }
+                    get = method_name == "GET";
+                    if (!get && expect_body) {
+                        throw std::runtime_error("expect_body for \"" + name + "\" needs a GET");
+                    }
+                }
+                size_t max_body_bytes = global_max_body_bytes;
+                const auto max_body_bytes_iter = server.find("max_body_bytes");
+                if (max_body_bytes_iter != end) {
+                    max_body_bytes = max_body_bytes_iter->get<size_t>();
+                }
+                if (get) {
+                    definition["max_body_bytes"] = max_body_bytes;
+                }
+                monitor = std::make_unique<WebsiteMonitor>(url->get<std::string>(), status, timeout, verifypeer, keepalive, get, expect_body, max_body_bytes);
+            } else if (host != end && port != end) {
+                monitor = std::make_unique<ServiceMonitor>(host->get<std::string>(), port->get<PortType>(), timeout);
+            } else if (ping_host != end) {
+                const auto count = server.find("count");
+                const unsigned ping_count = count != end ? count->get<unsigned>() : 1;
+                monitor = std::make_unique<PingMonitor>(ping_host->get<std::string>(), timeout, ping_count);
+            } else if (tls_host != end) {
+                const PortType tls_port = port != end ? port->get<PortType>() : kDefaultTlsPort;
+                const auto sni = server.find("sni");
+                const std::string server_name = sni != end ? sni->get<std::string>() : std::string();
+                int min_cert_days = global_min_cert_days;
+                const auto min_cert_days_iter = server.find("min_cert_days");
+                if (min_cert_days_iter != end) {
+                    min_cert_days = min_cert_days_iter->get<int>();
+                }
+                definition["min_cert_days"] = min_cert_days;
+                monitor = std::make_unique<TlsMonitor>(tls_host->get<std::string>(), tls_port, server_name, verifypeer, min_cert_days, timeout);
+            } else if (cmd != end) {
+                monitor = std::make_unique<CommandMonitor>(cmd->get<std::string>(), timeout);
+            } else if (plugin != end) {
+                PluginOptions options;
+                const auto options_iter = server.find("options");
+                if (options_iter != end) {
+                    if (!options_iter->is_object()) {
+                        throw std::runtime_error("Options for \"" + name + "\" must be an object");
+                    }
+                    for (auto option = options_iter->begin(); option != options_iter->end(); ++option) {
+                        options.emplace_back(option.key(), option->is_string() ? option->get<std::string>() : option->dump());
+                    }
+                }
+                bool isolate = global_isolate;
+                const auto isolate_iter = server.find("isolate");
+                if (isolate_iter != end) {
+                    isolate = isolate_iter->get<bool>();
+                }
+                definition["isolate"] = isolate;
+                try {
+                    monitor = std::make_unique<PluginMonitor>(plugin->get<std::string>(), options, isolate, timeout);
+                } catch (const std::runtime_error& ex) {
+                    throw std::runtime_error(std::string(ex.what()) + " for \"" + name + "\"");
+                }
+            } else {
+                throw std::runtime_error("Invalid server entry for \"" + name + "\"");
             }
             
-            const auto host = server.find("host");
-            const auto port = server.find("port");
-            if (host != end && port != end) {
-                servers.emplace_back(name, global_date_format, std::make_unique<ServiceMonitor>(host->get<std::string>(), port->get<PortType>(), timeout), action);
-                continue;
+            definition["timeout"] = timeout;
+            definition["verifypeer"] = verifypeer;
+            definition["keepalive"] = keepalive;
+            definition["interval"] = interval;
+            definition["max_interval"] = schedule.maxInterval;
+            definition["retry_interval"] = schedule.retryInterval;
+            definition["confirmations"] = schedule.confirmations;
+            definition["date_format"] = global_date_format;
+            definition["latency_window"] = latency_window.count();
+            configuration.servers.emplace_back(name, date_format, std::move(monitor), action.empty() ? nullptr : string_pool.intern(action), schedule, latency_window);
+            configuration.servers.back().setDefinition(definition.dump());
+            if (!parent.empty()) {
+                configuration.servers.back().setParentName(string_pool.intern(parent));
             }
-            
-            const auto ping_host = server.find("ping");
-            if (ping_host != end) {
-                servers.emplace_back(name, global_date_format, std::make_unique<PingMonitor>(ping_host->get<std::string>(), timeout), action);
-                continue;
+        }
+        
+        // Every chain of parents must end at a server without one.
+        for (const auto& item : names) {
+            const std::string *parent = &item.second;
+            for (size_t depth = 0; !parent->empty(); ++depth) {
+                const auto parent_iter = names.find(*parent);
+                if (parent_iter == names.end()) {
+                    throw std::runtime_error("Unknown server \"" + *parent + "\" in depends_on of \"" + item.first + "\"");
+                }
+                if (depth == names.size()) {
+                    throw std::runtime_error("depends_on of \"" + item.first + "\" is circular");
+                }
+                parent = &parent_iter->second;
             }
-            
-            const auto cmd = server.find("cmd");
-            if (cmd != end) {
-                servers.emplace_back(name, global_date_format, std::make_unique<CommandMonitor>(cmd->get<std::string>(), timeout), action);
+        }
+        
+        configuration.has_history = read_history_options(config, configuration.history);
+    }
+    
+    // Applies the first configuration.
+    void start(Configuration& configuration) {
+        concurrency_ = configuration.concurrency;
+        engines_.reset(new Engines(loop_, resolver_, http_share_));
+        engines_->http.setMaxInFlight(concurrency_.http);
+        engines_->tcp.setMaxInFlight(concurrency_.port);
+        engines_->ping.setMaxInFlight(concurrency_.ping);
+        engines_->commands.setMax(concurrency_.cmd);
+        engines_->plugins.setMax(concurrency_.plugin);
+        action_queue_.reset(new ActionQueue(concurrency_.cmd));
+        metrics_address_ = configuration.metrics_address;
+        if (configuration.has_history) {
+            history_options_ = configuration.history;
+            history_.reset(new HistoryStore(history_options_));
+        }
+        actions_.swap(configuration.actions);
+        servers_.swap(configuration.servers);
+        configure(configuration);
+    }
+    
+    // Applies the options that can change with every configuration, and gives the servers
+    // their history ids.
+    void configure(const Configuration& configuration) {
+        flush_interval_ = configuration.flush_interval;
+        status_format_ = configuration.status_format;
+        resolver_.setTtl(std::chrono::seconds(configuration.dns_ttl));
+        SetMaxCommands(configuration.max_processes);
+        for (auto& server : servers_) {
+            const auto& name = server.actionName();
+            const auto iter = name ? actions_.find(*name) : actions_.end();
+            server.setAction(iter != actions_.end() ? iter->second.get() : nullptr);
+        }
+        resolveParents();
+        if (history_) {
+            for (auto& server : servers_) {
+                server.setHistoryId(history_->serverId(server.name()));
+            }
+        }
+    }
+    
+    // Points every server with "depends_on" at its parent; parse() made sure each chain of
+    // them ends.
+    void resolveParents() {
+        std::unordered_map<std::string, Server*> index;
+        for (auto& server : servers_) {
+            if (server.parentName() && index.empty()) {
+                index.reserve(servers_.size());
+                for (auto& other : servers_) {
+                    index[other.name()] = &other;
+                }
+            }
+            server.setParent(server.parentName() ? index[*server.parentName()] : nullptr, 0);
+        }
+        for (auto& server : servers_) {
+            unsigned depth = 0;
+            for (const Server *parent = server.parent(); parent; parent = parent->parent()) {
+                ++depth;
+            }
+            server.setParent(server.parent(), depth);
+        }
+    }
+    
+    // Reads the configuration again and swaps it in, keeping the servers and actions that didn't
+    // change as they are: their histograms, counters, last results and open connections carry
+    // on. A server whose definition changed keeps only its last status, so actions run if the
+    // new definition gives a different one. Returns false, with the running configuration left
+    // as it was, if the new one doesn't load.
+    bool reload(const std::string& config_path) {
+        Configuration configuration;
+        try {
+            json config;
+            std::ifstream filestream(config_path);
+            filestream >> config;
+            if (!config.is_object()) {
+                throw std::runtime_error("Configuration JSON must be an object.");
+            }
+            parse(config, configuration);
+        } catch (const std::exception& ex) {
+            std::cout << "ERROR: Not reloading " << config_path << ": " << ex.what() << std::endl;
+            return false;
+        }
+        
+        // Options of the pools and stores that exist for the lifetime of the process.
+        const auto& concurrency = configuration.concurrency;
+        if (concurrency.http != concurrency_.http || concurrency.port != concurrency_.port || concurrency.ping != concurrency_.ping || concurrency.cmd != concurrency_.cmd || concurrency.plugin != concurrency_.plugin) {
+            std::cout << "WARNING: \"max_concurrency\" changes when restarted" << std::endl;
+        }
+        if (configuration.metrics_address != metrics_address_) {
+            std::cout << "WARNING: \"metrics\" changes when restarted" << std::endl;
+        }
+        const auto& history = configuration.history;
+        if (configuration.has_history != static_cast<bool>(history_) ||
+            (history_ && (history.path != history_options_.path || history.rawAge != history_options_.rawAge || history.retention != history_options_.retention))) {
+            std::cout << "WARNING: \"history\" changes when restarted" << std::endl;
+        }
+        
+        // Changed and removed actions may still have events held for a digest, which go out
+        // with the old definition before it goes away.
+        std::vector<const Action*> replaced;
+        for (auto& item : actions_) {
+            const auto iter = configuration.actions.find(item.first);
+            if (iter != configuration.actions.end() && iter->second->definition() == item.second->definition()) {
+                iter->second = std::move(item.second);
+            } else {
+                replaced.push_back(item.second.get());
+            }
+        }
+        if (!replaced.empty()) {
+            finishActions();
+            for (auto action : replaced) {
+                action_queue_->remove(*action);
+            }
+        }
+        
+        std::unordered_map<std::string, Server*> index;
+        for (auto& server : servers_) {
+            index[server.name()] = &server;
+        }
+        size_t added = 0;
+        size_t changed = 0;
+        size_t unchanged = 0;
+        for (auto& server : configuration.servers) {
+            const auto iter = index.find(server.name());
+            if (iter == index.end()) {
+                ++added;
                 continue;
             }
-            
-            throw std::runtime_error("Invalid server entry for \"" + name + "\"");
+            Server& old = *iter->second;
+            if (old.definition() == server.definition()) {
+                server = std::move(old);
+                ++unchanged;
+            } else {
+                if (old.hasStatus()) {
+                    server.restoreState(old.state());
+                }
+                ++changed;
+            }
         }
+        const size_t removed = servers_.size() - changed - unchanged;
         
-        std::vector<std::future<void>> futures;
-
-        ElapsedTime elapsedTime;
+        actions_.swap(configuration.actions);
+        servers_.swap(configuration.servers);
+        configure(configuration);
+        std::cout << "Reloaded " << config_path << ": " << added << " added, " << removed << " removed, " << changed << " changed, " << unchanged << " unchanged" << std::endl;
+        return true;
+    }
+    
+    // Schedules every server for when it is next due, or right away if it hasn't been checked.
+    void schedule(TimerWheel<Server*>& wheel) {
+        const auto now = std::chrono::steady_clock::now();
+        for (auto& server : servers_) {
+            if (server.nextCheck() > now) {
+                wheel.schedule(&server, server.nextCheck() - now);
+            } else {
+                wheel.scheduleNow(&server);
+            }
+        }
+    }
+    
+    std::string statePath() const {
+        return status_path_ + kStateSuffix;
+    }
+    
+    // Seeds each server's previous state from the last run, so the first check after a restart
+    // only runs actions for real changes. The compact state file is read in one pass if there
+    // is one, and the status file otherwise.
+    void restore() {
+        std::unordered_map<std::string, Server*> index;
+        for (auto& server : servers_) {
+            index[server.name()] = &server;
+        }
         
-        elapsedTime.start();
+        const bool restored = read_state_file(statePath(), [&index](const std::string& name, const ServerState& state) {
+            const auto server_iter = index.find(name);
+            if (server_iter != index.end()) {
+                server_iter->second->restoreState(state);
+            }
+        });
+        if (restored) {
+            return;
+        }
         
-        for (auto& server : servers) {
-            futures.push_back(std::async(std::launch::async, [&server](){
-                server.setResult(server.monitor()->run());
-            }));
+        json status_prev;
+        if (!read_status_file(status_path_, status_prev)) {
+            return;
+        }
+        for (const auto& json_obj : status_prev) {
+            if (!json_obj.is_object()) {
+                std::cout << "WARNING: Invalid status JSON element" << std::endl;
+                continue;
+            }
+            const auto json_name = json_obj.find("name");
+            const auto json_status = json_obj.find("status");
+            if (json_name == json_obj.end() || !json_name->is_string() || json_status == json_obj.end() || !json_status->is_boolean()) {
+                continue;
+            }
+            const auto server_iter = index.find(json_name->get<std::string>());
+            if (server_iter != index.end()) {
+                ServerState state;
+                state.up = json_status->get<bool>();
+                const auto json_last_change = json_obj.find("last_change");
+                if (json_last_change != json_obj.end() && json_last_change->is_number()) {
+                    state.lastChange = json_last_change->get<int64_t>();
+                }
+                const auto json_failures = json_obj.find("consecutive_failures");
+                if (json_failures != json_obj.end() && json_failures->is_number()) {
+                    state.failures = json_failures->get<uint32_t>();
+                }
+                server_iter->second->restoreState(state);
+            }
+        }
+    }
+    
+    // Checks the servers, all at once on the event loop of this thread, each kind of probe as
+    // far as its "max_concurrency" allows, and returns once every one has been evaluated.
+    void check(const std::vector<Server*>& servers) {
+        startChecks(servers);
+        loop_.run();
+        finished_.clear();
+    }
+    
+    // Starts checking the servers, parents first, without waiting for them. Each one is
+    // evaluated as soon as its own check completes, and then added to finished_.
+    void startChecks(std::vector<Server*> servers) {
+        std::stable_sort(servers.begin(), servers.end(), [](const Server *a, const Server *b) {
+            return a->depth() < b->depth();
+        });
+        for (auto server : servers) {
+            ++checking_;
+            active_.insert(server);
+            // A server whose parent is being checked as well waits for that result, so only
+            // the parent's action runs if it turns out to be down.
+            const auto parent = server->parent();
+            if (parent && active_.find(parent) != active_.end()) {
+                dependents_[parent].push_back(server);
+            } else {
+                probe(server);
+            }
+        }
+    }
+    
+    // Probes the server, or skips it as unreachable while its parent is down. A server with
+    // the same probe as one already in flight takes that probe's result instead of running it
+    // again.
+    void probe(Server *server) {
+        const bool unreachable = server->parentDown();
+        server->setUnreachable(unreachable);
+        if (unreachable) {
+            server->monitor()->skip(kParentDownError, ErrorCode::Unreachable);
+            server->setResult(false);
+            finishCheck(server);
+            return;
+        }
+        auto key = server->monitor()->probeKey();
+        if (!key.empty()) {
+            const auto inserted = probe_keys_.emplace(key, server);
+            if (!inserted.second) {
+                in_flight_[inserted.first->second].followers.push_back(server);
+                ++shared_probes_;
+                return;
+            }
+        }
+        in_flight_[server].key = std::move(key);
+        ++probes_;
+        loop_.spawn(server->monitor()->check(*engines_), [this, server](bool result) {
+            auto node = in_flight_.extract(server);
+            const InFlight& probe = node.mapped();
+            if (!probe.key.empty()) {
+                probe_keys_.erase(probe.key);
+            }
+            server->setResult(result);
+            finishCheck(server);
+            for (auto follower : probe.followers) {
+                follower->monitor()->adopt(*server->monitor());
+                follower->setResult(result);
+                finishCheck(follower);
+            }
+        });
+    }
+    
+    // Evaluates the server's check and starts the checks that waited for it.
+    void finishCheck(Server *server) {
+        evaluate(*server);
+        active_.erase(server);
+        --checking_;
+        finished_.push_back(Finished{server, std::chrono::steady_clock::now()});
+        auto node = dependents_.extract(server);
+        if (!node.empty()) {
+            for (auto dependent : node.mapped()) {
+                probe(dependent);
+            }
+        }
+    }
+    
+    // Reports the result of the server's last check and queues its action if the status changed.
+    void evaluate(Server& server) {
+        const auto& monitor = server.monitor();
+        const auto& name = server.name();
+        const bool result = server.result();
+        if (server.unreachable()) {
+            std::cout << name << ": UNREACHABLE - " << *server.parentName() << " is down" << std::endl;
+        } else if (result) {
+            std::cout << name << ": UP (" << monitor->duration() << " ms)" << std::endl;
+        } else {
+            std::cout << name << ": DOWN - " << monitor->errorMessage() << " (" << monitor->duration() << " ms)" << std::endl;
         }
         
-        for (auto& future : futures) {
-            future.get();
+        if (server.unreachable()) {
+            // Its real status is unknown, so it's left as it was and no action runs.
+        } else if (server.settle(result, monitor->time())) {
+            std::cout << "  Handle " << (result ? "UP" : "DOWN") << std::endl;
+            if (server.action()) {
+                action_queue_->push(*server.action(), server.event());
+            }
+        } else if (!result && server.status()) {
+            std::cout << "  Unconfirmed (" << server.state().failures << " of " << server.schedule().confirmations << ")" << std::endl;
+        }
+        if (!server.unreachable()) {
+            server.recordLatency(std::chrono::steady_clock::now());
         }
+        const ErrorCode error = result ? ErrorCode::None : monitor->errorCode();
+        server.countCheck(error);
         
-        elapsedTime.stop();
-
-        json status;
+        if (history_) {
+            HistoryRecord record;
+            std::memset(&record, 0, sizeof(record));
+            record.time = static_cast<int64_t>(monitor->time());
+            record.server = server.historyId();
+            const int64_t micros = monitor->timings().get(Phase::Total);
+            record.duration = static_cast<uint32_t>(std::min<int64_t>(std::max<int64_t>(micros, 0), UINT32_MAX));
+            record.checks = 1;
+            record.up = result ? 1 : 0;
+            record.error = static_cast<uint16_t>(error);
+            history_records_.push_back(record);
+        }
+    }
+    
+    void appendHistory() {
+        if (history_) {
+            history_->append(history_records_);
+            history_records_.clear();
+        }
+    }
+    
+    void compactHistory() {
+        if (history_) {
+            history_->compact(static_cast<int64_t>(std::time(nullptr)));
+        }
+    }
+    
+    // Action events delivered or failed so far.
+    uint64_t countActionDeliveries() const {
+        uint64_t deliveries = 0;
+        for (const auto& item : actions_) {
+            const auto counts = action_queue_->counts(*item.second);
+            deliveries += counts.delivered + counts.failed;
+        }
+        return deliveries;
+    }
+    
+    // Delivers every queued and held action event.
+    void finishActions() {
+        action_queue_->release(true);
+        action_queue_->wait();
+    }
+    
+    void printResolverStats() const {
+        const auto stats = resolver_.stats();
+        std::cout << "DNS cache: " << stats.hits << " hits, " << stats.misses << " misses, " << stats.coalesced << " coalesced" << std::endl;
+    }
+    
+    // Streams one record per checked server to the status file.
+    void writeStatus() {
+        size_t checked = 0;
+        for (const auto& server : servers_) {
+            if (server.monitor()->time() != 0) {
+                ++checked;
+            }
+        }
+        StatusFileWriter writer{status_path_, status_format_, checked};
+        json server_info;
         
-        for (const auto& server : servers) {
+        for (const auto& server : servers_) {
             const auto& monitor = server.monitor();
-            const auto& name = server.name();
+            if (monitor->time() == 0) {
+                continue; // not checked yet
+            }
             const bool result = server.result();
-            if (result) {
-                std::cout << name << ": UP";
+            server_info = json::object();
+            server_info["name"] = server.name();
+            if (server.hasStatus()) {
+                server_info["status"] = server.status();
+            } else if (server.unreachable()) {
+                server_info["status"] = nullptr; // never checked through its parent yet
             } else {
-                std::cout << name << ": DOWN - " << monitor->errorMessage();
+                server_info["status"] = result;
+            }
+            if (server.unreachable()) {
+                server_info["unreachable"] = true;
             }
-            std::cout << " (" << monitor->duration() << " ms)" << std::endl;
-            json server_info;
-            server_info["name"] = name;
-            server_info["status"] = result;
             if (!result) {
                 server_info["error"] = monitor->errorMessage();
             }
             server_info["time"] = monitor->time();
-            status.push_back(server_info);
-            
-            const auto& status_prev_it = std::find_if(status_prev.begin(), status_prev.end(), [&name](const json& obj) {
-                return obj["name"] == name;
-            });
-            if (status_prev_it != status_prev.end()) {
-                if (!status_prev_it->is_object()) {
-                    std::cout << "WARNING: Invalid status JSON element for \"" << name << "\"" << std::endl;
+            if (server.hasStatus()) {
+                const auto& state = server.state();
+                server_info["last_change"] = state.lastChange;
+                if (state.failures > 0) {
+                    server_info["consecutive_failures"] = state.failures;
+                }
+            }
+            std::string action_error;
+            if (action_queue_->deliveryError(server.name(), action_error)) {
+                server_info["action_error"] = action_error;
+            }
+            monitor->report(server_info);
+            reportLatency(server, server_info);
+            writer.write(server_info);
+        }
+        
+        writer.commit();
+        
+        StateFileWriter state_writer{statePath()};
+        for (const auto& server : servers_) {
+            if (server.hasStatus()) {
+                state_writer.add(server.name(), server.state());
+            }
+        }
+        state_writer.commit();
+    }
+    
+    // Adds p50/p90/p99/max in milliseconds over the latency window for every phase measured.
+    static void reportLatency(const Server& server, json& server_info) {
+        const auto now = std::chrono::steady_clock::now();
+        json latency;
+        Histogram histogram;
+        for (size_t i = 0; i < kPhaseCount; ++i) {
+            const Phase phase = static_cast<Phase>(i);
+            if (!server.latency().snapshot(phase, now, histogram)) {
+                continue;
+            }
+            const auto ms = [](uint64_t micros) {
+                return static_cast<double>(micros) / 1000.0;
+            };
+            latency[phase_name(phase)] = {
+                {"count", histogram.count()},
+                {"p50", ms(histogram.percentile(50))},
+                {"p90", ms(histogram.percentile(90))},
+                {"p99", ms(histogram.percentile(99))},
+                {"max", ms(histogram.max())},
+            };
+        }
+        if (!latency.is_null()) {
+            server_info["latency"] = latency;
+        }
+    }
+    
+    // Renders the state of every checked server for scrapes, straight from the servers into the
+    // metrics server's spare buffer.
+    void renderMetrics(MetricsServer& metrics) const {
+        std::string& out = metrics.buffer();
+        MetricsWriter writer{out};
+        const auto now = std::chrono::steady_clock::now();
+        
+        writer.family("servermonitor_up", "gauge", "Whether the server is up, counting failures only once confirmed.");
+        for (const auto& server : servers_) {
+            if (server.monitor()->time() != 0 && server.hasStatus()) {
+                writer.sample("servermonitor_up").label("server", server.name()).value(static_cast<uint64_t>(server.status() ? 1 : 0));
+            }
+        }
+        
+        writer.family("servermonitor_unreachable", "gauge", "Whether the last check was skipped because the server it depends on is down.");
+        for (const auto& server : servers_) {
+            if (server.monitor()->time() != 0) {
+                writer.sample("servermonitor_unreachable").label("server", server.name()).value(static_cast<uint64_t>(server.unreachable() ? 1 : 0));
+            }
+        }
+        
+        writer.family("servermonitor_last_check_timestamp_seconds", "gauge", "When the last check of the server started.");
+        for (const auto& server : servers_) {
+            if (server.monitor()->time() != 0) {
+                writer.sample("servermonitor_last_check_timestamp_seconds").label("server", server.name()).value(static_cast<uint64_t>(server.monitor()->time()));
+            }
+        }
+        
+        writer.family("servermonitor_probe_duration_seconds", "gauge", "How long the last check of the server took.");
+        for (const auto& server : servers_) {
+            const int64_t micros = server.monitor()->timings().get(Phase::Total);
+            if (server.monitor()->time() != 0 && micros >= 0) {
+                writer.sample("servermonitor_probe_duration_seconds").label("server", server.name()).value(static_cast<double>(micros) / 1e6);
+            }
+        }
+        
+        writer.family("servermonitor_probe_phase_seconds", "gauge", "How long each phase of the last check of the server took.");
+        for (const auto& server : servers_) {
+            if (server.monitor()->time() == 0) {
+                continue;
+            }
+            const auto& timings = server.monitor()->timings();
+            for (size_t i = 1; i < kPhaseCount; ++i) {
+                const Phase phase = static_cast<Phase>(i);
+                if (timings.get(phase) >= 0) {
+                    writer.sample("servermonitor_probe_phase_seconds").label("server", server.name()).label("phase", phase_name(phase)).value(static_cast<double>(timings.get(phase)) / 1e6);
+                }
+            }
+        }
+        
+        writer.family("servermonitor_latency_seconds", "gauge", "Percentiles of each phase over the latency window; quantile 1 is the maximum.");
+        Histogram histogram;
+        const std::pair<const char*, double> quantiles[] = {{"0.5", 50}, {"0.9", 90}, {"0.99", 99}};
+        for (const auto& server : servers_) {
+            for (size_t i = 0; i < kPhaseCount; ++i) {
+                const Phase phase = static_cast<Phase>(i);
+                if (!server.latency().snapshot(phase, now, histogram)) {
                     continue;
                 }
-                const auto& json_obj = *status_prev_it;
-                const auto& json_status = json_obj.find("status");
-                if (json_status != json_obj.end() && json_status->get<bool>() != result) {
-                    std::cout << "  Handle " << (result ? "UP" : "DOWN") << std::endl;
-                    if (!server.action().empty()) {
-                        const auto action_iter = actions.find(server.action());
-                        if (action_iter != actions.end()) {
-                            action_iter->second->run(server);
-                        }
-                    }
+                for (const auto& quantile : quantiles) {
+                    writer.sample("servermonitor_latency_seconds").label("server", server.name()).label("phase", phase_name(phase)).label("quantile", quantile.first).value(static_cast<double>(histogram.percentile(quantile.second)) / 1e6);
                 }
+                writer.sample("servermonitor_latency_seconds").label("server", server.name()).label("phase", phase_name(phase)).label("quantile", "1").value(static_cast<double>(histogram.max()) / 1e6);
             }
         }
         
-        std::cout << "Total time: " << elapsedTime.duration() << " ms" << std::endl;
+        writer.family("servermonitor_checks_total", "counter", "Checks of the server since the daemon started.");
+        for (const auto& server : servers_) {
+            writer.sample("servermonitor_checks_total").label("server", server.name()).value(server.checks());
+        }
+        
+        writer.family("servermonitor_check_failures_total", "counter", "Failed checks of the server since the daemon started, by kind of error.");
+        for (const auto& server : servers_) {
+            for (size_t i = 1; i < kErrorCodeCount; ++i) {
+                const ErrorCode error = static_cast<ErrorCode>(i);
+                if (server.failures(error) > 0) {
+                    writer.sample("servermonitor_check_failures_total").label("server", server.name()).label("error", error_code_name(error)).value(server.failures(error));
+                }
+            }
+        }
         
-        std::ofstream output_file{status_path_};
-        if (!output_file.is_open()) {
-            throw std::runtime_error("Can't open status file");
+        writer.family("servermonitor_action_deliveries_total", "counter", "Action events delivered or failed, by action.");
+        for (const auto& item : actions_) {
+            const auto counts = action_queue_->counts(*item.second);
+            writer.sample("servermonitor_action_deliveries_total").label("action", item.first).label("result", "delivered").value(counts.delivered);
+            writer.sample("servermonitor_action_deliveries_total").label("action", item.first).label("result", "failed").value(counts.failed);
         }
-        output_file << status.dump(4) << std::endl;
+        
+        const auto stats = resolver_.stats();
+        writer.family("servermonitor_dns_lookups_total", "counter", "Host name lookups by how the resolver answered them.");
+        writer.sample("servermonitor_dns_lookups_total").label("result", "hit").value(stats.hits);
+        writer.sample("servermonitor_dns_lookups_total").label("result", "miss").value(stats.misses);
+        writer.sample("servermonitor_dns_lookups_total").label("result", "coalesced").value(stats.coalesced);
+        
+        writer.family("servermonitor_probes_total", "counter", "Probes run, and checks that shared the identical probe of another server instead.");
+        writer.sample("servermonitor_probes_total").label("result", "run").value(probes_);
+        writer.sample("servermonitor_probes_total").label("result", "shared").value(shared_probes_);
+        
+        metrics.publish();
     }
     
-private:
-    const json config_;
     const std::string status_path_;
+    IntervalType flush_interval_;
+    StatusFormat status_format_ = StatusFormat::Json;
+    std::string metrics_address_; // daemon mode only
+    Concurrency concurrency_;
+    uint64_t probes_ = 0;
+    uint64_t shared_probes_ = 0; // checks that took the result of an identical probe
+    
+    // A probe in flight, run by one server for every server with the same probe key.
+    struct InFlight {
+        std::string key;
+        std::vector<Server*> followers;
+    };
+    
+    struct Finished {
+        Server *server;
+        std::chrono::steady_clock::time_point time;
+    };
+    
+    size_t checking_ = 0; // checks started and not yet evaluated
+    std::unordered_set<Server*> active_; // the servers of those checks
+    std::unordered_map<Server*, InFlight> in_flight_; // by the server running the probe
+    std::unordered_map<std::string, Server*> probe_keys_; // of in_flight_
+    std::unordered_map<Server*, std::vector<Server*>> dependents_; // waiting on a parent's check
+    std::vector<Finished> finished_; // evaluated since the daemon last rescheduled
+    // Before the resolver, as lookups given up on may still post to it, and the servers, as
+    // plugin monitors may watch it until they go.
+    EventLoop loop_;
+    Resolver resolver_;
+    HttpShare http_share_; // keeps connections and TLS sessions between runs
+    std::unordered_map<std::string, ActionPtr> actions_;
+    std::vector<Server> servers_;
+    HistoryOptions history_options_;
+    std::unique_ptr<HistoryStore> history_;
+    std::vector<HistoryRecord> history_records_; // of the checks evaluated since the last append
+    std::unique_ptr<ActionQueue> action_queue_;
+    std::unique_ptr<Engines> engines_; // last, so the engines go before anything they use
 };
 
+// Prints the uptime and mean response time of every server in the history over the last days,
+// in total and per (UTC) day.
+void print_history_report(const json& config, unsigned days) {
+    HistoryOptions options;
+    if (!read_history_options(config, options)) {
+        throw std::runtime_error("No \"history\" configured");
+    }
+    options.readOnly = true;
+    HistoryStore history(options);
+    
+    const int64_t kDay = 86400;
+    const int64_t now = static_cast<int64_t>(std::time(nullptr));
+    const int64_t from = (now / kDay - static_cast<int64_t>(days) + 1) * kDay;
+    std::vector<std::vector<HistorySummary>> report;
+    history.report(from, now + 1, kDay, report);
+    
+    for (uint32_t id = 0; id < report.size(); ++id) {
+        HistorySummary total;
+        for (const auto& day : report[id]) {
+            total.checks += day.checks;
+            total.up += day.up;
+            total.durationSum += day.durationSum;
+        }
+        if (total.checks == 0) {
+            continue;
+        }
+        std::printf("%s: %.2f%% up, %.1f ms mean over %llu checks\n", history.serverName(id).c_str(), total.uptime() * 100, total.meanDuration() / 1000, static_cast<unsigned long long>(total.checks));
+        for (size_t i = 0; i < report[id].size(); ++i) {
+            const auto& day = report[id][i];
+            if (day.checks == 0) {
+                continue;
+            }
+            const std::time_t start = static_cast<std::time_t>(from + static_cast<int64_t>(i) * kDay);
+            char date[16];
+            std::strftime(date, sizeof(date), "%Y-%m-%d", std::gmtime(&start));
+            std::printf("  %s %7.2f%% %9.1f ms\n", date, day.uptime() * 100, day.meanDuration() / 1000);
+        }
+    }
+}
+
 int main(int argc, const char * argv[]) {
     try {
-        if (argc != 3) {
-            throw std::invalid_argument("Usage: ServerMonitor <input_config.json> <output_status.json>");
+        bool daemon = false;
+        bool report = false;
+        int argi = 1;
+        if (argc == 3 && std::string(argv[1]) == kServePluginOption) {
+            return ServePlugin(argv[2]);
+        }
+        if (argc > 1 && std::string(argv[1]) == "--daemon") {
+            daemon = true;
+            ++argi;
+        } else if (argc > 1 && std::string(argv[1]) == "--report") {
+            report = true;
+            ++argi;
+        }
+        if (report ? (argc - argi != 1 && argc - argi != 2) : argc - argi != 2) {
+            throw std::invalid_argument("Usage: ServerMonitor [--daemon] <input_config.json> <output_status.json>\n"
+                                        "       ServerMonitor --report <input_config.json> [days]");
         }
         
-        const std::string config_path{argv[1]};
-        const std::string status_path{argv[2]};
+        const std::string config_path{argv[argi]};
 
         json config;
         read_json_file(config_path, config);
         if (!config.is_object()) {
             throw std::runtime_error("Configuration JSON must be an object.");
         }
+        
+        if (report) {
+            const unsigned days = argc - argi == 2 ? static_cast<unsigned>(std::stoul(argv[argi + 1])) : kDefaultReportDays;
+            print_history_report(config, days > 0 ? days : 1);
+            return EXIT_SUCCESS;
+        }
+        
+        const std::string status_path{argv[argi + 1]};
 
+        raise_file_limit();
+        // TLS probes write to sockets the server may already have closed.
+        std::signal(SIGPIPE, SIG_IGN);
         CurlGlobal curlGlobal;
         ServerMonitor mon(config, status_path);
-        mon.run();
+        config = json(); // parsed, and sizeable for a large fleet
+        if (daemon) {
+            std::signal(SIGINT, request_stop);
+            std::signal(SIGTERM, request_stop);
+            std::signal(SIGHUP, request_reload);
+            mon.runDaemon(config_path);
+        } else {
+            mon.run();
+        }
 
         return EXIT_SUCCESS;
     } catch (const std::exception& ex) {
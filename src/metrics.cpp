@@ -0,0 +1,361 @@
+#include "metrics.hpp"
+#include "poller.hpp"
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+    const size_t kMaxRequest = 8192;
+    const auto kConnectionTimeout = std::chrono::seconds(10);
+    const char kContentType[] = "text/plain; version=0.0.4; charset=utf-8";
+
+    void append_escaped(std::string& out, const char *value, size_t length) {
+        for (size_t i = 0; i < length; ++i) {
+            const char c = value[i];
+            if (c == '\\' || c == '"') {
+                out += '\\';
+                out += c;
+            } else if (c == '\n') {
+                out += "\\n";
+            } else {
+                out += c;
+            }
+        }
+    }
+
+    bool set_nonblocking(int fd) {
+        const int flags = ::fcntl(fd, F_GETFL);
+        return flags >= 0 && ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+    }
+}
+
+void MetricsWriter::family(const char *name, const char *type, const char *help) {
+    out_ += "# HELP ";
+    out_ += name;
+    out_ += ' ';
+    out_ += help;
+    out_ += "\n# TYPE ";
+    out_ += name;
+    out_ += ' ';
+    out_ += type;
+    out_ += '\n';
+}
+
+MetricsWriter& MetricsWriter::sample(const char *name) {
+    out_ += name;
+    labels_ = 0;
+    return *this;
+}
+
+MetricsWriter& MetricsWriter::label(const char *name, const std::string& value) {
+    out_ += labels_++ == 0 ? '{' : ',';
+    out_ += name;
+    out_ += "=\"";
+    append_escaped(out_, value.data(), value.size());
+    out_ += '"';
+    return *this;
+}
+
+MetricsWriter& MetricsWriter::label(const char *name, const char *value) {
+    out_ += labels_++ == 0 ? '{' : ',';
+    out_ += name;
+    out_ += "=\"";
+    append_escaped(out_, value, std::strlen(value));
+    out_ += '"';
+    return *this;
+}
+
+void MetricsWriter::end_labels() {
+    if (labels_ > 0) {
+        out_ += '}';
+    }
+    out_ += ' ';
+}
+
+void MetricsWriter::value(double value) {
+    end_labels();
+    char buffer[32];
+    const int length = std::snprintf(buffer, sizeof(buffer), "%.9g", value);
+    out_.append(buffer, static_cast<size_t>(length));
+    out_ += '\n';
+}
+
+void MetricsWriter::value(uint64_t value) {
+    end_labels();
+    char buffer[24];
+    const int length = std::snprintf(buffer, sizeof(buffer), "%llu", static_cast<unsigned long long>(value));
+    out_.append(buffer, static_cast<size_t>(length));
+    out_ += '\n';
+}
+
+struct MetricsServer::Impl {
+    using ClockType = std::chrono::steady_clock;
+    using Body = std::shared_ptr<std::string>;
+
+    struct Connection {
+        int fd;
+        ClockType::time_point started;
+        std::string request;
+        std::string head; // status line and headers
+        Body body;        // empty for errors
+        size_t sent = 0;  // of head, then of the body
+        bool responding = false;
+    };
+
+    int listen_fd = -1;
+    Poller poller;
+    Notifier stop;
+    std::atomic<bool> stopping{false};
+    std::atomic<uint64_t> scrapes{0};
+    std::unordered_map<int, std::unique_ptr<Connection>> connections;
+    std::mutex mutex;
+    Body current;
+    Body spare;
+    std::thread thread;
+
+    void listen(const std::string& address) {
+        std::string host = "127.0.0.1";
+        std::string port = address;
+        const auto colon = address.rfind(':');
+        if (colon != std::string::npos) {
+            host = address.substr(0, colon);
+            port = address.substr(colon + 1);
+            if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+                host = host.substr(1, host.size() - 2);
+            }
+        }
+        struct ::addrinfo hints;
+        std::memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        struct ::addrinfo *res = nullptr;
+        const int error = ::getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res);
+        if (error != 0) {
+            throw std::runtime_error("Can't get metrics address " + address + ": " + ::gai_strerror(error));
+        }
+        std::string errorMessage;
+        for (const struct ::addrinfo *ai = res; ai; ai = ai->ai_next) {
+            const int fd = open_socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0) {
+                errorMessage = ::strerror(errno);
+                continue;
+            }
+            const int on = 1;
+            (void)::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            if (::bind(fd, ai->ai_addr, ai->ai_addrlen) != 0 || ::listen(fd, 64) != 0 || !set_nonblocking(fd)) {
+                errorMessage = ::strerror(errno);
+                (void)::close(fd);
+                continue;
+            }
+            listen_fd = fd;
+            break;
+        }
+        ::freeaddrinfo(res);
+        if (listen_fd < 0) {
+            throw std::runtime_error("Can't listen for metrics on " + address + ": " + errorMessage);
+        }
+    }
+
+    void close_connection(int fd) {
+        poller.remove(fd);
+        (void)::close(fd);
+        connections.erase(fd);
+    }
+
+    void accept_all() {
+        for (;;) {
+            const int fd = accept_socket(listen_fd);
+            if (fd < 0) {
+                return; // EAGAIN, or a connection that went away
+            }
+            if (!set_nonblocking(fd) || !poller.add(fd, Poller::Read, nullptr)) {
+                (void)::close(fd);
+                continue;
+            }
+            std::unique_ptr<Connection> connection{new Connection};
+            connection->fd = fd;
+            connection->started = ClockType::now();
+            connections[fd] = std::move(connection);
+        }
+    }
+
+    void respond(Connection& connection) {
+        const auto& request = connection.request;
+        const bool is_get = request.compare(0, 4, "GET ") == 0;
+        const auto path_end = request.find(' ', 4);
+        const std::string path = is_get && path_end != std::string::npos ? request.substr(4, path_end - 4) : std::string();
+        if (!is_get) {
+            connection.head = "HTTP/1.1 405 Method Not Allowed\r\nAllow: GET\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        } else if (path != "/metrics" && path != "/") {
+            connection.head = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        } else {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                connection.body = current;
+            }
+            const size_t length = connection.body ? connection.body->size() : 0;
+            connection.head = "HTTP/1.1 200 OK\r\nContent-Type: " + std::string(kContentType) + "\r\nContent-Length: " + std::to_string(length) + "\r\nConnection: close\r\n\r\n";
+            ++scrapes;
+        }
+        connection.responding = true;
+        (void)poller.modify(connection.fd, Poller::Write, nullptr);
+    }
+
+    // Returns false once the connection is finished with.
+    bool readable(Connection& connection) {
+        char buffer[2048];
+        for (;;) {
+            const ssize_t n = ::recv(connection.fd, buffer, sizeof(buffer), 0);
+            if (n > 0) {
+                connection.request.append(buffer, static_cast<size_t>(n));
+                if (connection.request.find("\r\n\r\n") != std::string::npos) {
+                    respond(connection);
+                    return writable(connection);
+                }
+                if (connection.request.size() > kMaxRequest) {
+                    return false;
+                }
+                continue;
+            }
+            return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+        }
+    }
+
+    bool writable(Connection& connection) {
+        for (;;) {
+            const char *data;
+            size_t remaining;
+            if (connection.sent < connection.head.size()) {
+                data = connection.head.data() + connection.sent;
+                remaining = connection.head.size() - connection.sent;
+            } else {
+                const size_t offset = connection.sent - connection.head.size();
+                const size_t length = connection.body ? connection.body->size() : 0;
+                if (offset >= length) {
+                    return false; // done
+                }
+                data = connection.body->data() + offset;
+                remaining = length - offset;
+            }
+#ifdef MSG_NOSIGNAL
+            const ssize_t n = ::send(connection.fd, data, remaining, MSG_NOSIGNAL);
+#else
+            const ssize_t n = ::send(connection.fd, data, remaining, 0);
+#endif
+            if (n < 0) {
+                return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+            }
+            connection.sent += static_cast<size_t>(n);
+        }
+    }
+
+    void expire_connections() {
+        const auto now = ClockType::now();
+        std::vector<int> expired;
+        for (const auto& item : connections) {
+            if (now - item.second->started > kConnectionTimeout) {
+                expired.push_back(item.first);
+            }
+        }
+        for (auto fd : expired) {
+            close_connection(fd);
+        }
+    }
+
+    void run() {
+        std::vector<Poller::Event> events;
+        while (!stopping) {
+            if (!poller.wait(events, connections.empty() ? -1 : 1000)) {
+                break;
+            }
+            for (const auto& event : events) {
+                if (event.fd == stop.fd()) {
+                    stop.drain();
+                    continue;
+                }
+                if (event.fd == listen_fd) {
+                    accept_all();
+                    continue;
+                }
+                const auto iter = connections.find(event.fd);
+                if (iter == connections.end()) {
+                    continue;
+                }
+                Connection& connection = *iter->second;
+                bool open;
+                if (event.events & Poller::Error) {
+                    open = false;
+                } else if (connection.responding) {
+                    open = writable(connection);
+                } else {
+                    open = readable(connection);
+                }
+                if (!open) {
+                    close_connection(event.fd);
+                }
+            }
+            expire_connections();
+        }
+        while (!connections.empty()) {
+            close_connection(connections.begin()->first);
+        }
+    }
+};
+
+MetricsServer::MetricsServer(const std::string& address)
+    : impl_(new Impl)
+{
+    impl_->listen(address);
+    if (!impl_->poller.add(impl_->listen_fd, Poller::Read, nullptr) ||
+        !impl_->poller.add(impl_->stop.fd(), Poller::Read, nullptr)) {
+        (void)::close(impl_->listen_fd);
+        throw std::runtime_error("Can't poll metrics socket: " + std::string(::strerror(errno)));
+    }
+    impl_->current = std::make_shared<std::string>();
+    impl_->thread = std::thread([this](){
+        impl_->run();
+    });
+}
+
+MetricsServer::~MetricsServer()
+{
+    impl_->stopping = true;
+    impl_->stop.notify();
+    impl_->thread.join();
+    impl_->poller.remove(impl_->listen_fd);
+    (void)::close(impl_->listen_fd);
+}
+
+std::string& MetricsServer::buffer() {
+    // Nothing but this thread can get hold of the spare buffer, so once no scrape is still
+    // sending it, it is ours to reuse.
+    auto& spare = impl_->spare;
+    if (!spare || spare.use_count() > 1) {
+        spare = std::make_shared<std::string>();
+        spare->reserve(impl_->current->capacity());
+    }
+    spare->clear();
+    return *spare;
+}
+
+void MetricsServer::publish() {
+    std::lock_guard<std::mutex> lock(impl_->mutex);
+    std::swap(impl_->current, impl_->spare);
+}
+
+uint64_t MetricsServer::scrapes() const {
+    return impl_->scrapes;
+}
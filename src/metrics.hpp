@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// Appends samples in the Prometheus text exposition format to a buffer, without building
+// anything in between:
+//     writer.family("up", "gauge", "Whether the last check succeeded");
+//     writer.sample("up").label("server", name).value(1);
+// Samples of one family must follow its family() line.
+class MetricsWriter {
+public:
+    explicit MetricsWriter(std::string& out)
+        : out_(out)
+        , labels_(0)
+    {
+    }
+
+    void family(const char *name, const char *type, const char *help);
+
+    MetricsWriter& sample(const char *name);
+    MetricsWriter& label(const char *name, const std::string& value);
+    MetricsWriter& label(const char *name, const char *value);
+    void value(double value);
+    void value(uint64_t value);
+
+private:
+    void end_labels();
+
+    std::string& out_;
+    unsigned labels_; // of the sample being written
+};
+
+// Serves the latest rendered metrics over HTTP from a thread of its own, for Prometheus to
+// scrape. Rendering happens elsewhere into buffer(); publish() swaps it in, so a scrape only
+// copies bytes out of a finished buffer and never waits for a render. Buffers are reused
+// unless a slow scrape still holds the old one.
+class MetricsServer {
+public:
+    // Listens on "host:port", "[v6 host]:port" or just a port on 127.0.0.1. Throws
+    // std::runtime_error if it can't.
+    explicit MetricsServer(const std::string& address);
+    ~MetricsServer();
+
+    MetricsServer(const MetricsServer&) = delete;
+    MetricsServer& operator=(const MetricsServer&) = delete;
+
+    // An empty buffer to render the next snapshot into. Only one thread may render.
+    std::string& buffer();
+
+    // Makes the buffer the one served to scrapes from now on.
+    void publish();
+
+    uint64_t scrapes() const;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl_;
+};
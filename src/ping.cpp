@@ -0,0 +1,359 @@
+#include "ping.hpp"
+#include "poller.hpp"
+#include "resolver.hpp"
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+namespace {
+    using ClockType = std::chrono::steady_clock;
+
+    // Spacing between the echo requests sent to one host.
+    const auto kPacketInterval = std::chrono::milliseconds(250);
+    const size_t kPayloadSize = 16;
+    const size_t kMaxPacketSize = 2048;
+
+    const uint8_t kEchoRequest4 = 8;
+    const uint8_t kEchoReply4 = 0;
+    const uint8_t kEchoRequest6 = 128;
+    const uint8_t kEchoReply6 = 129;
+
+    struct IcmpHeader {
+        uint8_t type;
+        uint8_t code;
+        uint16_t checksum;
+        uint16_t id;
+        uint16_t sequence;
+    };
+
+    uint16_t icmp_checksum(const uint8_t *data, size_t len) {
+        uint32_t sum = 0;
+        for (size_t i = 0; i + 1 < len; i += 2) {
+            sum += static_cast<uint32_t>(data[i] << 8 | data[i + 1]);
+        }
+        if (len & 1) {
+            sum += static_cast<uint32_t>(data[len - 1] << 8);
+        }
+        while (sum >> 16) {
+            sum = (sum & 0xffff) + (sum >> 16);
+        }
+        return htons(static_cast<uint16_t>(~sum));
+    }
+
+    struct IcmpSocket {
+        int fd = -1;
+        bool raw = false;
+        std::string errorMessage;
+
+        ~IcmpSocket() {
+            if (fd >= 0) {
+                (void)::close(fd);
+            }
+        }
+
+        bool open(int family) {
+            const int protocol = family == AF_INET ? static_cast<int>(IPPROTO_ICMP) : static_cast<int>(IPPROTO_ICMPV6);
+            fd = open_socket(family, SOCK_DGRAM, protocol);
+            raw = false;
+            if (fd < 0) {
+                fd = open_socket(family, SOCK_RAW, protocol);
+                raw = true;
+            }
+            if (fd < 0) {
+                errorMessage = "Can't create ICMP socket: " + std::string(::strerror(errno));
+                return false;
+            }
+            if (::fcntl(fd, F_SETFL, O_NONBLOCK) != 0) {
+                errorMessage = "Can't set to non-blocking: " + std::string(::strerror(errno));
+                (void)::close(fd);
+                fd = -1;
+                return false;
+            }
+            return true;
+        }
+    };
+
+    bool same_address(const struct ::sockaddr_storage& a, const struct ::sockaddr_storage& b) {
+        if (a.ss_family != b.ss_family) {
+            return false;
+        }
+        if (a.ss_family == AF_INET) {
+            const auto& a4 = reinterpret_cast<const struct ::sockaddr_in&>(a);
+            const auto& b4 = reinterpret_cast<const struct ::sockaddr_in&>(b);
+            return a4.sin_addr.s_addr == b4.sin_addr.s_addr;
+        }
+        const auto& a6 = reinterpret_cast<const struct ::sockaddr_in6&>(a);
+        const auto& b6 = reinterpret_cast<const struct ::sockaddr_in6&>(b);
+        return std::memcmp(&a6.sin6_addr, &b6.sin6_addr, sizeof(a6.sin6_addr)) == 0;
+    }
+}
+
+struct PingMulti::Impl : EventLoop::Watcher {
+    // A host being pinged, kept by its ping() for as long as any request to it is pending.
+    struct Target {
+        struct ::sockaddr_storage address;
+        socklen_t addrlen = 0;
+        unsigned count = 0;
+        PingStats stats;
+        unsigned resolved = 0; // echo requests answered or given up on
+        double rtt_total = 0;
+        std::string errorMessage;
+        std::coroutine_handle<> waiter; // ping() waiting for the last request
+    };
+
+    struct Packet {
+        Target *target = nullptr;
+        ClockType::time_point sent;
+        EventLoop::TimerId timer = 0; // gives up on the request
+        bool pending = false;
+    };
+
+    // co_await answered(target) resumes once every request sent to it is resolved.
+    struct Answered {
+        Target& target;
+
+        bool await_ready() const noexcept {
+            return target.resolved >= target.count;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle) noexcept {
+            target.waiter = handle;
+        }
+
+        void await_resume() const noexcept {
+        }
+    };
+
+    Impl(EventLoop& loop, Resolver& resolver)
+        : loop(loop)
+        , resolver(resolver)
+        , limit(loop, std::numeric_limits<size_t>::max())
+    {
+    }
+
+    ~Impl() {
+        for (auto& packet : packets) {
+            if (packet.pending) {
+                loop.cancelTimer(packet.timer);
+            }
+        }
+        for (size_t i = 0; i < 2; ++i) {
+            if (opened[i] && sockets[i].fd >= 0 && sockets[i].errorMessage.empty()) {
+                loop.unwatch(sockets[i].fd);
+            }
+        }
+    }
+
+    EventLoop& loop;
+    Resolver& resolver;
+    InFlightLimit limit;
+    IcmpSocket sockets[2]; // AF_INET, AF_INET6
+    bool opened[2] = {false, false};
+    std::vector<Packet> packets; // indexed by sequence number
+    uint16_t id = static_cast<uint16_t>(::getpid());
+    uint16_t next_sequence = 0;
+
+    IcmpSocket& socket_for(const Target& target) {
+        return sockets[target.address.ss_family == AF_INET ? 0 : 1];
+    }
+
+    // The ICMP socket for the family, opened and watched on first use. Check its errorMessage.
+    IcmpSocket& open(int family) {
+        const size_t index = family == AF_INET ? 0 : 1;
+        IcmpSocket& socket = sockets[index];
+        if (!opened[index]) {
+            opened[index] = true;
+            if (socket.open(family) && !loop.watch(socket.fd, Poller::Read, this)) {
+                socket.errorMessage = "Can't poll socket: " + std::string(::strerror(errno));
+            }
+            if (packets.empty()) {
+                packets.resize(65536);
+            }
+        }
+        return socket;
+    }
+
+    void resolve(Target& target) {
+        if (++target.resolved >= target.count && target.waiter) {
+            loop.resume(std::exchange(target.waiter, nullptr));
+        }
+    }
+
+    void received(Packet& packet, ClockType::time_point now) {
+        Target& target = *packet.target;
+        packet.pending = false;
+        loop.cancelTimer(packet.timer);
+        const double rtt = std::chrono::duration<double, std::milli>(now - packet.sent).count();
+        PingStats& stats = target.stats;
+        if (stats.received == 0 || rtt < stats.rtt_min) {
+            stats.rtt_min = rtt;
+        }
+        if (rtt > stats.rtt_max) {
+            stats.rtt_max = rtt;
+        }
+        target.rtt_total += rtt;
+        ++stats.received;
+        resolve(target);
+    }
+
+    void expire(uint16_t sequence) {
+        Packet& packet = packets[sequence];
+        if (packet.pending) {
+            packet.pending = false;
+            resolve(*packet.target);
+        }
+    }
+
+    void send(Target& target, TimeoutType timeout) {
+        const uint16_t sequence = next_sequence++;
+        Packet& packet = packets[sequence];
+        if (packet.pending) {
+            // More requests in flight than sequence numbers, give up on the oldest one.
+            loop.cancelTimer(packet.timer);
+            expire(sequence);
+        }
+
+        const bool v4 = target.address.ss_family == AF_INET;
+        uint8_t buffer[sizeof(IcmpHeader) + kPayloadSize];
+        std::memset(buffer, 0, sizeof(buffer));
+        IcmpHeader header;
+        header.type = v4 ? kEchoRequest4 : kEchoRequest6;
+        header.code = 0;
+        header.checksum = 0;
+        header.id = htons(id); // replaced by the kernel for SOCK_DGRAM sockets
+        header.sequence = htons(sequence);
+        std::memcpy(buffer, &header, sizeof(header));
+        std::memcpy(buffer + sizeof(header), "ServerMonitor", 13);
+        if (v4) {
+            header.checksum = icmp_checksum(buffer, sizeof(buffer)); // the kernel computes it for ICMPv6
+            std::memcpy(buffer, &header, sizeof(header));
+        }
+
+        ++target.stats.sent;
+        const IcmpSocket& socket = socket_for(target);
+        const ssize_t sent = ::sendto(socket.fd, buffer, sizeof(buffer), 0, reinterpret_cast<const struct ::sockaddr*>(&target.address), target.addrlen);
+        if (sent < 0) {
+            target.errorMessage = "Can't send: " + std::string(::strerror(errno));
+            resolve(target);
+            return;
+        }
+        packet.target = &target;
+        packet.sent = ClockType::now();
+        packet.pending = true;
+        packet.timer = loop.addTimer(packet.sent + std::chrono::seconds(timeout), [this, sequence](){
+            expire(sequence);
+        });
+    }
+
+    virtual void ready(int fd, unsigned) override {
+        const size_t index = fd == sockets[0].fd ? 0 : 1;
+        const IcmpSocket& socket = sockets[index];
+        const int family = index == 0 ? AF_INET : AF_INET6;
+        uint8_t buffer[kMaxPacketSize];
+        for (;;) {
+            struct ::sockaddr_storage from;
+            socklen_t fromlen = sizeof(from);
+            const ssize_t len = ::recvfrom(socket.fd, buffer, sizeof(buffer), 0, reinterpret_cast<struct ::sockaddr*>(&from), &fromlen);
+            if (len < 0) {
+                return; // EAGAIN or a transient error, either way nothing more to read now
+            }
+            const auto now = ClockType::now();
+            size_t offset = 0;
+            if (family == AF_INET && len > 0 && (buffer[0] >> 4) == 4) {
+                offset = (buffer[0] & 0x0f) * 4; // raw (and macOS datagram) sockets include the IP header
+            }
+            if (static_cast<size_t>(len) < offset + sizeof(IcmpHeader)) {
+                continue;
+            }
+            IcmpHeader header;
+            std::memcpy(&header, buffer + offset, sizeof(header));
+            if (header.type != (family == AF_INET ? kEchoReply4 : kEchoReply6)) {
+                continue;
+            }
+            if (socket.raw && ntohs(header.id) != id) {
+                continue; // raw sockets see every ICMP packet, including other processes' pings
+            }
+            Packet& packet = packets[ntohs(header.sequence)];
+            if (packet.pending && same_address(packet.target->address, from)) {
+                received(packet, now);
+            }
+        }
+    }
+};
+
+PingMulti::PingMulti(EventLoop& loop, Resolver& resolver)
+    : impl_(new Impl(loop, resolver))
+{
+}
+
+PingMulti::~PingMulti() = default;
+
+bool PingMulti::available() {
+    static const bool result = [](){
+        IcmpSocket socket;
+        return socket.open(AF_INET);
+    }();
+    return result;
+}
+
+void PingMulti::setMaxInFlight(size_t max_in_flight) {
+    impl_->limit.setMax(max_in_flight);
+}
+
+Task<bool> PingMulti::ping(const PingParams& params, PingStats& stats, ProbeError& error) {
+    Impl& impl = *impl_;
+    const auto deadline = EventLoop::ClockType::now() + std::chrono::seconds(params.timeout);
+    const ResolvedPtr resolved = co_await Resolve(impl.loop, impl.resolver, params.host, deadline);
+    if (!resolved) {
+        error.set(ErrorCode::Timeout, "Timed out");
+        co_return false;
+    }
+    if (resolved->addresses.empty()) {
+        error.set(ErrorCode::Dns, resolved->errorMessage);
+        co_return false;
+    }
+    // The first address is used, as the ping command does.
+    Impl::Target target;
+    const ResolvedAddress& address = resolved->addresses.front();
+    std::memcpy(&target.address, &address.address, sizeof(address.address));
+    target.addrlen = address.length;
+    target.count = params.count > 0 ? params.count : 1;
+    const IcmpSocket& socket = impl.open(target.address.ss_family);
+    if (!socket.errorMessage.empty()) {
+        error.set(ErrorCode::Other, socket.errorMessage);
+        co_return false;
+    }
+
+    // Requests to one host are spaced out, so multi-packet pings don't trip ICMP rate
+    // limiting on the target.
+    const auto slot = co_await impl.limit.acquire();
+    for (unsigned i = 0; i < target.count; ++i) {
+        if (i > 0) {
+            co_await impl.loop.sleep(kPacketInterval);
+        }
+        impl.send(target, params.timeout);
+    }
+    co_await Impl::Answered{target};
+
+    stats = target.stats;
+    if (stats.received > 0) {
+        stats.rtt_avg = target.rtt_total / stats.received;
+        co_return true;
+    }
+    if (target.errorMessage.empty()) {
+        error.set(ErrorCode::NoReply, "No reply (100% packet loss)");
+    } else {
+        error.set(ErrorCode::Other, target.errorMessage);
+    }
+    co_return false;
+}
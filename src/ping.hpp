@@ -0,0 +1,55 @@
+#pragma once
+
+#include "error_code.hpp"
+#include "event_loop.hpp"
+#include "task.hpp"
+#include "types.hpp"
+#include <memory>
+#include <string>
+
+class Resolver;
+
+struct PingParams {
+    std::string host;
+    TimeoutType timeout; // per echo request
+    unsigned count;      // number of echo requests to send
+};
+
+struct PingStats {
+    unsigned sent = 0;
+    unsigned received = 0;
+    double rtt_min = 0; // milliseconds
+    double rtt_avg = 0;
+    double rtt_max = 0;
+
+    double loss() const {
+        return sent > 0 ? 100.0 * (sent - received) / sent : 100.0;
+    }
+};
+
+// Sends ICMP echo requests to any number of hosts at once from an EventLoop, through one
+// socket per address family, and matches the replies by identifier and sequence number.
+// Unprivileged SOCK_DGRAM ICMP sockets are used where the system allows them, with raw sockets
+// as the fallback.
+class PingMulti {
+public:
+    PingMulti(EventLoop& loop, Resolver& resolver);
+    ~PingMulti();
+
+    PingMulti(const PingMulti&) = delete;
+    PingMulti& operator=(const PingMulti&) = delete;
+
+    // Whether an ICMP socket can be opened at all by this process.
+    static bool available();
+
+    // Limits how many hosts are pinged at once; the rest wait for a free slot.
+    void setMaxInFlight(size_t max_in_flight);
+
+    // Completes once every echo request sent to the host has been answered or has timed out.
+    // The host is up if any request was answered.
+    Task<bool> ping(const PingParams& params, PingStats& stats, ProbeError& error);
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl_;
+};
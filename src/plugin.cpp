@@ -0,0 +1,803 @@
+#include "plugin.hpp"
+#include "servermonitor_plugin.h"
+#include "json.hpp"
+#include "poller.hpp"
+#include "spawn.hpp"
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef __APPLE__
+#include <limits.h>
+#include <mach-o/dyld.h>
+#endif
+
+extern char **environ;
+
+const char kServePluginOption[] = "--serve-plugin";
+
+// A check handed to a plugin, until the plugin completes it.
+struct sm_check {
+    explicit sm_check(EventLoop& loop)
+        : loop(loop)
+    {
+    }
+
+    EventLoop& loop;
+    PluginResult result;
+    bool abandoned = false; // nothing waits for the result any more, so completing only frees it
+    std::function<void(sm_check*)> completed; // takes the result, and frees the check or has it freed
+};
+
+namespace {
+    using json = nlohmann::json;
+    using ClockType = EventLoop::ClockType;
+
+    // How long past its timeout a plugin has to complete a check.
+    const auto kCompleteGrace = std::chrono::seconds(1);
+    // How long the process of a plugin has to exit once asked to, before it is killed.
+    const auto kExitGrace = std::chrono::milliseconds(100);
+    // How often a process that was asked to exit is looked at until it has.
+    const auto kReapInterval = std::chrono::milliseconds(10);
+    // How long the process of a plugin waits for checks before waiting again.
+    const auto kIdleWait = std::chrono::hours(1);
+
+    const char kTimedOut[] = "Timed out: plugin didn't complete the check";
+
+    EventLoop& event_loop(sm_loop *loop) {
+        return *reinterpret_cast<EventLoop*>(loop);
+    }
+
+    sm_loop* plugin_loop(EventLoop& loop) {
+        return reinterpret_cast<sm_loop*>(&loop);
+    }
+
+    unsigned timeout_millis(TimeoutType timeout) {
+        return static_cast<unsigned>(timeout) * 1000;
+    }
+
+    // A wait of a plugin for a descriptor or a timer, which frees itself once it calls back.
+    class HostWait final : private EventLoop::Watcher {
+    public:
+        static int start(EventLoop& loop, int fd, unsigned events, unsigned timeout_ms, sm_ready_fn callback, void *data) {
+            HostWait *wait = new HostWait(loop, fd, callback, data);
+            if (fd >= 0) {
+                unsigned watched = 0;
+                if (events & SM_READ) {
+                    watched |= Poller::Read;
+                }
+                if (events & SM_WRITE) {
+                    watched |= Poller::Write;
+                }
+                if (!loop.watch(fd, watched, wait)) {
+                    const int error = errno;
+                    delete wait;
+                    return error != 0 ? error : EINVAL;
+                }
+            }
+            wait->timer_ = loop.addTimer(ClockType::now() + std::chrono::milliseconds(timeout_ms), [wait](){
+                wait->timer_ = 0;
+                wait->finish(SM_TIMEOUT);
+            });
+            return 0;
+        }
+
+    private:
+        HostWait(EventLoop& loop, int fd, sm_ready_fn callback, void *data)
+            : loop_(loop)
+            , fd_(fd)
+            , callback_(callback)
+            , data_(data)
+        {
+        }
+
+        virtual void ready(int, unsigned events) override {
+            unsigned ready = 0;
+            if (events & Poller::Read) {
+                ready |= SM_READ;
+            }
+            if (events & Poller::Write) {
+                ready |= SM_WRITE;
+            }
+            if (events & Poller::Error) {
+                ready |= SM_READ | SM_WRITE; // so the plugin finds out what from its next call
+            }
+            finish(ready);
+        }
+
+        void finish(unsigned events) {
+            if (timer_ != 0) {
+                loop_.cancelTimer(timer_);
+            }
+            if (fd_ >= 0) {
+                loop_.unwatch(fd_);
+            }
+            const sm_ready_fn callback = callback_;
+            void *data = data_;
+            delete this;
+            callback(data, events); // last, as it may wait for the descriptor again
+        }
+
+        EventLoop& loop_;
+        const int fd_;
+        const sm_ready_fn callback_;
+        void *const data_;
+        EventLoop::TimerId timer_ = 0;
+    };
+
+    int host_wait(sm_loop *loop, int fd, unsigned events, unsigned timeout_ms, sm_ready_fn callback, void *data) {
+        return HostWait::start(event_loop(loop), fd, events, timeout_ms, callback, data);
+    }
+
+    void host_complete(sm_check *check, int up, const char *error, int64_t latency_us) {
+        if (check->abandoned) {
+            delete check;
+            return;
+        }
+        auto& result = check->result;
+        result.up = up != 0;
+        if (!result.up) {
+            result.error.set(ErrorCode::Other, error && *error ? error : "Plugin reported the server down");
+        }
+        result.latency = latency_us;
+        check->completed(check);
+    }
+
+    const sm_host kHost = {SM_PLUGIN_API_VERSION, host_wait, host_complete};
+
+    // Loads the plugin, once per path. Libraries are never unloaded, as a plugin may still have
+    // waits outstanding from a check it didn't complete in time.
+    const sm_plugin& load_plugin(const std::string& path) {
+        static std::mutex mutex;
+        static std::unordered_map<std::string, const sm_plugin*> plugins;
+        std::lock_guard<std::mutex> lock(mutex);
+        const auto iter = plugins.find(path);
+        if (iter != plugins.end()) {
+            return *iter->second;
+        }
+        void *handle = ::dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+        if (!handle) {
+            const char *error = ::dlerror();
+            throw std::runtime_error("Can't load plugin " + path + ": " + (error ? error : "unknown error"));
+        }
+        const auto entry = reinterpret_cast<sm_plugin_entry>(::dlsym(handle, SM_PLUGIN_ENTRY));
+        if (!entry) {
+            (void)::dlclose(handle);
+            throw std::runtime_error("Plugin " + path + " has no " SM_PLUGIN_ENTRY "()");
+        }
+        const sm_plugin *plugin = entry(&kHost);
+        if (!plugin || plugin->api_version != SM_PLUGIN_API_VERSION || !plugin->create || !plugin->start) {
+            (void)::dlclose(handle);
+            throw std::runtime_error("Plugin " + path + " doesn't support API version " + std::to_string(SM_PLUGIN_API_VERSION));
+        }
+        plugins[path] = plugin;
+        return *plugin;
+    }
+
+    // The plugin's monitor for the options. Throws std::runtime_error if it rejects them.
+    void* create_monitor(const sm_plugin& plugin, const PluginOptions& options) {
+        std::vector<const char*> pairs;
+        pairs.reserve(options.size() * 2 + 1);
+        for (const auto& option : options) {
+            pairs.push_back(option.first.c_str());
+            pairs.push_back(option.second.c_str());
+        }
+        pairs.push_back(nullptr);
+        char error[256] = "";
+        void *monitor = plugin.create(pairs.data(), error, sizeof(error));
+        if (!monitor) {
+            error[sizeof(error) - 1] = '\0';
+            throw std::runtime_error(std::string("Invalid plugin options: ") + (error[0] ? error : "rejected by the plugin"));
+        }
+        return monitor;
+    }
+
+    // co_await Completion{...} starts the check and resumes once the plugin completes it, yielding
+    // true, or once its time is up, yielding false.
+    class Completion {
+    public:
+        Completion(const sm_plugin& plugin, void *monitor, sm_check *check, TimeoutType timeout)
+            : plugin_(plugin)
+            , monitor_(monitor)
+            , check_(check)
+            , timeout_(timeout)
+        {
+        }
+
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle) {
+            handle_ = handle;
+            check_->completed = [this](sm_check*) {
+                completed_ = true;
+                wake();
+            };
+            timer_ = check_->loop.addTimer(ClockType::now() + std::chrono::seconds(timeout_) + kCompleteGrace, [this](){
+                timer_ = 0;
+                wake();
+            });
+            plugin_.start(monitor_, plugin_loop(check_->loop), check_, timeout_millis(timeout_));
+        }
+
+        bool await_resume() {
+            if (timer_ != 0) {
+                check_->loop.cancelTimer(timer_);
+            }
+            return completed_;
+        }
+
+    private:
+        // From the loop, as the plugin may complete the check before start() returns.
+        void wake() {
+            if (!woken_) {
+                woken_ = true;
+                check_->loop.resume(handle_);
+            }
+        }
+
+        const sm_plugin& plugin_;
+        void *monitor_;
+        sm_check *check_;
+        const TimeoutType timeout_;
+        std::coroutine_handle<> handle_;
+        EventLoop::TimerId timer_ = 0;
+        bool completed_ = false;
+        bool woken_ = false;
+    };
+
+    bool set_nonblocking(int fd) {
+        const int flags = ::fcntl(fd, F_GETFL);
+        return flags >= 0 && ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+    }
+
+    // Appends what fd has to input without blocking. Returns false at end of file or on error.
+    bool read_available(int fd, std::string& input) {
+        char buffer[4096];
+        for (;;) {
+            const ssize_t n = ::read(fd, buffer, sizeof(buffer));
+            if (n > 0) {
+                input.append(buffer, static_cast<size_t>(n));
+                continue;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        }
+    }
+
+    bool write_all(int fd, const std::string& data) {
+        size_t written = 0;
+        while (written < data.size()) {
+            const ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            written += static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    std::string how_ended(int status) {
+        return WIFSIGNALED(status)
+            ? "killed by signal " + std::to_string(WTERMSIG(status))
+            : "exited with status " + std::to_string(WEXITSTATUS(status));
+    }
+
+    // Reaps a process that was asked to exit from timers on the loop rather than by waiting for
+    // it there, killing it once give_up has passed. Calls ended, if set, with how it ended.
+    void reap(EventLoop& loop, pid_t pid, ClockType::time_point give_up, std::function<void(const std::string&)> ended) {
+        int status = 0;
+        pid_t reaped;
+        while ((reaped = ::waitpid(pid, &status, WNOHANG)) < 0 && errno == EINTR) {
+        }
+        if (reaped != 0) {
+            if (ended) {
+                ended(reaped < 0 ? "exited" : how_ended(status));
+            }
+            return;
+        }
+        const auto now = ClockType::now();
+        if (now >= give_up) {
+            (void)::kill(pid, SIGKILL);
+        }
+        (void)loop.addTimer(now + kReapInterval, [&loop, pid, give_up, ended = std::move(ended)]() mutable {
+            reap(loop, pid, give_up, std::move(ended));
+        });
+    }
+
+    std::string executable_path() {
+#ifdef __APPLE__
+        char path[PATH_MAX];
+        uint32_t size = sizeof(path);
+        return ::_NSGetExecutablePath(path, &size) == 0 ? path : "";
+#else
+        return "/proc/self/exe";
+#endif
+    }
+
+    // The process an isolated plugin runs in, shared by every server of the library and started
+    // on its first check. Checks go to it as JSON lines on its stdin and their results come back
+    // as JSON lines on its stdout.
+    class PluginProcess : private EventLoop::Watcher, public std::enable_shared_from_this<PluginProcess> {
+    public:
+        static std::shared_ptr<PluginProcess> get(const std::string& path) {
+            static std::unordered_map<std::string, std::weak_ptr<PluginProcess>> processes;
+            auto& entry = processes[path];
+            auto process = entry.lock();
+            if (!process) {
+                process = std::make_shared<PluginProcess>(path);
+                entry = process;
+            }
+            return process;
+        }
+
+        explicit PluginProcess(const std::string& path)
+            : path_(path)
+        {
+        }
+
+        // Nothing is left for the process to do, and the loop may not run again to reap it
+        // after a grace period.
+        ~PluginProcess() {
+            stop(true);
+        }
+
+        PluginProcess(const PluginProcess&) = delete;
+        PluginProcess& operator=(const PluginProcess&) = delete;
+
+        // options is the JSON of the PluginOptions.
+        Task<bool> check(EventLoop& loop, const std::string& options, TimeoutType timeout, PluginResult& result) {
+            result = PluginResult();
+            std::string errorMessage;
+            if (!running(loop, errorMessage)) {
+                result.error.set(ErrorCode::Other, errorMessage);
+                co_return false;
+            }
+            const uint64_t id = ++next_id_;
+            const std::string request = "{\"id\":" + std::to_string(id) + ",\"timeout\":" + std::to_string(timeout) + ",\"options\":" + options + "}\n";
+            if (!write_all(to_, request)) {
+                const int error = errno;
+                result.error.set(ErrorCode::Other, error == EAGAIN || error == EWOULDBLOCK ? "Plugin process isn't taking checks" : "Can't send check to plugin process: " + std::string(::strerror(error)));
+                restart(result.error.message);
+                co_return false;
+            }
+            const uint64_t replies = replies_;
+            Pending pending;
+            pending.result = &result;
+            if (co_await Reply(*this, id, pending, ClockType::now() + std::chrono::seconds(timeout) + kCompleteGrace)) {
+                co_return result.up;
+            }
+            result.error.set(ErrorCode::Timeout, kTimedOut);
+            if (replies_ == replies) {
+                // Nothing at all has come back since, so it is stuck rather than one check lost.
+                restart("Plugin process stuck and restarted");
+            }
+            co_return false;
+        }
+
+    private:
+        struct Pending {
+            PluginResult *result = nullptr;
+            std::coroutine_handle<> handle;
+            EventLoop::TimerId timer = 0;
+            bool answered = false;
+        };
+
+        // co_await Reply{...} yields true once the check is answered, or false at the deadline.
+        class Reply {
+        public:
+            Reply(PluginProcess& process, uint64_t id, Pending& pending, ClockType::time_point deadline)
+                : process_(process)
+                , id_(id)
+                , pending_(pending)
+                , deadline_(deadline)
+            {
+            }
+
+            bool await_ready() const noexcept {
+                return false;
+            }
+
+            void await_suspend(std::coroutine_handle<> handle) {
+                pending_.handle = handle;
+                process_.expect(id_, pending_, deadline_);
+            }
+
+            bool await_resume() const noexcept {
+                return pending_.answered;
+            }
+
+        private:
+            PluginProcess& process_;
+            const uint64_t id_;
+            Pending& pending_;
+            const ClockType::time_point deadline_;
+        };
+
+        void expect(uint64_t id, Pending& pending, ClockType::time_point deadline) {
+            pending_[id] = &pending;
+            pending.timer = loop_->addTimer(deadline, [this, id](){
+                const auto iter = pending_.find(id);
+                if (iter != pending_.end()) {
+                    Pending& expired = *iter->second;
+                    expired.timer = 0;
+                    pending_.erase(iter);
+                    loop_->resume(expired.handle);
+                }
+            });
+        }
+
+        void answer(Pending& pending) {
+            if (pending.timer != 0) {
+                loop_->cancelTimer(pending.timer);
+            }
+            pending.answered = true;
+            loop_->resume(pending.handle);
+        }
+
+        void failAll(const std::string& error) {
+            for (auto& item : pending_) {
+                item.second->result->error.set(ErrorCode::Other, error);
+                answer(*item.second);
+            }
+            pending_.clear();
+        }
+
+        // Starts the process unless it is already running on the loop.
+        bool running(EventLoop& loop, std::string& errorMessage) {
+            if (pid_ >= 0) {
+                int status = 0;
+                const pid_t reaped = ::waitpid(pid_, &status, WNOHANG);
+                if (reaped == 0 && &loop == loop_) {
+                    return true;
+                }
+                if (reaped == pid_) {
+                    pid_ = -1; // exited since its last check
+                }
+                stop(false);
+            }
+            return start(loop, errorMessage);
+        }
+
+        bool start(EventLoop& loop, std::string& errorMessage) {
+            loop_ = &loop;
+            int in[2];
+            int out[2];
+            if (!open_pipe(in)) {
+                errorMessage = "Can't start plugin process: " + std::string(::strerror(errno));
+                return false;
+            }
+            if (!open_pipe(out)) {
+                errorMessage = "Can't start plugin process: " + std::string(::strerror(errno));
+                (void)::close(in[0]);
+                (void)::close(in[1]);
+                return false;
+            }
+            posix_spawn_file_actions_t actions;
+            int error = ::posix_spawn_file_actions_init(&actions);
+            if (error == 0) {
+                const std::string executable = executable_path();
+                char option[sizeof(kServePluginOption)];
+                std::memcpy(option, kServePluginOption, sizeof(option));
+                char *argv[] = {const_cast<char*>(executable.c_str()), option, const_cast<char*>(path_.c_str()), nullptr};
+                if ((error = ::posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO)) == 0 &&
+                    (error = ::posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO)) == 0 &&
+                    (error = close_inherited(&actions)) == 0) {
+                    error = ::posix_spawn(&pid_, executable.c_str(), &actions, nullptr, argv, environ);
+                }
+                (void)::posix_spawn_file_actions_destroy(&actions);
+            }
+            (void)::close(in[0]);
+            (void)::close(out[1]);
+            to_ = in[1];
+            from_ = out[0];
+            if (error != 0) {
+                pid_ = -1;
+                errorMessage = "Can't start plugin process: " + std::string(::strerror(error));
+                stop(false);
+                return false;
+            }
+            if (!set_nonblocking(to_) || !set_nonblocking(from_) || !loop.watch(from_, Poller::Read, this)) {
+                errorMessage = "Can't watch plugin process: " + std::string(::strerror(errno));
+                stop(true);
+                return false;
+            }
+            return true;
+        }
+
+        // Closes the pipes, which has the process exit, and leaves it to be reaped on the loop,
+        // killed if it doesn't exit in time or kill is set. Calls ended, if set, with how it
+        // ended.
+        void stop(bool kill, std::function<void(const std::string&)> ended = nullptr) {
+            if (from_ >= 0) {
+                if (loop_) {
+                    loop_->unwatch(from_);
+                }
+                (void)::close(from_);
+                from_ = -1;
+            }
+            if (to_ >= 0) {
+                (void)::close(to_);
+                to_ = -1;
+            }
+            input_.clear();
+            if (pid_ < 0) {
+                if (ended) {
+                    ended("exited");
+                }
+                return;
+            }
+            if (kill) {
+                (void)::kill(pid_, SIGKILL);
+            }
+            reap(*loop_, pid_, ClockType::now() + kExitGrace, std::move(ended));
+            pid_ = -1;
+        }
+
+        void restart(const std::string& error) {
+            stop(true);
+            failAll(error);
+        }
+
+        // Fails the checks of ids that are still waiting for a reply.
+        void fail(const std::vector<uint64_t>& ids, const std::string& error) {
+            for (uint64_t id : ids) {
+                const auto iter = pending_.find(id);
+                if (iter != pending_.end()) {
+                    Pending& pending = *iter->second;
+                    pending_.erase(iter);
+                    pending.result->error.set(ErrorCode::Other, error);
+                    answer(pending);
+                }
+            }
+        }
+
+        // Results from the process, or its end.
+        virtual void ready(int, unsigned) override {
+            const bool open = read_available(from_, input_);
+            size_t start = 0;
+            size_t end;
+            while ((end = input_.find('\n', start)) != std::string::npos) {
+                const json reply = json::parse(input_.begin() + start, input_.begin() + end, nullptr, false);
+                start = end + 1;
+                ++replies_;
+                if (!reply.is_object()) {
+                    continue;
+                }
+                const auto reply_end = reply.end();
+                const auto id = reply.find("id");
+                if (id == reply_end || !id->is_number_unsigned()) {
+                    continue;
+                }
+                const auto iter = pending_.find(id->get<uint64_t>());
+                if (iter == pending_.end()) {
+                    continue; // given up on already
+                }
+                Pending& pending = *iter->second;
+                pending_.erase(iter);
+                PluginResult& result = *pending.result;
+                const auto up = reply.find("up");
+                result.up = up != reply_end && up->is_boolean() && up->get<bool>();
+                const auto error = reply.find("error");
+                if (error != reply_end && error->is_string()) {
+                    result.error.message = error->get<std::string>();
+                }
+                const auto code = reply.find("code");
+                if (code != reply_end && code->is_number_unsigned() && code->get<uint64_t>() < kErrorCodeCount) {
+                    result.error.code = static_cast<ErrorCode>(code->get<uint64_t>());
+                } else if (!result.up) {
+                    result.error.code = ErrorCode::Other;
+                }
+                const auto latency = reply.find("latency");
+                if (latency != reply_end && latency->is_number_integer()) {
+                    result.latency = latency->get<int64_t>();
+                }
+                answer(pending);
+            }
+            input_.erase(0, start);
+            if (!open) {
+                // The checks sent to it fail once it is reaped and it is known how it ended.
+                // Any sent before then go to a process started in its place.
+                std::vector<uint64_t> ids;
+                for (const auto& item : pending_) {
+                    ids.push_back(item.first);
+                }
+                stop(false, [process = weak_from_this(), ids](const std::string& how) {
+                    if (const auto alive = process.lock()) {
+                        alive->fail(ids, "Plugin process " + how);
+                    }
+                });
+            }
+        }
+
+        const std::string path_;
+        EventLoop *loop_ = nullptr;
+        pid_t pid_ = -1;
+        int to_ = -1;   // its stdin
+        int from_ = -1; // its stdout
+        std::string input_;
+        uint64_t next_id_ = 0;
+        uint64_t replies_ = 0;
+        std::unordered_map<uint64_t, Pending*> pending_;
+    };
+
+    // What the process of a plugin keeps of the monitors it has created.
+    struct ServedMonitor {
+        void *monitor = nullptr;
+        std::string error; // why it couldn't be created
+    };
+
+    void send_result(int fd, uint64_t id, const PluginResult& result) {
+        json reply;
+        reply["id"] = id;
+        reply["up"] = result.up;
+        if (result.error.code != ErrorCode::None) {
+            reply["code"] = static_cast<unsigned>(result.error.code);
+            reply["error"] = result.error.message;
+        }
+        if (result.latency >= 0) {
+            reply["latency"] = result.latency;
+        }
+        (void)write_all(fd, reply.dump() + "\n");
+    }
+
+    void serve_check(EventLoop& loop, const sm_plugin *plugin, const std::string& load_error, std::unordered_map<std::string, ServedMonitor>& monitors, const std::string& line, int results) {
+        const json request = json::parse(line, nullptr, false);
+        if (!request.is_object()) {
+            return;
+        }
+        const auto end = request.end();
+        const auto id_iter = request.find("id");
+        const auto timeout_iter = request.find("timeout");
+        const auto options_iter = request.find("options");
+        if (id_iter == end || timeout_iter == end || options_iter == end) {
+            return;
+        }
+        const uint64_t id = id_iter->get<uint64_t>();
+        PluginResult failed;
+        if (!plugin) {
+            failed.error.set(ErrorCode::Other, load_error);
+            send_result(results, id, failed);
+            return;
+        }
+        auto& served = monitors[options_iter->dump()];
+        if (!served.monitor && served.error.empty()) {
+            try {
+                served.monitor = create_monitor(*plugin, options_iter->get<PluginOptions>());
+            } catch (const std::exception& ex) {
+                served.error = ex.what();
+            }
+        }
+        if (!served.monitor) {
+            failed.error.set(ErrorCode::Other, served.error);
+            send_result(results, id, failed);
+            return;
+        }
+        sm_check *check = new sm_check(loop);
+        check->completed = [id, results](sm_check *check) {
+            send_result(results, id, check->result);
+            delete check;
+        };
+        plugin->start(served.monitor, plugin_loop(loop), check, timeout_millis(timeout_iter->get<TimeoutType>()));
+    }
+
+    Task<void> serve_checks(EventLoop& loop, const sm_plugin *plugin, const std::string& load_error, int results) {
+        std::unordered_map<std::string, ServedMonitor> monitors; // by the JSON of their options
+        std::string input;
+        for (;;) {
+            const int error = co_await loop.wait(STDIN_FILENO, Poller::Read, ClockType::now() + kIdleWait);
+            if (error == ETIMEDOUT) {
+                continue;
+            }
+            if (error != 0) {
+                co_return;
+            }
+            const bool open = read_available(STDIN_FILENO, input);
+            size_t start = 0;
+            size_t end;
+            while ((end = input.find('\n', start)) != std::string::npos) {
+                serve_check(loop, plugin, load_error, monitors, input.substr(start, end - start), results);
+                start = end + 1;
+            }
+            input.erase(0, start);
+            if (!open) {
+                co_return; // ServerMonitor is gone
+            }
+        }
+    }
+}
+
+struct PluginCheck::Impl {
+    // In this process
+    const sm_plugin *plugin = nullptr;
+    void *monitor = nullptr;
+    bool abandoned = false; // a check the plugin may still complete, so monitor must stay
+
+    // Isolated
+    std::shared_ptr<PluginProcess> process;
+    std::string options; // as JSON
+};
+
+PluginCheck::PluginCheck(const std::string& path, const PluginOptions& options, bool isolate)
+    : impl_(new Impl)
+{
+    if (isolate) {
+        impl_->process = PluginProcess::get(path);
+        impl_->options = json(options).dump();
+    } else {
+        impl_->plugin = &load_plugin(path);
+        impl_->monitor = create_monitor(*impl_->plugin, options);
+    }
+}
+
+PluginCheck::~PluginCheck()
+{
+    if (impl_->monitor && impl_->plugin->destroy && !impl_->abandoned) {
+        impl_->plugin->destroy(impl_->monitor);
+    }
+}
+
+Task<bool> PluginCheck::run(EventLoop& loop, TimeoutType timeout, PluginResult& result) {
+    Impl& impl = *impl_;
+    if (impl.process) {
+        co_return co_await impl.process->check(loop, impl.options, timeout, result);
+    }
+    sm_check *check = new sm_check(loop);
+    if (!co_await Completion(*impl.plugin, impl.monitor, check, timeout)) {
+        // Freed once the plugin completes it, if ever.
+        check->abandoned = true;
+        check->completed = nullptr;
+        impl.abandoned = true;
+        result = PluginResult();
+        result.error.set(ErrorCode::Timeout, kTimedOut);
+        co_return false;
+    }
+    result = std::move(check->result);
+    delete check;
+    co_return result.up;
+}
+
+int ServePlugin(const std::string& path) {
+    // It goes once ServerMonitor closes its end of stdin, not on signals meant for ServerMonitor,
+    // so that stopping both doesn't fail the checks in flight first.
+    (void)std::signal(SIGINT, SIG_IGN);
+    (void)std::signal(SIGHUP, SIG_IGN);
+    (void)std::signal(SIGTERM, SIG_IGN);
+    (void)std::signal(SIGPIPE, SIG_IGN);
+    // Results go to the original stdout, and anything the plugin prints to stderr instead.
+    const int results = ::fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+    if (results < 0 || ::dup2(STDERR_FILENO, STDOUT_FILENO) < 0 || !set_nonblocking(STDIN_FILENO)) {
+        return EXIT_FAILURE;
+    }
+
+    const sm_plugin *plugin = nullptr;
+    std::string load_error;
+    try {
+        plugin = &load_plugin(path);
+    } catch (const std::exception& ex) {
+        load_error = ex.what();
+    }
+    EventLoop loop;
+    loop.spawn(serve_checks(loop, plugin, load_error, results), [](){
+    });
+    loop.run();
+    return EXIT_SUCCESS;
+}
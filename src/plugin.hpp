@@ -0,0 +1,48 @@
+#pragma once
+
+#include "error_code.hpp"
+#include "event_loop.hpp"
+#include "task.hpp"
+#include "types.hpp"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+// The "options" of a plugin server, handed to the plugin's create() in order.
+using PluginOptions = std::vector<std::pair<std::string, std::string>>;
+
+struct PluginResult {
+    bool up = false;
+    ProbeError error;
+    int64_t latency = -1; // microseconds, as the plugin measured it; negative if it didn't
+};
+
+// The command line option that runs ServerMonitor as the process of an isolated plugin.
+extern const char kServePluginOption[];
+
+// The monitor of one server implemented by a plugin, a shared library with the C interface of
+// servermonitor_plugin.h. It runs in this process on the loop of the check or, isolated, in a
+// process of its own shared by every server of the library, which is started again once it
+// crashes. A plugin that doesn't report within a second past the timeout is given up on.
+class PluginCheck {
+public:
+    // Throws std::runtime_error if the plugin can't be loaded or rejects the options; isolated,
+    // that only shows when it is run.
+    PluginCheck(const std::string& path, const PluginOptions& options, bool isolate);
+    ~PluginCheck();
+
+    PluginCheck(const PluginCheck&) = delete;
+    PluginCheck& operator=(const PluginCheck&) = delete;
+
+    Task<bool> run(EventLoop& loop, TimeoutType timeout, PluginResult& result);
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl_;
+};
+
+// The process of an isolated plugin: runs the checks PluginCheck sends it on stdin, answering
+// on stdout, until stdin closes. Returns the exit status.
+int ServePlugin(const std::string& path);
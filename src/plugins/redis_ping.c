@@ -0,0 +1,270 @@
+/*
+ * Sample ServerMonitor plugin: sends a Redis PING and expects +PONG, on ServerMonitor's event
+ * loop without blocking. The latency it reports is from sending the PING to the reply.
+ *
+ * Options:
+ *   "host"     the server, resolved once when the configuration loads (default 127.0.0.1)
+ *   "port"     (default 6379)
+ *   "password" sent with AUTH first, if set
+ *
+ *   {"name": "Cache", "plugin": "/usr/local/lib/servermonitor/libredis_ping.so",
+ *    "options": {"host": "10.0.0.5"}}
+ */
+
+#include "servermonitor_plugin.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+static const sm_host *host;
+
+struct redis_monitor {
+    struct sockaddr_storage address;
+    socklen_t length;
+    char request[512];
+};
+
+struct redis_check {
+    const struct redis_monitor *monitor;
+    sm_loop *loop;
+    sm_check *check;
+    int fd;
+    int64_t deadline; /* monotonic microseconds */
+    int64_t sent_at;
+    size_t sent;
+    char reply[512];
+    size_t received;
+    unsigned replies; /* expected: one for AUTH, one for PING */
+};
+
+static int64_t now_micros(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned remaining_millis(const struct redis_check *check) {
+    const int64_t remaining = check->deadline - now_micros();
+    return remaining > 0 ? (unsigned)(remaining / 1000) + 1 : 0;
+}
+
+static void finish(struct redis_check *check, int up, const char *error, int64_t latency_us) {
+    sm_check *done = check->check;
+    if (check->fd >= 0) {
+        close(check->fd);
+    }
+    free(check);
+    host->complete(done, up, error, latency_us);
+}
+
+static void fail_errno(struct redis_check *check, const char *what, int error) {
+    char message[256];
+    snprintf(message, sizeof(message), "%s: %s", what, strerror(error));
+    finish(check, 0, message, -1);
+}
+
+static void wait_for(struct redis_check *check, unsigned events, sm_ready_fn callback) {
+    const int error = host->wait(check->loop, check->fd, events, remaining_millis(check), callback, check);
+    if (error != 0) {
+        fail_errno(check, "Can't wait for socket", error);
+    }
+}
+
+static void on_readable(void *data, unsigned events);
+
+static void on_writable(void *data, unsigned events) {
+    struct redis_check *check = data;
+    const char *request = check->monitor->request;
+    const size_t length = strlen(request);
+    if (events & SM_TIMEOUT) {
+        finish(check, 0, "Timed out", -1);
+        return;
+    }
+    if (check->sent == 0) {
+        int error = 0;
+        socklen_t error_length = sizeof(error);
+        if (getsockopt(check->fd, SOL_SOCKET, SO_ERROR, &error, &error_length) != 0) {
+            error = errno;
+        }
+        if (error != 0) {
+            fail_errno(check, "Can't connect", error);
+            return;
+        }
+        check->sent_at = now_micros();
+    }
+    while (check->sent < length) {
+        const ssize_t n = send(check->fd, request + check->sent, length - check->sent, 0);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                wait_for(check, SM_WRITE, on_writable);
+                return;
+            }
+            fail_errno(check, "Can't send", errno);
+            return;
+        }
+        check->sent += (size_t)n;
+    }
+    wait_for(check, SM_READ, on_readable);
+}
+
+static void on_readable(void *data, unsigned events) {
+    struct redis_check *check = data;
+    if (events & SM_TIMEOUT) {
+        finish(check, 0, "Timed out", -1);
+        return;
+    }
+    for (;;) {
+        const ssize_t n = recv(check->fd, check->reply + check->received, sizeof(check->reply) - 1 - check->received, 0);
+        if (n > 0) {
+            check->received += (size_t)n;
+            check->reply[check->received] = '\0';
+            if (check->received + 1 < sizeof(check->reply)) {
+                continue;
+            }
+        } else if (n == 0) {
+            finish(check, 0, "Connection closed before the reply", -1);
+            return;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            fail_errno(check, "Can't receive", errno);
+            return;
+        }
+        break;
+    }
+    /* Each reply is one line; an error ("-ERR ...") fails the check right away. */
+    char *line = check->reply;
+    unsigned complete = 0;
+    char *end;
+    while ((end = strstr(line, "\r\n")) != NULL) {
+        *end = '\0';
+        if (line[0] == '-') {
+            finish(check, 0, line + 1, -1);
+            return;
+        }
+        ++complete;
+        if (complete == check->replies) {
+            const int64_t latency = now_micros() - check->sent_at;
+            if (strcmp(line, "+PONG") != 0) {
+                char message[300];
+                snprintf(message, sizeof(message), "Unexpected reply: %.256s", line);
+                finish(check, 0, message, latency);
+                return;
+            }
+            finish(check, 1, NULL, latency);
+            return;
+        }
+        *end = '\r';
+        line = end + 2;
+    }
+    if (check->received + 1 >= sizeof(check->reply)) {
+        finish(check, 0, "Reply too long", -1);
+        return;
+    }
+    wait_for(check, SM_READ, on_readable);
+}
+
+static const char *option(const char *const *options, const char *key, const char *fallback) {
+    for (; options[0] && options[1]; options += 2) {
+        if (strcmp(options[0], key) == 0) {
+            return options[1];
+        }
+    }
+    return fallback;
+}
+
+static void *redis_create(const char *const *options, char *error, size_t error_size) {
+    const char *name = option(options, "host", "127.0.0.1");
+    const char *port = option(options, "port", "6379");
+    const char *password = option(options, "password", NULL);
+    struct redis_monitor *monitor = calloc(1, sizeof(*monitor));
+    if (!monitor) {
+        snprintf(error, error_size, "Out of memory");
+        return NULL;
+    }
+    if (password) {
+        /* Inline commands can't carry spaces or line breaks in their arguments. */
+        if (strpbrk(password, " \r\n") != NULL) {
+            snprintf(error, error_size, "password can't contain spaces or line breaks");
+            free(monitor);
+            return NULL;
+        }
+        snprintf(monitor->request, sizeof(monitor->request), "AUTH %s\r\nPING\r\n", password);
+    } else {
+        snprintf(monitor->request, sizeof(monitor->request), "PING\r\n");
+    }
+    struct addrinfo hints;
+    struct addrinfo *result = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    const int status = getaddrinfo(name, port, &hints, &result);
+    if (status != 0 || !result) {
+        snprintf(error, error_size, "Can't get address of %s: %s", name, gai_strerror(status));
+        free(monitor);
+        return NULL;
+    }
+    memcpy(&monitor->address, result->ai_addr, result->ai_addrlen);
+    monitor->length = result->ai_addrlen;
+    freeaddrinfo(result);
+    return monitor;
+}
+
+static void redis_destroy(void *monitor) {
+    free(monitor);
+}
+
+static void redis_start(void *data, sm_loop *loop, sm_check *done, unsigned timeout_ms) {
+    const struct redis_monitor *monitor = data;
+    struct redis_check *check = calloc(1, sizeof(*check));
+    if (!check) {
+        host->complete(done, 0, "Out of memory", -1);
+        return;
+    }
+    check->monitor = monitor;
+    check->loop = loop;
+    check->check = done;
+    check->deadline = now_micros() + (int64_t)timeout_ms * 1000;
+    check->replies = strstr(monitor->request, "AUTH ") == monitor->request ? 2 : 1;
+    check->fd = socket(monitor->address.ss_family, SOCK_STREAM, 0);
+    if (check->fd < 0) {
+        fail_errno(check, "Can't create socket", errno);
+        return;
+    }
+    (void)fcntl(check->fd, F_SETFD, FD_CLOEXEC);
+    const int flags = fcntl(check->fd, F_GETFL);
+    if (flags < 0 || fcntl(check->fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+        fail_errno(check, "Can't set to non-blocking", errno);
+        return;
+    }
+    if (connect(check->fd, (const struct sockaddr *)&monitor->address, monitor->length) != 0 && errno != EINPROGRESS) {
+        fail_errno(check, "Can't connect", errno);
+        return;
+    }
+    wait_for(check, SM_WRITE, on_writable);
+}
+
+static const sm_plugin plugin = {
+    SM_PLUGIN_API_VERSION,
+    "redis_ping",
+    redis_create,
+    redis_destroy,
+    redis_start,
+};
+
+SM_PLUGIN_EXPORT const sm_plugin *servermonitor_plugin(const sm_host *host_api) {
+    if (host_api->api_version < SM_PLUGIN_API_VERSION) {
+        return NULL;
+    }
+    host = host_api;
+    return &plugin;
+}
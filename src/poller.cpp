@@ -0,0 +1,272 @@
+#include "poller.hpp"
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+#ifdef __linux__
+
+struct Poller::Impl {
+    int epfd = -1;
+    std::unordered_map<int, void*> data;
+    std::vector<struct ::epoll_event> ready;
+
+    static uint32_t to_native(unsigned events) {
+        uint32_t native = 0;
+        if (events & Read) {
+            native |= EPOLLIN;
+        }
+        if (events & Write) {
+            native |= EPOLLOUT;
+        }
+        return native;
+    }
+
+    bool control(int op, int fd, unsigned events) {
+        struct ::epoll_event ev;
+        std::memset(&ev, 0, sizeof(ev));
+        ev.events = to_native(events);
+        ev.data.fd = fd;
+        return ::epoll_ctl(epfd, op, fd, &ev) == 0;
+    }
+};
+
+Poller::Poller()
+    : impl_(new Impl)
+{
+    impl_->epfd = ::epoll_create1(EPOLL_CLOEXEC);
+    if (impl_->epfd < 0) {
+        throw std::runtime_error("epoll_create1 failed: " + std::string(::strerror(errno)));
+    }
+}
+
+Poller::~Poller()
+{
+    (void)::close(impl_->epfd);
+}
+
+bool Poller::add(int fd, unsigned events, void *data) {
+    if (!impl_->control(EPOLL_CTL_ADD, fd, events)) {
+        return false;
+    }
+    impl_->data[fd] = data;
+    return true;
+}
+
+bool Poller::modify(int fd, unsigned events, void *data) {
+    if (!impl_->control(EPOLL_CTL_MOD, fd, events)) {
+        return false;
+    }
+    impl_->data[fd] = data;
+    return true;
+}
+
+void Poller::remove(int fd) {
+    (void)impl_->control(EPOLL_CTL_DEL, fd, 0);
+    impl_->data.erase(fd);
+}
+
+bool Poller::wait(std::vector<Event>& events, int timeout_ms) {
+    events.clear();
+    if (impl_->data.empty() && timeout_ms < 0) {
+        return true;
+    }
+    impl_->ready.resize(impl_->data.empty() ? 1 : impl_->data.size());
+    const int count = ::epoll_wait(impl_->epfd, impl_->ready.data(), static_cast<int>(impl_->ready.size()), timeout_ms);
+    if (count < 0) {
+        return errno == EINTR;
+    }
+    for (int i = 0; i < count; ++i) {
+        const auto& ev = impl_->ready[i];
+        unsigned ready = 0;
+        if (ev.events & EPOLLIN) {
+            ready |= Read;
+        }
+        if (ev.events & EPOLLOUT) {
+            ready |= Write;
+        }
+        if (ev.events & (EPOLLERR | EPOLLHUP)) {
+            ready |= Error;
+        }
+        const auto iter = impl_->data.find(ev.data.fd);
+        if (iter != impl_->data.end()) {
+            events.push_back(Event{ev.data.fd, ready, iter->second});
+        }
+    }
+    return true;
+}
+
+#else
+
+struct Poller::Impl {
+    std::vector<struct ::pollfd> fds;
+    std::vector<void*> data;
+    std::unordered_map<int, size_t> index;
+
+    static short to_native(unsigned events) {
+        short native = 0;
+        if (events & Read) {
+            native |= POLLIN;
+        }
+        if (events & Write) {
+            native |= POLLOUT;
+        }
+        return native;
+    }
+};
+
+Poller::Poller()
+    : impl_(new Impl)
+{
+}
+
+Poller::~Poller() = default;
+
+bool Poller::add(int fd, unsigned events, void *data) {
+    if (impl_->index.find(fd) != impl_->index.end()) {
+        errno = EEXIST;
+        return false;
+    }
+    struct ::pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = Impl::to_native(events);
+    pfd.revents = 0;
+    impl_->index[fd] = impl_->fds.size();
+    impl_->fds.push_back(pfd);
+    impl_->data.push_back(data);
+    return true;
+}
+
+bool Poller::modify(int fd, unsigned events, void *data) {
+    const auto iter = impl_->index.find(fd);
+    if (iter == impl_->index.end()) {
+        errno = ENOENT;
+        return false;
+    }
+    impl_->fds[iter->second].events = Impl::to_native(events);
+    impl_->data[iter->second] = data;
+    return true;
+}
+
+void Poller::remove(int fd) {
+    const auto iter = impl_->index.find(fd);
+    if (iter == impl_->index.end()) {
+        return;
+    }
+    const size_t pos = iter->second;
+    const size_t last = impl_->fds.size() - 1;
+    if (pos != last) {
+        impl_->fds[pos] = impl_->fds[last];
+        impl_->data[pos] = impl_->data[last];
+        impl_->index[impl_->fds[pos].fd] = pos;
+    }
+    impl_->fds.pop_back();
+    impl_->data.pop_back();
+    impl_->index.erase(iter);
+}
+
+bool Poller::wait(std::vector<Event>& events, int timeout_ms) {
+    events.clear();
+    const int count = ::poll(impl_->fds.data(), static_cast<nfds_t>(impl_->fds.size()), timeout_ms);
+    if (count < 0) {
+        return errno == EINTR;
+    }
+    for (size_t i = 0; i < impl_->fds.size() && events.size() < static_cast<size_t>(count); ++i) {
+        const auto& pfd = impl_->fds[i];
+        if (pfd.revents == 0) {
+            continue;
+        }
+        unsigned ready = 0;
+        if (pfd.revents & POLLIN) {
+            ready |= Read;
+        }
+        if (pfd.revents & POLLOUT) {
+            ready |= Write;
+        }
+        if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+            ready |= Error;
+        }
+        events.push_back(Event{pfd.fd, ready, impl_->data[i]});
+    }
+    return true;
+}
+
+#endif
+
+#ifndef __linux__
+namespace {
+    int close_on_exec(int fd) {
+        if (fd >= 0) {
+            (void)::fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+        return fd;
+    }
+}
+#endif
+
+int open_socket(int family, int type, int protocol) {
+#ifdef __linux__
+    return ::socket(family, type | SOCK_CLOEXEC, protocol);
+#else
+    return close_on_exec(::socket(family, type, protocol));
+#endif
+}
+
+bool open_pipe(int fds[2]) {
+#ifdef __linux__
+    return ::pipe2(fds, O_CLOEXEC) == 0;
+#else
+    if (::pipe(fds) != 0) {
+        return false;
+    }
+    (void)close_on_exec(fds[0]);
+    (void)close_on_exec(fds[1]);
+    return true;
+#endif
+}
+
+int accept_socket(int fd) {
+#ifdef __linux__
+    return ::accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+#else
+    return close_on_exec(::accept(fd, nullptr, nullptr));
+#endif
+}
+
+Notifier::Notifier()
+{
+    if (!open_pipe(fds_)) {
+        throw std::runtime_error("pipe failed: " + std::string(::strerror(errno)));
+    }
+    for (int fd : fds_) {
+        (void)::fcntl(fd, F_SETFL, O_NONBLOCK);
+    }
+}
+
+Notifier::~Notifier()
+{
+    (void)::close(fds_[0]);
+    (void)::close(fds_[1]);
+}
+
+void Notifier::notify() {
+    const char byte = 0;
+    (void)!::write(fds_[1], &byte, 1); // a full pipe already guarantees a wakeup
+}
+
+void Notifier::drain() {
+    char buffer[256];
+    while (::read(fds_[0], buffer, sizeof(buffer)) > 0) {
+    }
+}
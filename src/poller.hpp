@@ -0,0 +1,67 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+// Readiness notification for many file descriptors at once: epoll on Linux and poll()
+// elsewhere. Unlike select() it isn't limited to descriptors below FD_SETSIZE.
+class Poller {
+public:
+    enum : unsigned {
+        Read = 1,
+        Write = 2,
+        Error = 4, // always reported, also used for hang-ups
+    };
+
+    struct Event {
+        int fd;
+        unsigned events;
+        void *data;
+    };
+
+    Poller();
+    ~Poller();
+
+    Poller(const Poller&) = delete;
+    Poller& operator=(const Poller&) = delete;
+
+    bool add(int fd, unsigned events, void *data);
+    bool modify(int fd, unsigned events, void *data);
+    void remove(int fd);
+
+    // Waits up to timeout_ms (-1 waits forever) and replaces the contents of events with the
+    // ready descriptors. Returns false on failure with errno set; EINTR is not a failure.
+    bool wait(std::vector<Event>& events, int timeout_ms);
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl_;
+};
+
+// socket(), pipe() and accept() for descriptors that commands this process runs don't inherit,
+// with close-on-exec set as they are created where the system allows it, so a command started
+// from another thread at the same time can't catch them without it. Fail as the calls do.
+int open_socket(int family, int type, int protocol);
+bool open_pipe(int fds[2]);
+int accept_socket(int fd);
+
+// Wakes a thread blocked in Poller::wait() from another thread: add fd() for reading and call
+// drain() when it becomes readable.
+class Notifier {
+public:
+    Notifier();
+    ~Notifier();
+
+    Notifier(const Notifier&) = delete;
+    Notifier& operator=(const Notifier&) = delete;
+
+    int fd() const {
+        return fds_[0];
+    }
+
+    void notify();
+    void drain();
+
+private:
+    int fds_[2];
+};
@@ -0,0 +1,198 @@
+#include "resolver.hpp"
+#include <algorithm>
+#include <cstring>
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+namespace {
+    const auto kNegativeTtl = std::chrono::seconds(5);
+
+    // Numeric addresses need no lookup or caching.
+    bool parse_numeric(const std::string& host, Resolved& resolved) {
+        ResolvedAddress entry;
+        std::memset(&entry.address, 0, sizeof(entry.address));
+        auto& v4 = reinterpret_cast<struct ::sockaddr_in&>(entry.address);
+        auto& v6 = reinterpret_cast<struct ::sockaddr_in6&>(entry.address);
+        if (::inet_pton(AF_INET, host.c_str(), &v4.sin_addr) == 1) {
+            v4.sin_family = AF_INET;
+            entry.length = sizeof(v4);
+        } else if (::inet_pton(AF_INET6, host.c_str(), &v6.sin6_addr) == 1) {
+            v6.sin6_family = AF_INET6;
+            entry.length = sizeof(v6);
+        } else {
+            return false;
+        }
+        resolved.addresses.push_back(entry);
+        return true;
+    }
+
+    ResolvedPtr getaddrinfo_lookup(const std::string& host) {
+        auto resolved = std::make_shared<Resolved>();
+        struct ::addrinfo hints;
+        std::memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        struct ::addrinfo *res = nullptr;
+        const int getaddrinfo_error = ::getaddrinfo(host.c_str(), nullptr, &hints, &res);
+        if (getaddrinfo_error != 0) {
+            resolved->errorMessage = "Can't get address: " + std::string(::gai_strerror(getaddrinfo_error));
+            return resolved;
+        }
+        for (const struct ::addrinfo *ai = res; ai; ai = ai->ai_next) {
+            if ((ai->ai_family != AF_INET && ai->ai_family != AF_INET6) || ai->ai_addrlen > sizeof(struct ::sockaddr_storage)) {
+                continue;
+            }
+            bool duplicate = false;
+            for (const auto& existing : resolved->addresses) {
+                if (existing.length == ai->ai_addrlen && std::memcmp(&existing.address, ai->ai_addr, ai->ai_addrlen) == 0) {
+                    duplicate = true;
+                    break;
+                }
+            }
+            if (!duplicate) {
+                ResolvedAddress entry;
+                std::memset(&entry.address, 0, sizeof(entry.address));
+                std::memcpy(&entry.address, ai->ai_addr, ai->ai_addrlen);
+                entry.length = ai->ai_addrlen;
+                resolved->addresses.push_back(entry);
+            }
+        }
+        ::freeaddrinfo(res);
+        if (resolved->addresses.empty()) {
+            resolved->errorMessage = "Can't get address: no IPv4 or IPv6 addresses";
+        }
+        return resolved;
+    }
+}
+
+Resolver::Resolver(size_t threads, std::chrono::seconds ttl)
+    : ttl_(ttl)
+    , stopping_(false)
+    , hits_(0)
+    , misses_(0)
+    , coalesced_(0)
+{
+    for (size_t i = 0; i < threads; ++i) {
+        threads_.emplace_back([this](){
+            work();
+        });
+    }
+}
+
+Resolver::~Resolver()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wakeup_.notify_all();
+    for (auto& thread : threads_) {
+        thread.join();
+    }
+}
+
+void Resolver::setTtl(std::chrono::seconds ttl) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ttl_ = ttl;
+}
+
+void Resolver::resolve(const std::string& host, Callback callback) {
+    auto numeric = std::make_shared<Resolved>();
+    if (parse_numeric(host, *numeric)) {
+        callback(numeric);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    const auto cached = cache_.find(host);
+    if (cached != cache_.end()) {
+        if (ClockType::now() < cached->second.expires) {
+            const ResolvedPtr resolved = cached->second.resolved;
+            lock.unlock();
+            ++hits_;
+            callback(resolved);
+            return;
+        }
+        cache_.erase(cached);
+    }
+
+    auto& waiting = inflight_[host];
+    waiting.push_back(std::move(callback));
+    if (waiting.size() > 1) {
+        ++coalesced_;
+        return;
+    }
+    ++misses_;
+    if (threads_.empty()) {
+        lock.unlock();
+        lookup(host);
+        return;
+    }
+    queue_.push_back(host);
+    lock.unlock();
+    wakeup_.notify_one();
+}
+
+ResolvedPtr Resolver::resolve(const std::string& host) {
+    std::mutex mutex;
+    std::condition_variable done;
+    ResolvedPtr result;
+    resolve(host, [&](const ResolvedPtr& resolved) {
+        std::lock_guard<std::mutex> lock(mutex);
+        result = resolved;
+        done.notify_one();
+    });
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&result](){
+        return result != nullptr;
+    });
+    return result;
+}
+
+ResolverStats Resolver::stats() const {
+    ResolverStats stats;
+    stats.hits = hits_;
+    stats.misses = misses_;
+    stats.coalesced = coalesced_;
+    return stats;
+}
+
+void Resolver::work() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        wakeup_.wait(lock, [this](){
+            return stopping_ || !queue_.empty();
+        });
+        if (queue_.empty()) {
+            return; // stopping
+        }
+        const std::string host = queue_.front();
+        queue_.pop_front();
+        lock.unlock();
+        lookup(host);
+        lock.lock();
+    }
+}
+
+void Resolver::lookup(const std::string& host) {
+    const ResolvedPtr resolved = getaddrinfo_lookup(host);
+    std::vector<Callback> callbacks;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const auto ttl = resolved->addresses.empty() ? std::min(ttl_, std::chrono::seconds(kNegativeTtl)) : ttl_;
+        if (ttl.count() > 0) {
+            cache_[host] = CacheEntry{resolved, ClockType::now() + ttl};
+        }
+        const auto iter = inflight_.find(host);
+        if (iter != inflight_.end()) {
+            callbacks.swap(iter->second);
+            inflight_.erase(iter);
+        }
+    }
+    for (auto& callback : callbacks) {
+        callback(resolved);
+    }
+}
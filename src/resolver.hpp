@@ -0,0 +1,154 @@
+#pragma once
+
+#include "event_loop.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <sys/socket.h>
+
+struct ResolvedAddress {
+    struct ::sockaddr_storage address; // port is zero
+    socklen_t length;
+};
+
+struct Resolved {
+    std::vector<ResolvedAddress> addresses; // in getaddrinfo() order, without duplicates
+    std::string errorMessage;               // set if addresses is empty
+};
+
+using ResolvedPtr = std::shared_ptr<const Resolved>;
+
+struct ResolverStats {
+    uint64_t hits = 0;      // answered from the cache
+    uint64_t misses = 0;    // needed a lookup
+    uint64_t coalesced = 0; // joined a lookup already in flight for the same name
+};
+
+// Host name lookups shared by every monitor. getaddrinfo() runs on a small pool of threads so
+// a slow name server never blocks a probe engine, concurrent lookups of one name are merged
+// into one, and answers are cached for the configured TTL (failures for a shorter time).
+// With zero threads, lookups run on the calling thread but are still cached.
+class Resolver {
+public:
+    using Callback = std::function<void(const ResolvedPtr& resolved)>;
+
+    Resolver(size_t threads, std::chrono::seconds ttl);
+    ~Resolver();
+
+    Resolver(const Resolver&) = delete;
+    Resolver& operator=(const Resolver&) = delete;
+
+    void setTtl(std::chrono::seconds ttl);
+
+    // Calls back with the addresses for host, either right away (numeric addresses and cache
+    // hits) or from a resolver thread once the lookup finishes.
+    void resolve(const std::string& host, Callback callback);
+
+    // Blocking variant of resolve().
+    ResolvedPtr resolve(const std::string& host);
+
+    ResolverStats stats() const;
+
+private:
+    using ClockType = std::chrono::steady_clock;
+
+    struct CacheEntry {
+        ResolvedPtr resolved;
+        ClockType::time_point expires;
+    };
+
+    void work();
+    void lookup(const std::string& host);
+
+    mutable std::mutex mutex_;
+    std::condition_variable wakeup_;
+    std::deque<std::string> queue_;
+    std::unordered_map<std::string, std::vector<Callback>> inflight_;
+    std::unordered_map<std::string, CacheEntry> cache_;
+    std::vector<std::thread> threads_;
+    std::chrono::seconds ttl_;
+    bool stopping_;
+    std::atomic<uint64_t> hits_;
+    std::atomic<uint64_t> misses_;
+    std::atomic<uint64_t> coalesced_;
+};
+
+// co_await Resolve(loop, resolver, host, deadline) yields the addresses for host, resuming on
+// the loop whichever thread the lookup finished on, or null once the deadline passes first.
+// A lookup given up on carries on and is still cached, so the loop must outlive the resolver.
+class ResolveAwaiter {
+public:
+    ResolveAwaiter(EventLoop& loop, Resolver& resolver, const std::string& host, EventLoop::ClockType::time_point deadline)
+        : loop_(loop)
+        , resolver_(resolver)
+        , host_(host)
+        , deadline_(deadline)
+    {
+    }
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> handle) {
+        // Shared with the callbacks, only touched on the loop. Whichever comes first resumes.
+        auto state = std::make_shared<State>();
+        state->handle = handle;
+        state_ = state;
+        EventLoop& loop = loop_;
+        state->timer = loop.addTimer(deadline_, [state](){
+            state->timer = 0;
+            state->finish(nullptr);
+        });
+        resolver_.resolve(host_, [&loop, state](const ResolvedPtr& resolved) {
+            loop.post([&loop, state, resolved](){
+                if (state->timer != 0) {
+                    loop.cancelTimer(state->timer);
+                    state->timer = 0;
+                }
+                state->finish(resolved);
+            });
+        });
+    }
+
+    ResolvedPtr await_resume() noexcept {
+        return std::move(state_->resolved);
+    }
+
+private:
+    struct State {
+        std::coroutine_handle<> handle;
+        EventLoop::TimerId timer = 0;
+        bool done = false;
+        ResolvedPtr resolved;
+
+        void finish(const ResolvedPtr& result) {
+            if (!done) {
+                done = true;
+                resolved = result;
+                handle.resume();
+            }
+        }
+    };
+
+    EventLoop& loop_;
+    Resolver& resolver_;
+    std::string host_;
+    EventLoop::ClockType::time_point deadline_;
+    std::shared_ptr<State> state_;
+};
+
+inline ResolveAwaiter Resolve(EventLoop& loop, Resolver& resolver, const std::string& host, EventLoop::ClockType::time_point deadline) {
+    return ResolveAwaiter(loop, resolver, host, deadline);
+}
@@ -0,0 +1,87 @@
+/*
+ * ServerMonitor plugin interface: monitors in shared libraries, loaded with dlopen() from the
+ * "plugin" of a server. Plain C, so plugins can be written in anything that can export a C
+ * function, and stable: a plugin built against one API version loads in every ServerMonitor
+ * that supports it.
+ *
+ * A plugin exports servermonitor_plugin(), which returns its description. ServerMonitor calls
+ * create() for each server with the server's "options", and start() for each check of it.
+ * Checks run on ServerMonitor's event loop, one thread shared by every check, so start() and
+ * everything it waits for must never block: wait for sockets and timers with host->wait(), and
+ * report the result with host->complete().
+ */
+
+#ifndef SERVERMONITOR_PLUGIN_H
+#define SERVERMONITOR_PLUGIN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SM_PLUGIN_API_VERSION 1
+
+/* Name of the function every plugin exports, of type sm_plugin_entry. */
+#define SM_PLUGIN_ENTRY "servermonitor_plugin"
+
+#if defined(__GNUC__) || defined(__clang__)
+#define SM_PLUGIN_EXPORT __attribute__((visibility("default")))
+#else
+#define SM_PLUGIN_EXPORT
+#endif
+
+/* What a descriptor is waited for, and what it became ready for. */
+#define SM_READ 1u
+#define SM_WRITE 2u
+#define SM_TIMEOUT 4u /* the wait's timeout passed first */
+
+typedef struct sm_loop sm_loop;   /* the event loop the check runs on */
+typedef struct sm_check sm_check; /* one check in flight, until it is completed */
+
+typedef void (*sm_ready_fn)(void *data, unsigned events);
+
+/* What ServerMonitor provides. Only to be called on the loop's thread: from start() or from a
+ * callback. */
+typedef struct sm_host {
+    unsigned api_version;
+
+    /* Calls back once, with the events fd became ready for (an error or hang-up counts as
+     * both), or with SM_TIMEOUT after timeout_ms. With fd -1 it is only a timer. Only one wait
+     * per descriptor at a time. Returns 0, or an errno if fd can't be waited for, in which case
+     * there is no callback. */
+    int (*wait)(sm_loop *loop, int fd, unsigned events, unsigned timeout_ms, sm_ready_fn callback, void *data);
+
+    /* Reports the result of the check, exactly once, after which the check is gone. error is
+     * why it is down (NULL or "" when up), and latency_us the plugin's own measure of the
+     * service's latency, e.g. from request to reply, or -1. */
+    void (*complete)(sm_check *check, int up, const char *error, int64_t latency_us);
+} sm_host;
+
+typedef struct sm_plugin {
+    unsigned api_version; /* SM_PLUGIN_API_VERSION */
+    const char *name;
+
+    /* Creates the monitor of one server. options holds the server's "options" as key, value,
+     * key, value, ..., NULL, with numbers and booleans as text. Returns NULL with a message in
+     * error if they aren't valid. */
+    void *(*create)(const char *const *options, char *error, size_t error_size);
+
+    void (*destroy)(void *monitor);
+
+    /* Starts a check, which must end with host->complete(), from start() itself or any
+     * callback after it. A check that isn't completed within a second past timeout_ms is
+     * reported as down. */
+    void (*start)(void *monitor, sm_loop *loop, sm_check *check, unsigned timeout_ms);
+} sm_plugin;
+
+/* Returns the plugin's description, or NULL if it can't work with this host. host stays valid
+ * as long as the plugin is loaded. */
+typedef const sm_plugin *(*sm_plugin_entry)(const sm_host *host);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,372 @@
+#include "spawn.hpp"
+#include "poller.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <mutex>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+namespace {
+    using ClockType = std::chrono::steady_clock;
+
+    // How often to check whether the command has exited where there is no descriptor for it.
+    const int kReapPollMillis = 10;
+
+    // Limits the commands running across every thread, each waiting its turn on its own loop.
+    class CommandLimit {
+    public:
+        class Acquire {
+        public:
+            Acquire(CommandLimit& limit, EventLoop& loop)
+                : limit_(limit)
+                , loop_(loop)
+            {
+            }
+
+            bool await_ready() const noexcept {
+                return false;
+            }
+
+            bool await_suspend(std::coroutine_handle<> handle) {
+                return limit_.wait(loop_, handle);
+            }
+
+            void await_resume() const noexcept {
+            }
+
+        private:
+            CommandLimit& limit_;
+            EventLoop& loop_;
+        };
+
+        void setMax(size_t max) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            max_ = max;
+            while (!waiting_.empty() && (max_ == 0 || running_ < max_)) {
+                ++running_;
+                wake_next();
+            }
+        }
+
+        Acquire acquire(EventLoop& loop) {
+            return Acquire(*this, loop);
+        }
+
+        void release() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!waiting_.empty() && (max_ == 0 || running_ <= max_)) {
+                wake_next(); // the slot passes straight to it
+            } else {
+                --running_;
+            }
+        }
+
+    private:
+        struct Waiter {
+            EventLoop *loop;
+            std::coroutine_handle<> handle;
+        };
+
+        // Takes a slot, returning false, or queues the awaiting command for one.
+        bool wait(EventLoop& loop, std::coroutine_handle<> handle) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (max_ == 0 || running_ < max_) {
+                ++running_;
+                return false;
+            }
+            waiting_.push_back(Waiter{&loop, handle});
+            return true;
+        }
+
+        void wake_next() {
+            const Waiter waiter = waiting_.front();
+            waiting_.pop_front();
+            waiter.loop->resume(waiter.handle);
+        }
+
+        std::mutex mutex_;
+        std::deque<Waiter> waiting_;
+        size_t max_ = 0;
+        size_t running_ = 0;
+    };
+
+    CommandLimit command_limit;
+
+    // Held from when the command's turn comes until it has finished.
+    struct CommandSlot {
+        ~CommandSlot() {
+            command_limit.release();
+        }
+    };
+
+    struct Pipe {
+        int read = -1;
+        int write = -1;
+
+        ~Pipe() {
+            close_read();
+            close_write();
+        }
+
+        bool open() {
+            int fds[2];
+            if (!open_pipe(fds)) {
+                return false;
+            }
+            read = fds[0];
+            write = fds[1];
+            const int flags = ::fcntl(read, F_GETFL);
+            return flags >= 0 && ::fcntl(read, F_SETFL, flags | O_NONBLOCK) == 0;
+        }
+
+        void close_read() {
+            if (read >= 0) {
+                (void)::close(read);
+                read = -1;
+            }
+        }
+
+        void close_write() {
+            if (write >= 0) {
+                (void)::close(write);
+                write = -1;
+            }
+        }
+    };
+
+    // Reads what the pipe has without blocking, keeping at most max bytes in out. Returns
+    // false at end of file.
+    bool drain(Pipe& pipe, std::string& out, size_t max) {
+        char buffer[4096];
+        for (;;) {
+            const ssize_t n = ::read(pipe.read, buffer, sizeof(buffer));
+            if (n > 0) {
+                if (out.size() < max) {
+                    out.append(buffer, std::min(static_cast<size_t>(n), max - out.size()));
+                }
+                continue;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return true;
+            }
+            pipe.close_read();
+            return false;
+        }
+    }
+
+    // A descriptor that becomes readable once the process exits, or -1 where the system has
+    // none, in which case the command is checked on now and then instead.
+    struct ExitDescriptor {
+        int fd = -1;
+
+        explicit ExitDescriptor(pid_t pid) {
+#ifdef SYS_pidfd_open
+            fd = static_cast<int>(::syscall(SYS_pidfd_open, pid, 0));
+            if (fd >= 0) {
+                (void)::fcntl(fd, F_SETFD, FD_CLOEXEC);
+            }
+#else
+            (void)pid;
+#endif
+        }
+
+        ~ExitDescriptor() {
+            if (fd >= 0) {
+                (void)::close(fd);
+            }
+        }
+
+        ExitDescriptor(const ExitDescriptor&) = delete;
+        ExitDescriptor& operator=(const ExitDescriptor&) = delete;
+    };
+
+    // Reaps a command that was killed, from the loop like one that exits: a process in
+    // uninterruptible sleep only dies once it wakes up.
+    Task<void> reap_killed(EventLoop& loop, pid_t pid) {
+        const ExitDescriptor exit_fd(pid);
+        for (;;) {
+            int status = 0;
+            const pid_t reaped = ::waitpid(pid, &status, WNOHANG);
+            if (reaped == pid || (reaped < 0 && errno != EINTR)) {
+                co_return;
+            }
+            const auto until = ClockType::now() + std::chrono::milliseconds(exit_fd.fd >= 0 ? 1000 : kReapPollMillis);
+            auto exited = loop.wait(exit_fd.fd, Poller::Read, until);
+            (void)co_await exited;
+        }
+    }
+
+    std::string spawn_error(const char *what, int error) {
+        return std::string("Can't ") + what + ": " + ::strerror(error);
+    }
+
+    // Launches "/bin/sh -c command" as the leader of a new process group, with stdin from
+    // /dev/null and stdout/stderr to the pipes. Returns 0 or an errno.
+    int spawn(const std::string& command, const Pipe& out, const Pipe& err, pid_t& pid) {
+        posix_spawn_file_actions_t actions;
+        posix_spawnattr_t attr;
+        int error = ::posix_spawn_file_actions_init(&actions);
+        if (error != 0) {
+            return error;
+        }
+        error = ::posix_spawnattr_init(&attr);
+        if (error != 0) {
+            (void)::posix_spawn_file_actions_destroy(&actions);
+            return error;
+        }
+        // Signals the daemon ignores or blocks shouldn't be inherited by the command.
+        sigset_t default_signals;
+        sigset_t no_signals;
+        sigemptyset(&default_signals);
+        sigaddset(&default_signals, SIGPIPE);
+        sigaddset(&default_signals, SIGINT);
+        sigaddset(&default_signals, SIGTERM);
+        sigemptyset(&no_signals);
+        short flags = POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+#ifdef POSIX_SPAWN_USEVFORK
+        flags |= POSIX_SPAWN_USEVFORK;
+#endif
+        if ((error = ::posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0)) == 0 &&
+            (error = ::posix_spawn_file_actions_adddup2(&actions, out.write, STDOUT_FILENO)) == 0 &&
+            (error = ::posix_spawn_file_actions_adddup2(&actions, err.write, STDERR_FILENO)) == 0 &&
+            (error = close_inherited(&actions)) == 0 &&
+            (error = ::posix_spawnattr_setflags(&attr, flags)) == 0 &&
+            (error = ::posix_spawnattr_setpgroup(&attr, 0)) == 0 &&
+            (error = ::posix_spawnattr_setsigdefault(&attr, &default_signals)) == 0 &&
+            (error = ::posix_spawnattr_setsigmask(&attr, &no_signals)) == 0) {
+            char sh[] = "/bin/sh";
+            char dash_c[] = "-c";
+            char *argv[] = {sh, dash_c, const_cast<char*>(command.c_str()), nullptr};
+            error = ::posix_spawn(&pid, sh, &actions, &attr, argv, environ);
+        }
+        (void)::posix_spawnattr_destroy(&attr);
+        (void)::posix_spawn_file_actions_destroy(&actions);
+        return error;
+    }
+}
+
+int close_inherited(posix_spawn_file_actions_t *actions) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 34))
+    return ::posix_spawn_file_actions_addclosefrom_np(actions, STDERR_FILENO + 1);
+#else
+    (void)actions;
+    return 0;
+#endif
+}
+
+Task<bool> RunCommand(EventLoop& loop, const CommandParams& params, CommandResult& result, ProbeError& error) {
+    result = CommandResult();
+    co_await command_limit.acquire(loop);
+    const CommandSlot slot;
+    Pipe out;
+    Pipe err;
+    if (!out.open() || !err.open()) {
+        error.set(ErrorCode::Other, spawn_error("create pipe", errno));
+        co_return false;
+    }
+    pid_t pid;
+    const int spawned = spawn(params.command, out, err, pid);
+    if (spawned != 0) {
+        error.set(ErrorCode::Other, spawn_error("run command", spawned));
+        co_return false;
+    }
+    out.close_write();
+    err.close_write();
+    const ExitDescriptor exit_fd(pid);
+
+    const auto deadline = ClockType::now() + std::chrono::seconds(params.timeout);
+    int status = 0;
+    bool exited = false;
+    for (;;) {
+        if (!exited) {
+            const pid_t reaped = ::waitpid(pid, &status, WNOHANG);
+            if (reaped < 0 && errno != EINTR) {
+                // Its exit status is lost, so there is no telling whether it succeeded.
+                error.set(ErrorCode::Other, spawn_error("wait for command", errno));
+                co_return false;
+            }
+            exited = reaped == pid;
+        }
+        if (exited) {
+            // Anything the command left running in the background may still hold the pipes,
+            // so take what is there rather than waiting for them to close.
+            if (out.read >= 0) {
+                (void)drain(out, result.out, params.maxOutput);
+            }
+            if (err.read >= 0) {
+                (void)drain(err, result.err, params.maxOutput);
+            }
+            break;
+        }
+        const auto now = ClockType::now();
+        if (now >= deadline) {
+            (void)::kill(-pid, SIGKILL);
+            loop.spawn(reap_killed(loop, pid), [](){
+            });
+            result.timedOut = true;
+            error.set(ErrorCode::Timeout, "Timed out after " + std::to_string(params.timeout) + " seconds");
+            co_return false;
+        }
+        // Without an exit descriptor, output closing usually means the command has exited;
+        // otherwise wake up now and then to check for it.
+        auto until = deadline;
+        if (exit_fd.fd < 0) {
+            const bool reading = out.read >= 0 || err.read >= 0;
+            until = std::min(deadline, now + std::chrono::milliseconds(reading ? 1000 : kReapPollMillis));
+        }
+        auto readable = loop.wait({out.read, err.read, exit_fd.fd}, Poller::Read, until);
+        const int waited = co_await readable;
+        if (waited == 0) {
+            if (out.read >= 0) {
+                (void)drain(out, result.out, params.maxOutput);
+            }
+            if (err.read >= 0) {
+                (void)drain(err, result.err, params.maxOutput);
+            }
+        } else if (waited != ETIMEDOUT) {
+            co_await loop.sleep(std::chrono::milliseconds(kReapPollMillis));
+        }
+    }
+
+    if (WIFEXITED(status)) {
+        result.status = WEXITSTATUS(status);
+        co_return true;
+    }
+    if (WIFSIGNALED(status)) {
+        error.set(ErrorCode::Other, "command killed by signal " + std::to_string(WTERMSIG(status)));
+    } else {
+        error.set(ErrorCode::Other, "command failed");
+    }
+    co_return false;
+}
+
+bool RunCommand(const CommandParams& params, CommandResult& result, std::string& errorMessage) {
+    EventLoop loop;
+    bool succeeded = false;
+    ProbeError error;
+    loop.spawn(RunCommand(loop, params, result, error), [&succeeded](bool ok){
+        succeeded = ok;
+    });
+    loop.run();
+    if (!succeeded) {
+        errorMessage = error.message;
+    }
+    return succeeded;
+}
+
+void SetMaxCommands(size_t max_commands) {
+    command_limit.setMax(max_commands);
+}
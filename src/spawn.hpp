@@ -0,0 +1,41 @@
+#pragma once
+
+#include "error_code.hpp"
+#include "event_loop.hpp"
+#include "task.hpp"
+#include "types.hpp"
+#include <string>
+
+#include <spawn.h>
+
+struct CommandParams {
+    std::string command;   // run with /bin/sh -c
+    TimeoutType timeout;   // seconds before the command's process group is killed
+    size_t maxOutput;      // bytes kept of each of stdout and stderr; the rest is discarded
+};
+
+struct CommandResult {
+    int status = -1;       // exit status, or -1 if the command didn't exit normally
+    bool timedOut = false;
+    std::string out;
+    std::string err;
+};
+
+// Runs a command in a process group of its own, launched with posix_spawn so that nothing of
+// this process is copied, and reads its output until it exits or the timeout passes. On
+// timeout the whole process group is killed, taking anything the command started with it.
+// Yields false with error set if the command couldn't run to completion. Waits on the
+// loop for the command's output and for it to exit, so any number can run on one thread.
+Task<bool> RunCommand(EventLoop& loop, const CommandParams& params, CommandResult& result, ProbeError& error);
+
+// The same, blocking the calling thread until the command has finished, with only the message
+// of a failure.
+bool RunCommand(const CommandParams& params, CommandResult& result, std::string& errorMessage);
+
+// Adds closing every descriptor above stderr in the child to actions where the system can, so
+// one without close-on-exec set doesn't leak into it. Returns 0 or an errno.
+int close_inherited(posix_spawn_file_actions_t *actions);
+
+// Limits how many commands run at once across every thread and loop; 0 for no limit. Commands
+// over the limit wait for one to finish before they are launched, and their timeout starts then.
+void SetMaxCommands(size_t max_commands);
@@ -0,0 +1,112 @@
+#include "state_file.hpp"
+#include "status_file.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <unistd.h>
+
+namespace {
+    const char kMagic[4] = {'S', 'M', 'S', 'T'};
+    const uint32_t kVersion = 1;
+    const size_t kHeaderSize = sizeof(kMagic) + 4 + 4; // magic, version, count
+    const size_t kRecordSize = 2 + 1 + 8 + 4;          // name length, up, last change, failures
+
+    // Little-endian, so a snapshot reads the same on any machine.
+    void put(std::string& out, uint64_t value, size_t bytes) {
+        for (size_t i = 0; i < bytes; ++i) {
+            out += static_cast<char>((value >> (8 * i)) & 0xff);
+        }
+    }
+
+    uint64_t get(const char *data, size_t bytes) {
+        uint64_t value = 0;
+        for (size_t i = 0; i < bytes; ++i) {
+            value |= static_cast<uint64_t>(static_cast<unsigned char>(data[i])) << (8 * i);
+        }
+        return value;
+    }
+}
+
+StateFileWriter::StateFileWriter(const std::string& path)
+    : path_(path)
+    , count_(0)
+{
+    data_.append(kMagic, sizeof(kMagic));
+    put(data_, kVersion, 4);
+    put(data_, 0, 4); // count, filled in by commit()
+}
+
+void StateFileWriter::add(const std::string& name, const ServerState& state) {
+    const size_t length = std::min<size_t>(name.size(), UINT16_MAX);
+    put(data_, length, 2);
+    data_.append(name, 0, length);
+    put(data_, state.up ? 1 : 0, 1);
+    put(data_, static_cast<uint64_t>(state.lastChange), 8);
+    put(data_, state.failures, 4);
+    ++count_;
+}
+
+void StateFileWriter::commit() {
+    std::string count;
+    put(count, count_, 4);
+    data_.replace(sizeof(kMagic) + 4, 4, count);
+    std::string temp_path;
+    const int fd = make_temp_file(path_, temp_path);
+    const bool written = write_fully(fd, data_.data(), data_.size());
+    if (::close(fd) != 0 || !written) {
+        (void)std::remove(temp_path.c_str());
+        throw std::runtime_error("Can't write state file " + temp_path);
+    }
+    if (std::rename(temp_path.c_str(), path_.c_str()) != 0) {
+        const int error = errno;
+        (void)std::remove(temp_path.c_str());
+        throw std::runtime_error("Can't replace state file " + path_ + ": " + std::strerror(error));
+    }
+}
+
+bool read_state_file(const std::string& path, const std::function<void(const std::string& name, const ServerState& state)>& found) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+    const std::string data{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+    if (data.size() < kHeaderSize || std::memcmp(data.data(), kMagic, sizeof(kMagic)) != 0 ||
+        get(data.data() + sizeof(kMagic), 4) != kVersion) {
+        return false;
+    }
+    const uint64_t count = get(data.data() + sizeof(kMagic) + 4, 4);
+    
+    // Checked in full first, so nothing is restored from a truncated file.
+    size_t offset = kHeaderSize;
+    for (uint64_t i = 0; i < count; ++i) {
+        if (data.size() - offset < kRecordSize) {
+            return false;
+        }
+        offset += kRecordSize + get(data.data() + offset, 2);
+        if (offset > data.size()) {
+            return false;
+        }
+    }
+    if (offset != data.size()) {
+        return false;
+    }
+    
+    std::string name;
+    ServerState state;
+    offset = kHeaderSize;
+    for (uint64_t i = 0; i < count; ++i) {
+        const size_t length = get(data.data() + offset, 2);
+        name.assign(data, offset + 2, length);
+        const char *fields = data.data() + offset + 2 + length;
+        state.up = fields[0] != 0;
+        state.lastChange = static_cast<int64_t>(get(fields + 1, 8));
+        state.failures = static_cast<uint32_t>(get(fields + 9, 4));
+        found(name, state);
+        offset += kRecordSize + length;
+    }
+    return true;
+}
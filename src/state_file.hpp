@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+// What the next check of a server is compared against.
+struct ServerState {
+    bool up = false;
+    int64_t lastChange = 0;  // time of the check that found the current status, or 0
+    uint32_t failures = 0;   // consecutive failed checks up to the last one
+};
+
+// A compact binary snapshot of every server's state, kept beside the status file so a restart
+// can pick up where the last run left off without parsing the status. Records are a name and
+// a fixed-size state, read in one pass over the file.
+class StateFileWriter {
+public:
+    explicit StateFileWriter(const std::string& path);
+
+    void add(const std::string& name, const ServerState& state);
+
+    // Writes the snapshot to a temporary file and renames it over the old one. Throws
+    // std::runtime_error if it can't.
+    void commit();
+
+private:
+    const std::string path_;
+    std::string data_;
+    uint32_t count_;
+};
+
+// Calls found() for every record of the snapshot. Returns false, without calling it, if there
+// is no complete snapshot to read.
+bool read_state_file(const std::string& path, const std::function<void(const std::string& name, const ServerState& state)>& found);
@@ -0,0 +1,254 @@
+#include "status_file.hpp"
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+using json = nlohmann::json;
+
+namespace {
+    const char kTempPattern[] = ".XXXXXX";
+    const size_t kFlushSize = 64 * 1024; // bytes of records held before they are written out
+
+    // What open() would leave of 0666, as mkostemp() creates files only their owner can read.
+    mode_t file_mode() {
+        static const mode_t mode = [] {
+            const mode_t mask = ::umask(0);
+            (void)::umask(mask);
+            return 0666 & ~mask;
+        }();
+        return mode;
+    }
+
+    // Array headers that give the number of elements up front, so whole files decode with the
+    // plain from_cbor() and from_msgpack(). MessagePack arrays always use the 32-bit form, which
+    // no CBOR array starts with.
+    void cbor_array(std::string& out, size_t count) {
+        if (count < 24) {
+            out += static_cast<char>(0x80 + count);
+        } else if (count <= 0xff) {
+            out += static_cast<char>(0x98);
+            out += static_cast<char>(count);
+        } else if (count <= 0xffff) {
+            out += static_cast<char>(0x99);
+            out += static_cast<char>(count >> 8);
+            out += static_cast<char>(count);
+        } else {
+            out += static_cast<char>(0x9a);
+            for (int shift = 24; shift >= 0; shift -= 8) {
+                out += static_cast<char>(count >> shift);
+            }
+        }
+    }
+
+    void msgpack_array(std::string& out, size_t count) {
+        out += static_cast<char>(0xdd);
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            out += static_cast<char>(count >> shift);
+        }
+    }
+
+    // Indents every line after the first, as dump(4) does for the elements of an array.
+    void append_indented(std::string& out, const std::string& text) {
+        for (char c : text) {
+            out += c;
+            if (c == '\n') {
+                out += "    ";
+            }
+        }
+    }
+}
+
+bool status_format(const std::string& name, StatusFormat& format) {
+    static const std::pair<const char*, StatusFormat> kFormats[] = {
+        {"json", StatusFormat::Json},
+        {"json_compact", StatusFormat::JsonCompact},
+        {"ndjson", StatusFormat::Ndjson},
+        {"cbor", StatusFormat::Cbor},
+        {"msgpack", StatusFormat::MessagePack},
+    };
+    for (const auto& item : kFormats) {
+        if (name == item.first) {
+            format = item.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+int make_temp_file(const std::string& path, std::string& temp_path) {
+    temp_path = path + kTempPattern;
+    const int fd = ::mkostemp(temp_path.data(), O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("Can't create temporary file for " + path + ": " + std::strerror(errno));
+    }
+    if (::fchmod(fd, file_mode()) != 0) {
+        const int error = errno;
+        (void)::close(fd);
+        (void)std::remove(temp_path.c_str());
+        throw std::runtime_error("Can't create temporary file for " + path + ": " + std::strerror(error));
+    }
+    return fd;
+}
+
+bool write_fully(int fd, const char *data, size_t size) {
+    size_t written = 0;
+    while (written < size) {
+        const ssize_t n = ::write(fd, data + written, size - written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        written += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+StatusFileWriter::StatusFileWriter(const std::string& path, StatusFormat format, size_t count)
+    : path_(path)
+    , format_(format)
+    , fd_(make_temp_file(path, temp_path_))
+    , written_(0)
+    , failed_(false)
+    , committed_(false)
+{
+    switch (format_) {
+        case StatusFormat::Json:
+        case StatusFormat::JsonCompact:
+            buffer_ = "[";
+            break;
+        case StatusFormat::Ndjson:
+            break;
+        case StatusFormat::Cbor:
+            cbor_array(buffer_, count);
+            break;
+        case StatusFormat::MessagePack:
+            msgpack_array(buffer_, count);
+            break;
+    }
+}
+
+StatusFileWriter::~StatusFileWriter()
+{
+    if (fd_ >= 0) {
+        (void)::close(fd_);
+    }
+    if (!committed_) {
+        (void)std::remove(temp_path_.c_str());
+    }
+}
+
+void StatusFileWriter::write(const json& record) {
+    switch (format_) {
+        case StatusFormat::Json:
+            buffer_ += written_ == 0 ? "\n    " : ",\n    ";
+            append_indented(buffer_, record.dump(4));
+            break;
+        case StatusFormat::JsonCompact:
+            if (written_ > 0) {
+                buffer_ += ',';
+            }
+            buffer_ += record.dump();
+            break;
+        case StatusFormat::Ndjson:
+            buffer_ += record.dump();
+            buffer_ += '\n';
+            break;
+        case StatusFormat::Cbor: {
+            const std::vector<uint8_t> bytes = json::to_cbor(record);
+            buffer_.append(bytes.begin(), bytes.end());
+            break;
+        }
+        case StatusFormat::MessagePack: {
+            const std::vector<uint8_t> bytes = json::to_msgpack(record);
+            buffer_.append(bytes.begin(), bytes.end());
+            break;
+        }
+    }
+    ++written_;
+    if (buffer_.size() >= kFlushSize) {
+        flush();
+    }
+}
+
+void StatusFileWriter::flush() {
+    if (!failed_ && !write_fully(fd_, buffer_.data(), buffer_.size())) {
+        failed_ = true;
+    }
+    buffer_.clear();
+}
+
+void StatusFileWriter::commit() {
+    if (format_ == StatusFormat::Json) {
+        buffer_ += written_ == 0 ? "]\n" : "\n]\n";
+    } else if (format_ == StatusFormat::JsonCompact) {
+        buffer_ += "]\n";
+    }
+    flush();
+    const int fd = std::exchange(fd_, -1);
+    if (::close(fd) != 0) {
+        failed_ = true;
+    }
+    if (failed_) {
+        throw std::runtime_error("Can't write status file " + temp_path_);
+    }
+    if (std::rename(temp_path_.c_str(), path_.c_str()) != 0) {
+        throw std::runtime_error("Can't replace status file " + path_ + ": " + std::strerror(errno));
+    }
+    committed_ = true;
+}
+
+bool read_status_file(const std::string& path, json& records) {
+    records = json::array();
+    std::ifstream file(path, std::ios::binary);
+    const std::string data{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+    size_t start = 0;
+    while (start < data.size() && std::isspace(static_cast<unsigned char>(data[start]))) {
+        ++start;
+    }
+    if (start == data.size()) {
+        return false;
+    }
+    try {
+        const auto first = static_cast<unsigned char>(data[start]);
+        if (first == '{') {
+            size_t line_start = start;
+            while (line_start < data.size()) {
+                size_t line_end = data.find('\n', line_start);
+                if (line_end == std::string::npos) {
+                    line_end = data.size();
+                }
+                if (line_end > line_start) {
+                    records.push_back(json::parse(data.substr(line_start, line_end - line_start)));
+                }
+                line_start = line_end + 1;
+            }
+        } else if (first == '[') {
+            records = json::parse(data);
+        } else if (first >= 0x80 && first <= 0x9f) {
+            records = json::from_cbor(std::vector<uint8_t>(data.begin(), data.end()));
+        } else if (first == 0xdc || first == 0xdd) {
+            records = json::from_msgpack(std::vector<uint8_t>(data.begin(), data.end()));
+        } else {
+            return false;
+        }
+    } catch (const std::exception&) {
+        records = json::array();
+        return false;
+    }
+    if (!records.is_array()) {
+        records = json::array();
+        return false;
+    }
+    return true;
+}
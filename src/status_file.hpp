@@ -0,0 +1,58 @@
+#pragma once
+
+#include "json.hpp"
+#include <string>
+
+// Encodings of the status file: an array of one object per server.
+enum class StatusFormat {
+    Json,        // indented JSON, as status.html reads it
+    JsonCompact, // JSON without whitespace
+    Ndjson,      // one JSON object per line
+    Cbor,
+    MessagePack,
+};
+
+// Looks up a "status_format" name. Returns false for an unknown one.
+bool status_format(const std::string& name, StatusFormat& format);
+
+// Creates an empty file named after path with a unique suffix, in the same directory so it can
+// be renamed over path, and sets temp_path to its name. Returns its descriptor, open for
+// writing and not inherited by commands. Throws std::runtime_error if it can't.
+int make_temp_file(const std::string& path, std::string& temp_path);
+
+// Writes all of data, however many writes it takes. Returns false with errno set if it can't.
+bool write_fully(int fd, const char *data, size_t size);
+
+// Writes the status one server at a time to a temporary file beside it, which commit() renames
+// over the status file, so a reader sees either the old file or the whole new one.
+class StatusFileWriter {
+public:
+    // count is the number of records that will be written (the binary formats start with it).
+    // Throws std::runtime_error if the temporary file can't be created.
+    StatusFileWriter(const std::string& path, StatusFormat format, size_t count);
+    ~StatusFileWriter();
+
+    StatusFileWriter(const StatusFileWriter&) = delete;
+    StatusFileWriter& operator=(const StatusFileWriter&) = delete;
+
+    void write(const nlohmann::json& record);
+
+    // Throws std::runtime_error if the file couldn't be written or replaced.
+    void commit();
+
+private:
+    void flush();
+
+    const std::string path_;
+    std::string temp_path_;
+    const StatusFormat format_;
+    int fd_;
+    std::string buffer_; // written out once it grows past a limit, and by commit()
+    size_t written_;
+    bool failed_;
+    bool committed_;
+};
+
+// Reads a status file in any of the formats, telling them apart by their first byte. Returns
+// false, leaving records empty, if there isn't a readable one.
+bool read_status_file(const std::string& path, nlohmann::json& records);
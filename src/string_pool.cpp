@@ -0,0 +1,30 @@
+#include "string_pool.hpp"
+#include <algorithm>
+
+namespace {
+    const size_t kMinPruneSize = 1024;
+}
+
+StringPool::Handle StringPool::intern(const std::string& text) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& entry = strings_[text];
+    Handle handle = entry.lock();
+    if (handle) {
+        return handle;
+    }
+    handle = std::make_shared<const std::string>(text);
+    entry = handle;
+    // Strings nobody holds any more, e.g. old command output, are dropped once the pool has
+    // doubled since the last time, which keeps the cost of pruning proportional.
+    if (strings_.size() >= std::max(prune_at_, kMinPruneSize)) {
+        for (auto iter = strings_.begin(); iter != strings_.end();) {
+            if (iter->second.expired()) {
+                iter = strings_.erase(iter);
+            } else {
+                ++iter;
+            }
+        }
+        prune_at_ = strings_.size() * 2;
+    }
+    return handle;
+}
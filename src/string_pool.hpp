@@ -0,0 +1,21 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Keeps one copy of each distinct string for as long as anything holds it, so a value that
+// many servers share, such as the same error from a whole fleet, costs each of them only a
+// pointer. Thread safe.
+class StringPool {
+public:
+    using Handle = std::shared_ptr<const std::string>;
+
+    Handle intern(const std::string& text);
+
+private:
+    std::mutex mutex_;
+    std::unordered_map<std::string, std::weak_ptr<const std::string>> strings_;
+    size_t prune_at_ = 0; // size at which released strings are dropped
+};
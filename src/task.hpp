@@ -0,0 +1,169 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+
+template <typename T = void>
+class Task;
+
+namespace task_detail {
+    // Hands control back to whoever awaited the task once it finishes, without growing the
+    // stack however long a chain of tasks completing at once is.
+    struct FinalAwaiter {
+        bool await_ready() noexcept {
+            return false;
+        }
+
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+            const auto continuation = handle.promise().continuation;
+            return continuation ? continuation : std::noop_coroutine();
+        }
+
+        void await_resume() noexcept {
+        }
+    };
+
+    struct PromiseBase {
+        std::coroutine_handle<> continuation;
+        std::exception_ptr error;
+
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+
+        FinalAwaiter final_suspend() noexcept {
+            return {};
+        }
+
+        void unhandled_exception() noexcept {
+            error = std::current_exception();
+        }
+
+        void rethrow() const {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+    };
+
+    template <typename T>
+    struct Promise : PromiseBase {
+        T value{};
+
+        Task<T> get_return_object() noexcept;
+
+        void return_value(T result) {
+            value = std::move(result);
+        }
+
+        T result() {
+            rethrow();
+            return std::move(value);
+        }
+    };
+
+    template <>
+    struct Promise<void> : PromiseBase {
+        Task<void> get_return_object() noexcept;
+
+        void return_void() noexcept {
+        }
+
+        void result() const {
+            rethrow();
+        }
+    };
+
+    // The coroutine EventLoop::spawn() wraps a task in, which runs as soon as it is called
+    // and frees itself when done.
+    struct Detached {
+        struct promise_type {
+            Detached get_return_object() noexcept {
+                return {};
+            }
+
+            std::suspend_never initial_suspend() noexcept {
+                return {};
+            }
+
+            std::suspend_never final_suspend() noexcept {
+                return {};
+            }
+
+            void return_void() noexcept {
+            }
+
+            void unhandled_exception() noexcept {
+                std::terminate();
+            }
+        };
+    };
+}
+
+// A coroutine producing a T, which starts when it is awaited and resumes its awaiter when it
+// finishes. Probes are written as tasks that co_await an EventLoop (readiness of sockets,
+// timers, lookups) and each other; EventLoop::spawn() runs the outermost one.
+template <typename T>
+class Task {
+public:
+    using promise_type = task_detail::Promise<T>;
+    using Handle = std::coroutine_handle<promise_type>;
+
+    explicit Task(Handle handle) noexcept
+        : handle_(handle)
+    {
+    }
+
+    Task(Task&& other) noexcept
+        : handle_(std::exchange(other.handle_, nullptr))
+    {
+    }
+
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            if (handle_) {
+                handle_.destroy();
+            }
+            handle_ = std::exchange(other.handle_, nullptr);
+        }
+        return *this;
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    ~Task() {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle_.promise().continuation = awaiting;
+        return handle_;
+    }
+
+    T await_resume() {
+        return handle_.promise().result();
+    }
+
+private:
+    Handle handle_;
+};
+
+namespace task_detail {
+    template <typename T>
+    Task<T> Promise<T>::get_return_object() noexcept {
+        return Task<T>(Task<T>::Handle::from_promise(*this));
+    }
+
+    inline Task<void> Promise<void>::get_return_object() noexcept {
+        return Task<void>(Task<void>::Handle::from_promise(*this));
+    }
+}
@@ -0,0 +1,222 @@
+#include "tcp.hpp"
+#include "poller.hpp"
+#include "resolver.hpp"
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <limits>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+namespace {
+    using ClockType = std::chrono::steady_clock;
+
+    // Connects race: once an address hasn't answered within the delay, the next one is tried
+    // alongside it, as in Happy Eyeballs (RFC 8305), so a blackholed address doesn't use up the
+    // whole timeout.
+    const size_t kMaxAttempts = 3;
+    static_assert(kMaxAttempts <= EventLoop::FdWait::kMaxFds, "all attempts are waited for at once");
+    const auto kFallbackDelay = std::chrono::milliseconds(250);
+
+    int64_t micros_since(ClockType::time_point start) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(ClockType::now() - start).count();
+    }
+
+    struct Socket {
+        int fd = -1;
+
+        ~Socket() {
+            close();
+        }
+
+        void close() {
+            if (fd >= 0) {
+                (void)::close(fd);
+                fd = -1;
+            }
+        }
+    };
+
+    // Starts a non-blocking connect() to the address, returning 0, EINPROGRESS or why it
+    // failed in error.
+    int start_connect(Socket& socket, ResolvedAddress addr, PortType port, ProbeError& error) {
+        const int family = addr.address.ss_family;
+        const uint16_t net_port = htons(static_cast<uint16_t>(port));
+        if (family == AF_INET) {
+            reinterpret_cast<struct ::sockaddr_in&>(addr.address).sin_port = net_port;
+        } else {
+            reinterpret_cast<struct ::sockaddr_in6&>(addr.address).sin6_port = net_port;
+        }
+        socket.fd = open_socket(family, SOCK_STREAM, 0);
+        if (socket.fd < 0) {
+            const int result = errno;
+            error.set(ErrorCode::Other, "Can't create socket: " + std::string(::strerror(result)));
+            return result;
+        }
+        if (::fcntl(socket.fd, F_SETFL, O_NONBLOCK) != 0) {
+            const int result = errno;
+            error.set(ErrorCode::Other, "Can't set to non-blocking: " + std::string(::strerror(result)));
+            socket.close();
+            return result;
+        }
+        if (::connect(socket.fd, reinterpret_cast<const struct ::sockaddr*>(&addr.address), addr.length) == 0) {
+            return 0;
+        }
+        const int result = errno;
+        if (result != EINPROGRESS) {
+            error.set(ErrorCode::Connect, "Can't connect: " + std::string(::strerror(result)));
+            socket.close();
+        }
+        return result;
+    }
+
+    // Whether the connect() the socket started has finished, either way.
+    bool connect_finished(const Socket& socket) {
+        struct ::pollfd pfd;
+        pfd.fd = socket.fd;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+        return ::poll(&pfd, 1, 0) > 0;
+    }
+
+    // Once the socket is writable, whether the connect() it started succeeded.
+    bool finish_connect(Socket& socket, ProbeError& error) {
+        int err = 0;
+        socklen_t errlen = sizeof(err);
+        if (::getsockopt(socket.fd, SOL_SOCKET, SO_ERROR, &err, &errlen) != 0) {
+            error.set(ErrorCode::Other, "getsockopt failed: " + std::string(::strerror(errno)));
+        } else if (err != 0) {
+            error.set(ErrorCode::Connect, "Socket connect error: " + std::string(::strerror(err)));
+        } else {
+            return true;
+        }
+        socket.close();
+        return false;
+    }
+}
+
+TcpMulti::TcpMulti(EventLoop& loop, Resolver& resolver)
+    : loop_(loop)
+    , resolver_(resolver)
+    , limit_(loop, std::numeric_limits<size_t>::max())
+{
+}
+
+void TcpMulti::setMaxInFlight(size_t max_in_flight) {
+    limit_.setMax(max_in_flight);
+}
+
+Task<bool> TcpMulti::connect(const ConnectParams& params, TcpInfo& info, ProbeError& error) {
+    auto phase_started = ClockType::now(); // of the lookup, the current connect(), then the TLS handshake
+    const auto timeout = std::chrono::duration_cast<ClockType::duration>(std::chrono::seconds(params.timeout));
+    const ResolvedPtr resolved = co_await Resolve(loop_, resolver_, params.host, phase_started + timeout);
+    const auto lookup_time = ClockType::now() - phase_started;
+    info.dns = micros_since(phase_started);
+    if (!resolved) {
+        error.set(ErrorCode::Timeout, "Timed out");
+        co_return false;
+    }
+    if (resolved->addresses.empty()) {
+        error.set(ErrorCode::Dns, resolved->errorMessage);
+        co_return false;
+    }
+
+    const auto slot = co_await limit_.acquire();
+    const auto deadline = ClockType::now() + (timeout - lookup_time);
+    const auto& addresses = resolved->addresses;
+    Socket socket; // the one that connected
+    Socket attempts[kMaxAttempts];
+    ClockType::time_point started[kMaxAttempts];
+    size_t next = 0; // of the addresses
+    while (socket.fd < 0) {
+        size_t pending = 0;
+        size_t idle = kMaxAttempts;
+        for (size_t i = 0; i < kMaxAttempts; ++i) {
+            if (attempts[i].fd >= 0) {
+                ++pending;
+            } else if (idle == kMaxAttempts) {
+                idle = i;
+            }
+        }
+        if (next < addresses.size() && idle < kMaxAttempts) {
+            started[idle] = ClockType::now();
+            const int result = start_connect(attempts[idle], addresses[next++], params.port, error);
+            if (result == 0) {
+                phase_started = started[idle];
+                std::swap(socket.fd, attempts[idle].fd);
+                break;
+            }
+            if (result != EINPROGRESS) {
+                continue; // on to the next address right away
+            }
+            ++pending;
+        }
+        if (pending == 0) {
+            co_return false; // every address failed
+        }
+
+        const auto wake = next < addresses.size() ? std::min(deadline, ClockType::now() + kFallbackDelay) : deadline;
+        auto ready = loop_.wait({attempts[0].fd, attempts[1].fd, attempts[2].fd}, Poller::Write, wake);
+        const int waited = co_await ready;
+        if (waited == ETIMEDOUT) {
+            if (ClockType::now() >= deadline) {
+                error.set(ErrorCode::Timeout, "Timed out");
+                co_return false;
+            }
+            continue; // time to try the next address too
+        }
+        if (waited != 0) {
+            error.set(ErrorCode::Other, "Can't poll socket: " + std::string(::strerror(waited)));
+            co_return false;
+        }
+        for (size_t i = 0; i < kMaxAttempts; ++i) {
+            if (attempts[i].fd >= 0 && connect_finished(attempts[i]) && finish_connect(attempts[i], error)) {
+                phase_started = started[i];
+                std::swap(socket.fd, attempts[i].fd);
+                break;
+            }
+        }
+    }
+    info.connect = micros_since(phase_started);
+    error = ProbeError(); // of any address tried before
+    if (!params.tls) {
+        co_return true;
+    }
+
+    phase_started = ClockType::now();
+    const std::string& server_name = params.serverName.empty() ? params.host : params.serverName;
+    // Declared after the socket, so close_notify goes out before the socket closes.
+    TlsHandshake tls(socket.fd, server_name, params.verify);
+    for (;;) {
+        unsigned events = 0;
+        switch (tls.step()) {
+            case TlsHandshake::Step::Done:
+                info.tls = micros_since(phase_started);
+                info.details = tls.details();
+                co_return true;
+            case TlsHandshake::Step::WantRead:
+                events = Poller::Read;
+                break;
+            case TlsHandshake::Step::WantWrite:
+                events = Poller::Write;
+                break;
+            case TlsHandshake::Step::Failed:
+                error.set(ErrorCode::Tls, tls.errorMessage());
+                co_return false;
+        }
+        const int waited = co_await loop_.wait(socket.fd, events, deadline);
+        if (waited == ETIMEDOUT) {
+            error.set(ErrorCode::Timeout, "Timed out");
+            co_return false;
+        }
+        if (waited != 0) {
+            error.set(ErrorCode::Other, "Can't poll socket: " + std::string(::strerror(waited)));
+            co_return false;
+        }
+    }
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "error_code.hpp"
+#include "event_loop.hpp"
+#include "task.hpp"
+#include "tls.hpp"
+#include "types.hpp"
+#include <cstdint>
+#include <string>
+
+class Resolver;
+
+struct ConnectParams {
+    std::string host;
+    PortType port;
+    TimeoutType timeout;    // for the connection and any TLS handshake together
+    bool tls = false;       // complete a TLS handshake once connected
+    std::string serverName; // sent as SNI and verified, the host if empty
+    bool verify = true;     // fail the handshake unless the certificate verifies
+};
+
+// Phase times of a connection in microseconds, negative when not measured.
+struct TcpInfo {
+    int64_t dns = -1;     // host name lookup
+    int64_t connect = -1; // TCP handshake with the address that accepted
+    int64_t tls = -1;     // TLS handshake, if any
+    TlsDetails details;   // of a completed TLS handshake
+};
+
+// Opens host:port connections as coroutines on an EventLoop, any number at once from its one
+// thread. Host names are looked up through the shared Resolver, and the addresses it returns
+// are tried in order (e.g. IPv6 then IPv4), the next one starting alongside whenever the ones
+// pending haven't answered within 250 ms, until one connects or the timeout expires. TLS
+// handshakes are then driven on the same loop.
+class TcpMulti {
+public:
+    TcpMulti(EventLoop& loop, Resolver& resolver);
+
+    TcpMulti(const TcpMulti&) = delete;
+    TcpMulti& operator=(const TcpMulti&) = delete;
+
+    // Limits how many connections are attempted at once; the rest wait for a free slot.
+    void setMaxInFlight(size_t max_in_flight);
+
+    // Completes once the result is known. The timeout covers the host name lookup and the
+    // connection, but not the wait for a free slot.
+    Task<bool> connect(const ConnectParams& params, TcpInfo& info, ProbeError& error);
+
+private:
+    EventLoop& loop_;
+    Resolver& resolver_;
+    InFlightLimit limit_;
+};
@@ -0,0 +1,34 @@
+#include "template.hpp"
+#include <algorithm>
+#include <stdexcept>
+
+Template::Template(const std::string& text, const std::vector<std::string>& names)
+    : text_(text)
+{
+    size_t literal = 0; // start of the pending literal
+    size_t pos = 0;
+    while ((pos = text_.find("{{", pos)) != std::string::npos) {
+        const size_t end = text_.find("}}", pos + 2);
+        if (end == std::string::npos) {
+            break; // unterminated, so literal text
+        }
+        const std::string name = text_.substr(pos + 2, end - pos - 2);
+        if (name.find('{') != std::string::npos) {
+            ++pos; // "{{ {{name}}": the first braces are text
+            continue;
+        }
+        const auto iter = std::find(names.begin(), names.end(), name);
+        if (iter == names.end()) {
+            throw std::runtime_error("Unknown variable {{" + name + "}}");
+        }
+        if (pos > literal) {
+            segments_.push_back(Segment{kLiteral, literal, pos - literal});
+        }
+        segments_.push_back(Segment{static_cast<size_t>(iter - names.begin()), 0, 0});
+        pos = end + 2;
+        literal = pos;
+    }
+    if (literal < text_.size()) {
+        segments_.push_back(Segment{kLiteral, literal, text_.size() - literal});
+    }
+}
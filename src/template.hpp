@@ -0,0 +1,39 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Text with {{variable}} placeholders, split once into literal and variable segments so that
+// rendering is a single pass appending to a buffer. Variables are known by their index in the
+// list of names the template was parsed with.
+class Template {
+public:
+    Template() = default;
+
+    // Throws std::runtime_error for a {{variable}} that isn't one of names.
+    Template(const std::string& text, const std::vector<std::string>& names);
+
+    // Appends the text to out, calling append(index, out) for each variable.
+    template <typename Append>
+    void render(std::string& out, const Append& append) const {
+        for (const auto& segment : segments_) {
+            if (segment.variable == kLiteral) {
+                out.append(text_, segment.offset, segment.length);
+            } else {
+                append(segment.variable, out);
+            }
+        }
+    }
+
+private:
+    static const size_t kLiteral = static_cast<size_t>(-1);
+
+    struct Segment {
+        size_t variable; // or kLiteral for text_[offset, offset + length)
+        size_t offset;
+        size_t length;
+    };
+
+    std::string text_;
+    std::vector<Segment> segments_;
+};
@@ -0,0 +1,80 @@
+#include "thread_pool.hpp"
+
+ThreadPool::ThreadPool(size_t threads)
+    : unfinished_(0)
+    , stopping_(false)
+{
+    if (threads == 0) {
+        threads = 1;
+    }
+    for (size_t i = 0; i < threads; ++i) {
+        threads_.emplace_back([this](){
+            work();
+        });
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wakeup_.notify_all();
+    for (auto& thread : threads_) {
+        thread.join();
+    }
+}
+
+void ThreadPool::post(Task task) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tasks_.push_back(std::move(task));
+        ++unfinished_;
+    }
+    wakeup_.notify_one();
+}
+
+void ThreadPool::wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_.wait(lock, [this](){
+        return unfinished_ == 0;
+    });
+    if (error_) {
+        std::exception_ptr error;
+        std::swap(error, error_);
+        std::rethrow_exception(error);
+    }
+}
+
+void ThreadPool::work() {
+    for (;;) {
+        Task task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            wakeup_.wait(lock, [this](){
+                return stopping_ || !tasks_.empty();
+            });
+            if (tasks_.empty()) {
+                return; // stopping
+            }
+            task = std::move(tasks_.front());
+            tasks_.pop_front();
+        }
+        std::exception_ptr error;
+        try {
+            task();
+        } catch (...) {
+            error = std::current_exception();
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (error && !error_) {
+                error_ = error;
+            }
+            if (--unfinished_ == 0) {
+                idle_.notify_all();
+            }
+        }
+    }
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed number of threads taking tasks from one shared queue in the order they were posted.
+class ThreadPool {
+public:
+    using Task = std::function<void()>;
+
+    explicit ThreadPool(size_t threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t size() const {
+        return threads_.size();
+    }
+
+    void post(Task task);
+
+    // Blocks until every task posted so far has finished, then rethrows the first exception
+    // any of them threw.
+    void wait();
+
+private:
+    void work();
+
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable wakeup_;
+    std::condition_variable idle_;
+    std::deque<Task> tasks_;
+    size_t unfinished_; // tasks posted but not finished
+    bool stopping_;
+    std::exception_ptr error_;
+};
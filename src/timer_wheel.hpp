@@ -0,0 +1,140 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Hierarchical timing wheel: four levels of 64 slots, each level covering 64 times the span of
+// the one below it. Scheduling and expiring are O(1); entries further out than the top level
+// covers are clamped to its horizon and simply re-cascaded, so any delay can be scheduled.
+template <typename T, typename ClockType = std::chrono::steady_clock>
+class TimerWheel {
+public:
+    using TimePoint = typename ClockType::time_point;
+    using Duration = typename ClockType::duration;
+
+    TimerWheel(TimePoint start, Duration tick)
+        : start_(start)
+        , tick_(tick)
+        , now_(0)
+    {
+    }
+
+    Duration tick() const {
+        return tick_;
+    }
+
+    // Schedules value to expire after delay, rounded up to whole ticks from the current tick.
+    void schedule(const T& value, Duration delay) {
+        uint64_t ticks = 1;
+        if (delay > tick_) {
+            ticks = static_cast<uint64_t>((delay + tick_ - Duration(1)) / tick_);
+        }
+        place(Entry{now_ + ticks, value});
+    }
+
+    // Schedules value to expire on the current tick, i.e. on the next call to advance().
+    void scheduleNow(const T& value) {
+        levels_[0][now_ & kSlotMask].push_back(Entry{now_, value});
+    }
+
+    // Moves the wheel forward to now, appending every value that expired on the way.
+    void advance(TimePoint now, std::vector<T>& expired) {
+        collect(expired); // anything scheduled for the current tick
+        const uint64_t target = now <= start_ ? 0 : static_cast<uint64_t>((now - start_) / tick_);
+        while (now_ < target) {
+            ++now_;
+            for (unsigned level = 1; level < kLevels; ++level) {
+                if (((now_ >> ((level - 1) * kSlotBits)) & kSlotMask) != 0) {
+                    break;
+                }
+                cascade(level);
+            }
+            collect(expired);
+        }
+    }
+
+    // The time of the next tick with anything scheduled on it, or the next point where a higher
+    // level cascades down, whichever comes first. Callers can sleep until then.
+    TimePoint nextExpiry() const {
+        const auto& level = levels_[0];
+        const uint64_t current = now_ & kSlotMask;
+        for (uint64_t offset = 0; offset < kSlots - current; ++offset) {
+            if (!level[current + offset].empty()) {
+                return at(now_ + offset);
+            }
+        }
+        return at((now_ | kSlotMask) + 1);
+    }
+
+    bool empty() const {
+        for (const auto& level : levels_) {
+            for (const auto& slot : level) {
+                if (!slot.empty()) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+private:
+    static const unsigned kLevels = 4;
+    static const unsigned kSlotBits = 6;
+    static const uint64_t kSlots = uint64_t(1) << kSlotBits;
+    static const uint64_t kSlotMask = kSlots - 1;
+
+    struct Entry {
+        uint64_t expires; // absolute tick
+        T value;
+    };
+
+    using Slot = std::vector<Entry>;
+    using Level = std::array<Slot, kSlots>;
+
+    TimePoint at(uint64_t tick) const {
+        return start_ + tick_ * static_cast<typename Duration::rep>(tick);
+    }
+
+    void place(Entry entry) {
+        const uint64_t horizon = uint64_t(1) << (kLevels * kSlotBits);
+        uint64_t delta = entry.expires - now_;
+        if (delta >= horizon) {
+            delta = horizon - 1; // collect() places it again when this slot comes round
+        }
+        unsigned level = 0;
+        while (level + 1 < kLevels && delta >= (uint64_t(1) << ((level + 1) * kSlotBits))) {
+            ++level;
+        }
+        const uint64_t slot = ((now_ + delta) >> (level * kSlotBits)) & kSlotMask;
+        levels_[level][slot].push_back(std::move(entry));
+    }
+
+    void cascade(unsigned level) {
+        Slot& slot = levels_[level][(now_ >> (level * kSlotBits)) & kSlotMask];
+        Slot entries;
+        entries.swap(slot);
+        for (auto& entry : entries) {
+            place(std::move(entry));
+        }
+    }
+
+    void collect(std::vector<T>& expired) {
+        Slot entries;
+        entries.swap(levels_[0][now_ & kSlotMask]);
+        for (auto& entry : entries) {
+            if (entry.expires > now_) {
+                place(std::move(entry));
+            } else {
+                expired.push_back(std::move(entry.value));
+            }
+        }
+    }
+
+    const TimePoint start_;
+    const Duration tick_;
+    uint64_t now_; // ticks since start_
+    std::array<Level, kLevels> levels_;
+};
@@ -0,0 +1,148 @@
+#include "tls.hpp"
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+
+#include <arpa/inet.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+namespace {
+    // One context for every handshake, holding the system's trusted certificates. Contexts
+    // are safe to share between threads once set up.
+    ::SSL_CTX* client_context() {
+        static ::SSL_CTX *context = []() {
+            ::SSL_CTX *context = ::SSL_CTX_new(::TLS_client_method());
+            if (context) {
+                (void)::SSL_CTX_set_default_verify_paths(context);
+            }
+            return context;
+        }();
+        return context;
+    }
+
+    bool is_ip_address(const std::string& host) {
+        unsigned char buffer[sizeof(struct ::in6_addr)];
+        return ::inet_pton(AF_INET, host.c_str(), buffer) == 1 || ::inet_pton(AF_INET6, host.c_str(), buffer) == 1;
+    }
+
+    // The oldest error on this thread's OpenSSL error queue, which is then cleared.
+    std::string ssl_error() {
+        const unsigned long error = ::ERR_get_error();
+        ::ERR_clear_error();
+        if (error == 0) {
+            return "unknown error";
+        }
+        char buffer[256];
+        ::ERR_error_string_n(error, buffer, sizeof(buffer));
+        return buffer;
+    }
+}
+
+struct TlsHandshake::Impl {
+    ::SSL *ssl = nullptr;
+    bool done = false;
+};
+
+TlsHandshake::TlsHandshake(int fd, const std::string& server_name, bool verify)
+    : impl_(new Impl)
+{
+    ::SSL_CTX *context = client_context();
+    if (!context || !(impl_->ssl = ::SSL_new(context))) {
+        errorMessage_ = "Can't start TLS: " + ssl_error();
+        return;
+    }
+    ::SSL *ssl = impl_->ssl;
+    bool ok = ::SSL_set_fd(ssl, fd) == 1;
+    const bool ip_address = is_ip_address(server_name);
+    if (ok && !ip_address && !server_name.empty()) {
+        ok = ::SSL_set_tlsext_host_name(ssl, server_name.c_str()) == 1;
+    }
+    if (ok && verify) {
+        ::X509_VERIFY_PARAM *param = ::SSL_get0_param(ssl);
+        ok = ip_address
+            ? ::X509_VERIFY_PARAM_set1_ip_asc(param, server_name.c_str()) == 1
+            : ::X509_VERIFY_PARAM_set1_host(param, server_name.c_str(), server_name.size()) == 1;
+    }
+    if (!ok) {
+        errorMessage_ = "Can't start TLS: " + ssl_error();
+        ::SSL_free(ssl);
+        impl_->ssl = nullptr;
+        return;
+    }
+    ::SSL_set_verify(ssl, verify ? SSL_VERIFY_PEER : SSL_VERIFY_NONE, nullptr);
+    ::SSL_set_connect_state(ssl);
+}
+
+TlsHandshake::~TlsHandshake()
+{
+    if (impl_->ssl) {
+        if (impl_->done) {
+            (void)::SSL_shutdown(impl_->ssl); // best effort, without waiting for the reply
+        }
+        ::SSL_free(impl_->ssl);
+        ::ERR_clear_error();
+    }
+}
+
+TlsHandshake::Step TlsHandshake::step() {
+    ::SSL *ssl = impl_->ssl;
+    if (!ssl) {
+        return Step::Failed;
+    }
+    const int result = ::SSL_do_handshake(ssl);
+    if (result == 1) {
+        impl_->done = true;
+        return Step::Done;
+    }
+    const int error = ::SSL_get_error(ssl, result);
+    switch (error) {
+        case SSL_ERROR_WANT_READ:
+            return Step::WantRead;
+        case SSL_ERROR_WANT_WRITE:
+            return Step::WantWrite;
+        case SSL_ERROR_SYSCALL:
+            if (::ERR_peek_error() == 0) {
+                errorMessage_ = "TLS handshake failed: " + std::string(errno != 0 ? ::strerror(errno) : "connection closed");
+                return Step::Failed;
+            }
+            break;
+        case SSL_ERROR_ZERO_RETURN:
+            errorMessage_ = "TLS handshake failed: connection closed";
+            return Step::Failed;
+    }
+    const long verify_result = ::SSL_get_verify_result(ssl);
+    if (verify_result != X509_V_OK) {
+        ::ERR_clear_error();
+        errorMessage_ = "TLS certificate verify failed: " + std::string(::X509_verify_cert_error_string(verify_result));
+    } else {
+        errorMessage_ = "TLS handshake failed: " + ssl_error();
+    }
+    return Step::Failed;
+}
+
+TlsDetails TlsHandshake::details() const {
+    TlsDetails details;
+    ::SSL *ssl = impl_->ssl;
+    if (!ssl || !impl_->done) {
+        return details;
+    }
+    details.protocol = ::SSL_get_version(ssl);
+    const char *cipher = ::SSL_get_cipher_name(ssl);
+    details.cipher = cipher ? cipher : "";
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    ::X509 *certificate = ::SSL_get1_peer_certificate(ssl);
+#else
+    ::X509 *certificate = ::SSL_get_peer_certificate(ssl);
+#endif
+    if (certificate) {
+        struct std::tm tm;
+        std::memset(&tm, 0, sizeof(tm));
+        if (::ASN1_TIME_to_tm(::X509_get0_notAfter(certificate), &tm) == 1) {
+            details.notAfter = static_cast<int64_t>(::timegm(&tm));
+        }
+        ::X509_free(certificate);
+    }
+    return details;
+}
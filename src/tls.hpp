@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// What a completed TLS handshake negotiated.
+struct TlsDetails {
+    std::string protocol;  // e.g. "TLSv1.3"
+    std::string cipher;
+    int64_t notAfter = 0;  // when the server's certificate expires, as a Unix time; 0 if unknown
+};
+
+// A client TLS handshake over a connected non-blocking socket, advanced a step at a time
+// whenever the socket is ready, so one thread can drive any number of them.
+class TlsHandshake {
+public:
+    enum class Step {
+        Done,
+        WantRead,
+        WantWrite,
+        Failed,
+    };
+
+    // Sends server_name as SNI and, with verify, fails unless the certificate chain verifies
+    // and matches it. server_name may be an IP address, which is then matched but not sent.
+    TlsHandshake(int fd, const std::string& server_name, bool verify);
+
+    // Sends close_notify if the handshake completed; the socket is left open.
+    ~TlsHandshake();
+
+    TlsHandshake(const TlsHandshake&) = delete;
+    TlsHandshake& operator=(const TlsHandshake&) = delete;
+
+    Step step();
+
+    // Once step() returned Failed.
+    const std::string& errorMessage() const {
+        return errorMessage_;
+    }
+
+    // Once step() returned Done.
+    TlsDetails details() const;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl_;
+    std::string errorMessage_;
+};
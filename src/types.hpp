@@ -3,3 +3,4 @@
 using TimeoutType = unsigned;
 using DurationType = unsigned;
 using PortType = unsigned;
+using IntervalType = unsigned;